@@ -20,7 +20,7 @@
 
 #define SUPPORT_PCRE8 1
 /* #undef SUPPORT_PCRE16 */
-/* #undef SUPPORT_JIT */
+#define SUPPORT_JIT 1
 #define SUPPORT_PCREGREP_JIT 1
 /* #undef SUPPORT_UTF */
 /* #undef SUPPORT_UCP */
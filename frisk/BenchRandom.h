@@ -0,0 +1,33 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef BENCHRANDOM_H
+#define BENCHRANDOM_H
+
+// xorshift32, so benchmark inputs don't depend on whatever rand() the C library has
+class BenchRandom
+{
+public:
+    BenchRandom(unsigned int seed) : state_(seed ? seed : 1) {}
+
+    unsigned int next()
+    {
+        state_ ^= (state_ << 13) & 0xffffffff;
+        state_ ^= state_ >> 17;
+        state_ ^= (state_ << 5) & 0xffffffff;
+        state_ &= 0xffffffff;
+        return state_;
+    }
+
+    int range(int count) { return (int)(next() % (unsigned int)count); } // [0, count)
+    bool chance(int percent) { return range(100) < percent; }
+
+protected:
+    unsigned int state_;
+};
+
+#endif
@@ -0,0 +1,486 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "DirectoryManifest.h"
+#include "MappedFile.h"
+#include "TrigramIndex.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#define DIRECTORY_MANIFEST_VERSION (1)
+
+// A directory modified this close to when its manifest was written could have changed again
+// within the same timestamp tick, after it was listed. Those are always listed again.
+#define RACY_SECONDS (2)
+
+// On disk layout, in native byte order: header, directories (sorted by name), entries, names.
+// Directory names are relative to the root, and the root itself is "".
+struct DirectoryManifestHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int directoryCount;
+    s64 entryCount;
+    s64 directoriesOffset;
+    s64 entriesOffset;
+    s64 namesOffset;
+    s64 namesSize;
+};
+
+struct DirectoryManifestDirectory
+{
+    s64 nameOffset;
+    s64 modified;
+    s64 firstEntry;
+    s64 entryCount;
+};
+
+enum DirectoryManifestEntryFlag
+{
+    DMF_DIRECTORY = (1 << 0)
+};
+
+struct DirectoryManifestEntry
+{
+    s64 nameOffset;
+    s64 size;
+    s64 modified;
+    unsigned int flags;
+    unsigned int reserved;
+};
+
+static const char manifestMagic[8] = { 'F', 'R', 'I', 'S', 'K', 'M', 'A', 'N' };
+
+// One directory visited during this walk
+struct DirectoryManifestListing
+{
+    std::string name;
+    s64 modified;
+    int cached;                 // index into the loaded manifest's directories, or -1
+    DirectoryEntryList entries; // when not cached
+};
+
+static bool listingNameLess(const DirectoryManifestListing &a, const DirectoryManifestListing &b)
+{
+    return a.name < b.name;
+}
+
+static bool listingNameEqual(const DirectoryManifestListing &a, const DirectoryManifestListing &b)
+{
+    return a.name == b.name;
+}
+
+// Writing these touches the root's timestamp, so they're left out of its listing; otherwise the
+// root would look different every time and the manifest would get rewritten after every search
+static bool isOwnFile(const std::string &name)
+{
+    return (name == DIRECTORY_MANIFEST_FILENAME)
+        || (name == DIRECTORY_MANIFEST_FILENAME ".tmp")
+        || (name == TRIGRAM_INDEX_FILENAME)
+        || (name == TRIGRAM_INDEX_FILENAME ".tmp");
+}
+
+static bool sectionFits(s64 offset, s64 size, size_t fileSize)
+{
+    return (offset >= 0) && (size >= 0) && (offset <= (s64)fileSize) && (size <= ((s64)fileSize - offset));
+}
+
+// ------------------------------------------------------------------------------------------------
+
+struct DirectoryManifestRoot
+{
+    DirectoryManifestRoot(const std::string &root, bool create);
+
+    bool load();
+    void unload();
+    int findDirectory(const char *name) const;
+    bool readListing(int index, DirectoryEntryList &entries) const;
+    bool sameListing(int index, const DirectoryEntryList &entries) const;
+    bool write();
+
+    s64 entryCount(const DirectoryManifestListing &listing) const;
+    void entryAt(const DirectoryManifestListing &listing, s64 i, const char *&name, DirectoryManifestEntry &record) const;
+
+    std::string path;
+    std::string prefix;
+    std::string filename;
+    bool create;
+
+    MappedFile file;
+    const DirectoryManifestHeader *header;
+    const DirectoryManifestDirectory *directories;
+    const DirectoryManifestEntry *entries;
+    const char *names;
+    s64 racyAfter; // directories modified at or after this get listed regardless
+
+    PlatformMutex mutex;
+    std::vector<DirectoryManifestListing> listings;
+    bool changed;
+};
+
+DirectoryManifestRoot::DirectoryManifestRoot(const std::string &root, bool create)
+: path(root)
+, prefix(joinPath(root, ""))
+, filename(joinPath(root, DIRECTORY_MANIFEST_FILENAME))
+, create(create)
+, header(NULL)
+, directories(NULL)
+, entries(NULL)
+, names(NULL)
+, racyAfter(0)
+, changed(false)
+{
+}
+
+bool DirectoryManifestRoot::load()
+{
+    DirectoryEntry info;
+    if(!statPath(filename, info) || !file.open(filename, 0))
+        return false;
+
+    const char *data = file.data();
+    size_t size = file.size();
+    const DirectoryManifestHeader *h = (const DirectoryManifestHeader *)data;
+    if((size < sizeof(DirectoryManifestHeader))
+    || memcmp(h->magic, manifestMagic, sizeof(manifestMagic))
+    || (h->version != DIRECTORY_MANIFEST_VERSION)
+    || (h->entryCount < 0)
+    || (h->entryCount > ((s64)size / (s64)sizeof(DirectoryManifestEntry)))
+    || !sectionFits(h->directoriesOffset, (s64)h->directoryCount * sizeof(DirectoryManifestDirectory), size)
+    || !sectionFits(h->entriesOffset, h->entryCount * sizeof(DirectoryManifestEntry), size)
+    || !sectionFits(h->namesOffset, h->namesSize, size)
+    || !h->namesSize
+    || data[h->namesOffset + h->namesSize - 1])
+    {
+        file.close();
+        return false;
+    }
+
+    header = h;
+    directories = (const DirectoryManifestDirectory *)(data + h->directoriesOffset);
+    entries = (const DirectoryManifestEntry *)(data + h->entriesOffset);
+    names = data + h->namesOffset;
+    racyAfter = info.modified - (RACY_SECONDS * MODIFIED_TICKS_PER_SECOND);
+    return true;
+}
+
+void DirectoryManifestRoot::unload()
+{
+    file.close();
+    header = NULL;
+    directories = NULL;
+    entries = NULL;
+    names = NULL;
+}
+
+int DirectoryManifestRoot::findDirectory(const char *name) const
+{
+    if(!header)
+        return -1;
+
+    unsigned int low = 0;
+    unsigned int high = header->directoryCount;
+    while(low < high)
+    {
+        unsigned int middle = low + ((high - low) / 2);
+        s64 nameOffset = directories[middle].nameOffset;
+        if((nameOffset < 0) || (nameOffset >= header->namesSize))
+            return -1;
+
+        int cmp = strcmp(names + nameOffset, name);
+        if(cmp == 0)
+            return (int)middle;
+        if(cmp < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return -1;
+}
+
+bool DirectoryManifestRoot::readListing(int index, DirectoryEntryList &list) const
+{
+    const DirectoryManifestDirectory &directory = directories[index];
+    if((directory.firstEntry < 0) || (directory.entryCount < 0) || (directory.entryCount > (header->entryCount - directory.firstEntry)))
+        return false;
+
+    list.resize((size_t)directory.entryCount);
+    for(s64 i = 0; i < directory.entryCount; ++i)
+    {
+        const DirectoryManifestEntry &record = entries[directory.firstEntry + i];
+        if((record.nameOffset < 0) || (record.nameOffset >= header->namesSize))
+            return false;
+
+        DirectoryEntry &entry = list[(size_t)i];
+        entry.name = names + record.nameOffset;
+        entry.path.clear();
+        entry.size = record.size;
+        entry.modified = record.modified;
+        entry.isDirectory = ((record.flags & DMF_DIRECTORY) != 0);
+        entry.fromManifest = true;
+    }
+    return true;
+}
+
+bool DirectoryManifestRoot::sameListing(int index, const DirectoryEntryList &list) const
+{
+    const DirectoryManifestDirectory &directory = directories[index];
+    if((directory.entryCount != (s64)list.size()) || (directory.firstEntry < 0) || (directory.entryCount > (header->entryCount - directory.firstEntry)))
+        return false;
+
+    for(s64 i = 0; i < directory.entryCount; ++i)
+    {
+        const DirectoryManifestEntry &record = entries[directory.firstEntry + i];
+        const DirectoryEntry &entry = list[(size_t)i];
+        if((record.nameOffset < 0) || (record.nameOffset >= header->namesSize)
+        || (record.size != entry.size)
+        || (record.modified != entry.modified)
+        || (((record.flags & DMF_DIRECTORY) != 0) != entry.isDirectory)
+        || strcmp(names + record.nameOffset, entry.name.c_str()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+s64 DirectoryManifestRoot::entryCount(const DirectoryManifestListing &listing) const
+{
+    if(listing.cached >= 0)
+        return directories[listing.cached].entryCount;
+    return (s64)listing.entries.size();
+}
+
+void DirectoryManifestRoot::entryAt(const DirectoryManifestListing &listing, s64 i, const char *&name, DirectoryManifestEntry &record) const
+{
+    if(listing.cached >= 0)
+    {
+        record = entries[directories[listing.cached].firstEntry + i];
+        name = names + record.nameOffset;
+        return;
+    }
+
+    const DirectoryEntry &entry = listing.entries[(size_t)i];
+    memset(&record, 0, sizeof(record));
+    record.size = entry.size;
+    record.modified = entry.modified;
+    record.flags = entry.isDirectory ? DMF_DIRECTORY : 0;
+    name = entry.name.c_str();
+}
+
+bool DirectoryManifestRoot::write()
+{
+    std::sort(listings.begin(), listings.end(), listingNameLess);
+    listings.erase(std::unique(listings.begin(), listings.end(), listingNameEqual), listings.end());
+
+    // Sizes first, so every section's offset is known up front
+    DirectoryManifestHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, manifestMagic, sizeof(manifestMagic));
+    h.version = DIRECTORY_MANIFEST_VERSION;
+    h.directoryCount = (unsigned int)listings.size();
+    for(std::vector<DirectoryManifestListing>::const_iterator it = listings.begin(); it != listings.end(); ++it)
+    {
+        h.namesSize += it->name.length() + 1;
+        s64 count = entryCount(*it);
+        for(s64 i = 0; i < count; ++i)
+        {
+            const char *name;
+            DirectoryManifestEntry record;
+            entryAt(*it, i, name, record);
+            h.namesSize += strlen(name) + 1;
+        }
+        h.entryCount += count;
+    }
+    h.directoriesOffset = sizeof(h);
+    h.entriesOffset = h.directoriesOffset + (s64)listings.size() * sizeof(DirectoryManifestDirectory);
+    h.namesOffset = h.entriesOffset + h.entryCount * sizeof(DirectoryManifestEntry);
+
+    std::string tempFilename = filename + ".tmp";
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if(!f)
+        return false;
+
+    bool ok = (fwrite(&h, sizeof(h), 1, f) == 1);
+
+    // Directory names come first in the names section, then every entry's name in order
+    s64 nameOffset = 0;
+    s64 firstEntry = 0;
+    for(std::vector<DirectoryManifestListing>::const_iterator it = listings.begin(); ok && (it != listings.end()); ++it)
+    {
+        DirectoryManifestDirectory record;
+        record.nameOffset = nameOffset;
+        record.modified = it->modified;
+        record.firstEntry = firstEntry;
+        record.entryCount = entryCount(*it);
+        nameOffset += it->name.length() + 1;
+        firstEntry += record.entryCount;
+        ok = (fwrite(&record, sizeof(record), 1, f) == 1);
+    }
+    for(std::vector<DirectoryManifestListing>::const_iterator it = listings.begin(); ok && (it != listings.end()); ++it)
+    {
+        s64 count = entryCount(*it);
+        for(s64 i = 0; ok && (i < count); ++i)
+        {
+            const char *name;
+            DirectoryManifestEntry record;
+            entryAt(*it, i, name, record);
+            record.nameOffset = nameOffset;
+            nameOffset += strlen(name) + 1;
+            ok = (fwrite(&record, sizeof(record), 1, f) == 1);
+        }
+    }
+    for(std::vector<DirectoryManifestListing>::const_iterator it = listings.begin(); ok && (it != listings.end()); ++it)
+    {
+        ok = (fwrite(it->name.c_str(), 1, it->name.length() + 1, f) == (it->name.length() + 1));
+    }
+    for(std::vector<DirectoryManifestListing>::const_iterator it = listings.begin(); ok && (it != listings.end()); ++it)
+    {
+        s64 count = entryCount(*it);
+        for(s64 i = 0; ok && (i < count); ++i)
+        {
+            const char *name;
+            DirectoryManifestEntry record;
+            entryAt(*it, i, name, record);
+            size_t length = strlen(name) + 1;
+            ok = (fwrite(name, 1, length, f) == length);
+        }
+    }
+    if(fclose(f) != 0)
+        ok = false;
+
+    // The old manifest has to let go before it can be replaced (on Windows, anyway)
+    listings.clear();
+    unload();
+    if(!ok || !platformReplaceFile(tempFilename, filename))
+    {
+        remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+DirectoryManifest::DirectoryManifest()
+{
+}
+
+DirectoryManifest::~DirectoryManifest()
+{
+    close();
+}
+
+void DirectoryManifest::open(const StringList &roots, bool create)
+{
+    close();
+    for(StringList::const_iterator it = roots.begin(); it != roots.end(); ++it)
+    {
+        DirectoryManifestRoot *root = new DirectoryManifestRoot(*it, create);
+        if(root->load() || create)
+            roots_.push_back(root);
+        else
+            delete root;
+    }
+}
+
+void DirectoryManifest::close()
+{
+    for(std::vector<DirectoryManifestRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        delete *it;
+    }
+    roots_.clear();
+}
+
+DirectoryManifestRoot *DirectoryManifest::findRoot(const std::string &path)
+{
+    for(std::vector<DirectoryManifestRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        DirectoryManifestRoot *root = *it;
+        if((path == root->path) || !path.compare(0, root->prefix.length(), root->prefix))
+            return root;
+    }
+    return NULL;
+}
+
+bool DirectoryManifest::list(const std::string &path, DirectoryEntryList &entries, bool &cached)
+{
+    cached = false;
+
+    // Taken before listing, so anything that changes while listing shows up next time
+    DirectoryEntry info;
+    DirectoryManifestRoot *root = findRoot(path);
+    if(!root || !statPath(path, info) || !info.isDirectory)
+        return listDirectory(path, entries);
+
+    DirectoryManifestListing listing;
+    listing.name = (path.length() > root->prefix.length()) ? path.substr(root->prefix.length()) : "";
+    listing.modified = info.modified;
+    listing.cached = root->findDirectory(listing.name.c_str());
+    if((listing.cached >= 0)
+    && (root->directories[listing.cached].modified == info.modified)
+    && (info.modified < root->racyAfter)
+    && root->readListing(listing.cached, entries))
+    {
+        cached = true;
+    }
+    else
+    {
+        if(!listDirectory(path, entries))
+            return false;
+        if(listing.name.empty())
+        {
+            size_t kept = 0;
+            for(size_t i = 0; i < entries.size(); ++i)
+            {
+                if(isOwnFile(entries[i].name))
+                    continue;
+                if(kept != i)
+                    entries[kept].swap(entries[i]);
+                kept++;
+            }
+            entries.resize(kept);
+        }
+
+        // Touched, but nothing actually came or went (or it was just too recent to trust)
+        if((listing.cached < 0) || !root->sameListing(listing.cached, entries))
+        {
+            listing.cached = -1;
+            listing.entries = entries;
+        }
+    }
+
+    PlatformScopedLock lock(root->mutex);
+    root->listings.push_back(DirectoryManifestListing());
+    root->listings.back().name.swap(listing.name);
+    root->listings.back().modified = listing.modified;
+    root->listings.back().cached = listing.cached;
+    root->listings.back().entries.swap(listing.entries);
+    if(listing.cached < 0)
+        root->changed = true;
+    return true;
+}
+
+void DirectoryManifest::save()
+{
+    for(std::vector<DirectoryManifestRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        DirectoryManifestRoot *root = *it;
+
+        // Nothing listed fresh, and nothing gone missing either
+        if(root->header && !root->changed && (root->listings.size() == root->header->directoryCount))
+            continue;
+        if(root->listings.empty())
+            continue;
+
+        root->write();
+        root->changed = false;
+    }
+}
@@ -0,0 +1,54 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef DIRECTORYMANIFEST_H
+#define DIRECTORYMANIFEST_H
+
+#include "DirectoryWalker.h"
+
+// Lives in the root it covers, next to any .friskindex
+#define DIRECTORY_MANIFEST_FILENAME ".friskmanifest"
+
+struct DirectoryManifestRoot;
+
+// Remembers every directory listing under a set of roots, along with each directory's own
+// timestamp, in a memory mapped .friskmanifest per root. Directories whose timestamp hasn't moved
+// since are served out of the manifest instead of being listed again, so walking a mostly
+// unchanged tree costs one stat per directory instead of a full listing.
+//
+// A directory's timestamp only moves when entries are added, removed or renamed; the sizes and
+// timestamps of files in a cached listing can be out of date (see DirectoryEntry::fromManifest).
+class DirectoryManifest
+{
+public:
+    DirectoryManifest();
+    ~DirectoryManifest();
+
+    // Loads whatever manifests the roots already have. With create set, roots without one get one
+    // on save().
+    void open(const StringList &roots, bool create);
+    void close();
+
+    // Same as listDirectory(), for any path. Thread safe. cached is set when the listing came out
+    // of a manifest.
+    bool list(const std::string &path, DirectoryEntryList &entries, bool &cached);
+
+    // Rewrites every manifest that's out of date. Only call this after a complete recursive walk,
+    // or directories that weren't visited are forgotten.
+    void save();
+
+protected:
+    DirectoryManifestRoot *findRoot(const std::string &path);
+
+    std::vector<DirectoryManifestRoot *> roots_;
+
+private:
+    DirectoryManifest(const DirectoryManifest &);
+    DirectoryManifest &operator=(const DirectoryManifest &);
+};
+
+#endif
@@ -0,0 +1,494 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "DirectoryWalker.h"
+#include "DirectoryManifest.h"
+#include "FilespecMatcher.h"
+#include "SearchTrace.h"
+
+#include <algorithm>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+// Directories sitting in the stealable deques, across all walkers. Past this, a walker keeps
+// newly found directories to itself until it catches up.
+#define MAX_FRONTIER_PER_THREAD (4096)
+
+// Files found but not yet taken by next(). Walkers stall when it fills up.
+#define MAX_OUTPUT_ENTRIES (8192)
+
+// ------------------------------------------------------------------------------------------------
+
+DirectoryEntry::DirectoryEntry()
+: size(0)
+, modified(0)
+, isDirectory(false)
+, fromManifest(false)
+{
+}
+
+void DirectoryEntry::swap(DirectoryEntry &other)
+{
+    name.swap(other.name);
+    path.swap(other.path);
+    std::swap(size, other.size);
+    std::swap(modified, other.modified);
+    std::swap(isDirectory, other.isDirectory);
+    std::swap(fromManifest, other.fromManifest);
+}
+
+std::string joinPath(const std::string &directory, const std::string &name)
+{
+    std::string path = directory;
+    if(!path.length() || (path[path.length() - 1] != PLATFORM_PATH_SEPARATOR))
+    {
+        path += PLATFORM_PATH_SEPARATOR;
+    }
+    path += name;
+    return path;
+}
+
+#ifdef _WIN32
+
+bool listDirectory(const std::string &path, DirectoryEntryList &entries)
+{
+    entries.clear();
+
+    std::string wildcard = joinPath(path, "*");
+    WIN32_FIND_DATA wfd;
+    HANDLE findHandle = FindFirstFile(wildcard.c_str(), &wfd);
+    if(findHandle == INVALID_HANDLE_VALUE)
+        return false;
+
+    do
+    {
+        if(!strcmp(wfd.cFileName, ".") || !strcmp(wfd.cFileName, ".."))
+            continue;
+
+        entries.push_back(DirectoryEntry());
+        DirectoryEntry &entry = entries.back();
+        entry.name = wfd.cFileName;
+        entry.isDirectory = ((wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+        entry.size = ((s64)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow;
+        entry.modified = ((s64)wfd.ftLastWriteTime.dwHighDateTime << 32) | wfd.ftLastWriteTime.dwLowDateTime;
+    }
+    while(FindNextFile(findHandle, &wfd));
+
+    FindClose(findHandle);
+    return true;
+}
+
+bool statPath(const std::string &path, DirectoryEntry &entry)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if(!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+
+    entry.isDirectory = ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+    entry.size = ((s64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    entry.modified = ((s64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+#else
+
+bool listDirectory(const std::string &path, DirectoryEntryList &entries)
+{
+    entries.clear();
+
+    DIR *dir = opendir(path.c_str());
+    if(!dir)
+        return false;
+
+    int fd = dirfd(dir);
+    struct dirent *de;
+    while((de = readdir(dir)) != NULL)
+    {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        DirectoryEntry entry;
+        entry.name = de->d_name;
+        if(de->d_name[0] == '.')
+        {
+            // Skipped by the walker anyway, don't bother stat'ing it
+            entry.isDirectory = (de->d_type == DT_DIR);
+            entries.push_back(entry);
+            continue;
+        }
+
+        struct stat st;
+        if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if(S_ISLNK(st.st_mode))
+        {
+            // Follow links to files, but never links to directories (cycles)
+            if((fstatat(fd, de->d_name, &st, 0) != 0) || S_ISDIR(st.st_mode))
+                continue;
+        }
+
+        // FIFOs, sockets and devices have no business being searched
+        if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            continue;
+
+        entry.isDirectory = S_ISDIR(st.st_mode);
+        entry.size = (s64)st.st_size;
+        entry.modified = ((s64)st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec;
+        entries.push_back(entry);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+bool statPath(const std::string &path, DirectoryEntry &entry)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+        return false;
+
+    entry.isDirectory = S_ISDIR(st.st_mode);
+    entry.size = (s64)st.st_size;
+    entry.modified = ((s64)st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec;
+    return true;
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+struct DirectoryWalkerThread
+{
+    DirectoryWalker *walker;
+    int index;
+    PlatformThread thread;
+    PlatformMutex mutex;
+    std::deque<std::string> frontier; // owner pops the back, thieves take the front
+};
+
+static void staticWalkerProc(void *param)
+{
+    DirectoryWalkerThread *thread = (DirectoryWalkerThread *)param;
+    thread->walker->walkerProc(thread);
+}
+
+DirectoryWalker::DirectoryWalker(const StringList &paths, bool recursive, int threadCount, const FilespecMatcher *filespecs, DirectoryManifest *manifest, SearchTrace *trace)
+: recursive_(recursive)
+, filespecs_(filespecs)
+, manifest_(manifest)
+, trace_(trace)
+, stop_(0)
+, listSeconds_(0)
+, filterSeconds_(0)
+, callerTrace_(NULL)
+, listingPos_(0)
+, pendingDirectories_(0)
+, frontierSize_(0)
+{
+    stats_.directoriesListed = 0;
+    stats_.directoriesCached = 0;
+    stats_.directoriesSkipped = 0;
+    stats_.filesSkipped = 0;
+
+    if(threadCount <= 1)
+    {
+        // next() does all the listing, on whatever thread this is
+        if(trace_)
+            callerTrace_ = trace_->createBuffer("search");
+        stack_ = paths;
+        return;
+    }
+
+    for(int i = 0; i < threadCount; ++i)
+    {
+        DirectoryWalkerThread *thread = new DirectoryWalkerThread;
+        thread->walker = this;
+        thread->index = i;
+        threads_.push_back(thread);
+    }
+
+    // Deal the roots out before anyone starts, so nobody decides there's nothing to do
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        threads_[i % threadCount]->frontier.push_back(paths[i]);
+        pendingDirectories_++;
+        frontierSize_++;
+    }
+
+    for(int i = 0; i < threadCount; ++i)
+    {
+        threads_[i]->thread.start(staticWalkerProc, threads_[i]);
+    }
+}
+
+DirectoryWalker::~DirectoryWalker()
+{
+    stop();
+    for(std::vector<DirectoryWalkerThread *>::iterator it = threads_.begin(); it != threads_.end(); ++it)
+    {
+        (*it)->thread.join();
+        delete *it;
+    }
+}
+
+void DirectoryWalker::stop()
+{
+    stop_ = 1;
+}
+
+DirectoryWalkerStats DirectoryWalker::stats()
+{
+    return stats_;
+}
+
+void DirectoryWalker::times(double &listSeconds, double &filterSeconds)
+{
+    PlatformScopedLock lock(timesMutex_);
+    listSeconds = listSeconds_;
+    filterSeconds = filterSeconds_;
+}
+
+void DirectoryWalker::addTime(double &phase, double seconds)
+{
+    PlatformScopedLock lock(timesMutex_);
+    phase += seconds;
+}
+
+bool DirectoryWalker::list(const std::string &path, DirectoryEntryList &listing, TraceBuffer *trace)
+{
+    TraceSpan span(trace, "list", path);
+    double start = platformSeconds();
+    bool listed;
+    if(!manifest_)
+    {
+        listed = listDirectory(path, listing);
+    }
+    else
+    {
+        bool cached = false;
+        listed = manifest_->list(path, listing, cached);
+        if(listed && cached)
+            platformAtomicIncrement(&stats_.directoriesCached);
+    }
+    addTime(listSeconds_, platformSeconds() - start);
+    return listed;
+}
+
+void DirectoryWalker::processListing(const std::string &path, DirectoryEntryList &listing, StringList &subdirectories)
+{
+    double start = platformSeconds();
+
+    // Filters the listing down to the files worth handing out, and pulls out subdirectories
+    size_t fileCount = 0;
+    for(size_t i = 0; i < listing.size(); ++i)
+    {
+        DirectoryEntry &entry = listing[i];
+        if((entry.name[0] == '.') || (entry.name[0] == 0))
+        {
+            if(entry.isDirectory)
+                platformAtomicIncrement(&stats_.directoriesSkipped);
+            else
+                platformAtomicIncrement(&stats_.filesSkipped);
+            continue;
+        }
+
+        if(entry.isDirectory)
+        {
+            if(recursive_)
+                subdirectories.push_back(joinPath(path, entry.name));
+            continue;
+        }
+
+        if(filespecs_ && !filespecs_->matches(path, entry.name))
+        {
+            platformAtomicIncrement(&stats_.filesSkipped);
+            continue;
+        }
+
+        entry.path = joinPath(path, entry.name);
+        if(fileCount != i)
+            listing[fileCount].swap(entry);
+        fileCount++;
+    }
+    listing.resize(fileCount);
+    addTime(filterSeconds_, platformSeconds() - start);
+}
+
+DirectoryWalker::State DirectoryWalker::next(DirectoryEntry &entry)
+{
+    if(threads_.empty())
+    {
+        while(!stop_)
+        {
+            if(listingPos_ < listing_.size())
+            {
+                entry.swap(listing_[listingPos_++]);
+                return WALK_FILE;
+            }
+
+            if(stack_.empty())
+                return WALK_DONE;
+
+            std::string path = stack_.back();
+            stack_.pop_back();
+
+            platformAtomicIncrement(&stats_.directoriesListed);
+            listingPos_ = 0;
+            if(!list(path, listing_, callerTrace_))
+                continue;
+
+            StringList subdirectories;
+            processListing(path, listing_, subdirectories);
+            stack_.insert(stack_.end(), subdirectories.begin(), subdirectories.end());
+        }
+        return WALK_DONE;
+    }
+
+    if(stop_)
+        return WALK_DONE;
+
+    // Read pending before looking at the output. Walkers publish their files before they stop
+    // counting a directory as pending, so seeing zero here means nothing else can show up.
+    int pending = platformAtomicAdd(&pendingDirectories_, 0);
+    {
+        PlatformScopedLock lock(outputMutex_);
+        if(!output_.empty())
+        {
+            entry.swap(output_.front());
+            output_.pop_front();
+            outputSpace_.signal();
+            return WALK_FILE;
+        }
+    }
+    if(!pending)
+        return WALK_DONE;
+
+    outputReady_.wait(100);
+    return WALK_WAITING;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Parallel walking
+
+bool DirectoryWalker::takeDirectory(DirectoryWalkerThread *thread, std::string &path)
+{
+    {
+        PlatformScopedLock lock(thread->mutex);
+        if(!thread->frontier.empty())
+        {
+            path = thread->frontier.back();
+            thread->frontier.pop_back();
+            platformAtomicDecrement(&frontierSize_);
+            return true;
+        }
+    }
+
+    // Steal the oldest directory from someone else; those tend to have the most under them
+    int count = (int)threads_.size();
+    for(int i = 1; i < count; ++i)
+    {
+        DirectoryWalkerThread *victim = threads_[(thread->index + i) % count];
+        PlatformScopedLock lock(victim->mutex);
+        if(!victim->frontier.empty())
+        {
+            path = victim->frontier.front();
+            victim->frontier.pop_front();
+            platformAtomicDecrement(&frontierSize_);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DirectoryWalker::queueDirectory(DirectoryWalkerThread *thread, const std::string &path, StringList &privateStack)
+{
+    platformAtomicIncrement(&pendingDirectories_);
+
+    int maxFrontier = MAX_FRONTIER_PER_THREAD * (int)threads_.size();
+    if(frontierSize_ < maxFrontier)
+    {
+        {
+            PlatformScopedLock lock(thread->mutex);
+            thread->frontier.push_back(path);
+        }
+        platformAtomicIncrement(&frontierSize_);
+        workReady_.signal();
+    }
+    else
+    {
+        privateStack.push_back(path);
+    }
+}
+
+void DirectoryWalker::pushOutput(DirectoryEntry &entry)
+{
+    outputMutex_.lock();
+    while(!stop_ && (output_.size() >= MAX_OUTPUT_ENTRIES))
+    {
+        outputMutex_.unlock();
+        outputSpace_.wait(10);
+        outputMutex_.lock();
+    }
+    output_.push_back(DirectoryEntry());
+    output_.back().swap(entry);
+    outputMutex_.unlock();
+
+    outputReady_.signal();
+}
+
+void DirectoryWalker::walkerProc(DirectoryWalkerThread *thread)
+{
+    StringList privateStack;
+    DirectoryEntryList listing;
+    StringList subdirectories;
+    TraceBuffer *trace = trace_ ? trace_->createBuffer("walker") : NULL;
+
+    while(!stop_)
+    {
+        std::string path;
+        if(!privateStack.empty())
+        {
+            path = privateStack.back();
+            privateStack.pop_back();
+        }
+        else if(!takeDirectory(thread, path))
+        {
+            if(!platformAtomicAdd(&pendingDirectories_, 0))
+                break;
+
+            // Someone else is still listing; they may hand us something
+            workReady_.wait(10);
+            continue;
+        }
+
+        platformAtomicIncrement(&stats_.directoriesListed);
+        if(list(path, listing, trace))
+        {
+            subdirectories.clear();
+            processListing(path, listing, subdirectories);
+            for(DirectoryEntryList::iterator it = listing.begin(); it != listing.end() && !stop_; ++it)
+            {
+                pushOutput(*it);
+            }
+            for(StringList::iterator it = subdirectories.begin(); it != subdirectories.end(); ++it)
+            {
+                queueDirectory(thread, *it, privateStack);
+            }
+        }
+
+        platformAtomicDecrement(&pendingDirectories_);
+    }
+
+    // Wake everybody up so they notice we're finished
+    workReady_.signal();
+    outputReady_.signal();
+}
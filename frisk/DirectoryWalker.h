@@ -0,0 +1,127 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef DIRECTORYWALKER_H
+#define DIRECTORYWALKER_H
+
+#include "Platform.h"
+#include "SearchConfig.h"
+
+struct DirectoryEntry
+{
+    DirectoryEntry();
+    void swap(DirectoryEntry &other);
+
+    std::string name;
+    std::string path;  // only filled in for entries handed out by DirectoryWalker::next()
+    s64 size;
+    s64 modified;      // opaque timestamp, only good for comparing against itself
+    bool isDirectory;
+    bool fromManifest; // listing came out of a DirectoryManifest; size and modified may be stale
+};
+
+typedef std::vector<DirectoryEntry> DirectoryEntryList;
+
+// Lists everything in a directory except "." and "..". Returns false if it can't be opened.
+bool listDirectory(const std::string &path, DirectoryEntryList &entries);
+std::string joinPath(const std::string &directory, const std::string &name);
+
+// Fills in size, modified and isDirectory for a single path (following links). Returns false if
+// it isn't there.
+bool statPath(const std::string &path, DirectoryEntry &entry);
+
+// DirectoryEntry::modified ticks per second
+#ifdef _WIN32
+#define MODIFIED_TICKS_PER_SECOND (10000000LL)
+#else
+#define MODIFIED_TICKS_PER_SECOND (1000000000LL)
+#endif
+
+struct DirectoryWalkerStats
+{
+    int directoriesListed;
+    int directoriesCached; // of those listed, the ones served from a DirectoryManifest
+    int directoriesSkipped;
+    int filesSkipped;
+};
+
+struct DirectoryWalkerThread;
+class DirectoryManifest;
+class FilespecMatcher;
+class SearchTrace;
+struct TraceBuffer;
+
+// Hands out every file under a set of root paths, skipping dot-prefixed entries.
+//
+// With a single thread, directories are listed lazily on the caller's thread from inside next(),
+// in the same depth-first order frisk has always used. With more threads, a pool of walkers lists
+// directories concurrently (each walker owns a deque of pending directories and steals from the
+// others when it runs dry) and next() just drains their output. Handy when every directory read
+// is a network round trip.
+//
+// Files that don't match filespecs (if given) are dropped straight out of the listing, usually
+// before their path is even built. Listings come from manifest (if given) when it can vouch for
+// them. Given a trace, every listing is recorded as a span on the thread that did it.
+class DirectoryWalker
+{
+public:
+    enum State
+    {
+        WALK_FILE,    // entry was filled in
+        WALK_WAITING, // nothing available yet, call again
+        WALK_DONE
+    };
+
+    DirectoryWalker(const StringList &paths, bool recursive, int threadCount, const FilespecMatcher *filespecs = NULL, DirectoryManifest *manifest = NULL, SearchTrace *trace = NULL);
+    ~DirectoryWalker();
+
+    State next(DirectoryEntry &entry);
+    void stop();
+
+    DirectoryWalkerStats stats();
+
+    // Seconds spent listing directories and filtering what was in them, summed over every thread
+    // that did any. Complete once the walker's done (or stopped and destroyed).
+    void times(double &listSeconds, double &filterSeconds);
+
+    void walkerProc(DirectoryWalkerThread *thread);
+protected:
+    bool list(const std::string &path, DirectoryEntryList &listing, TraceBuffer *trace);
+    void processListing(const std::string &path, DirectoryEntryList &listing, StringList &subdirectories);
+    bool takeDirectory(DirectoryWalkerThread *thread, std::string &path);
+    void queueDirectory(DirectoryWalkerThread *thread, const std::string &path, StringList &privateStack);
+    void pushOutput(DirectoryEntry &entry);
+    void addTime(double &phase, double seconds);
+
+    bool recursive_;
+    const FilespecMatcher *filespecs_;
+    DirectoryManifest *manifest_;
+    SearchTrace *trace_;
+    volatile int stop_;
+    DirectoryWalkerStats stats_;
+    PlatformMutex timesMutex_; // a directory's worth of work at a time, so it's never busy
+    double listSeconds_;
+    double filterSeconds_;
+
+    // Single threaded walking
+    TraceBuffer *callerTrace_;
+    StringList stack_;
+    DirectoryEntryList listing_;
+    size_t listingPos_;
+
+    // Parallel walking
+    std::vector<DirectoryWalkerThread *> threads_;
+    volatile int pendingDirectories_; // queued anywhere, or being listed right now
+    volatile int frontierSize_;       // queued in a stealable deque
+    PlatformEvent workReady_;
+    PlatformMutex outputMutex_;
+    std::deque<DirectoryEntry> output_;
+    PlatformEvent outputReady_;
+    PlatformEvent outputSpace_;
+};
+
+#endif
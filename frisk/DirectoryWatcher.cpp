@@ -0,0 +1,331 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "DirectoryWatcher.h"
+#include "DirectoryWalker.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+#define WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+struct DirectoryWatcherRoot
+{
+    std::string path;
+    HANDLE directory;
+    OVERLAPPED overlapped;
+    DWORD buffer[16 * 1024]; // FILE_NOTIFY_INFORMATION records have to be DWORD aligned
+};
+
+DirectoryWatcher::DirectoryWatcher()
+: recursive_(false)
+, complete_(false)
+{
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    stop();
+}
+
+bool DirectoryWatcher::start(const StringList &paths, bool recursive)
+{
+    stop();
+    recursive_ = recursive;
+    complete_ = true;
+
+    for(StringList::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        // wait() has to be able to wait on all of them at once
+        if(roots_.size() >= MAXIMUM_WAIT_OBJECTS)
+        {
+            stop();
+            return false;
+        }
+
+        HANDLE directory = CreateFile(it->c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        if(directory == INVALID_HANDLE_VALUE)
+            continue;
+
+        DirectoryWatcherRoot *root = new DirectoryWatcherRoot;
+        root->path = *it;
+        root->directory = directory;
+        ZeroMemory(&root->overlapped, sizeof(root->overlapped));
+        root->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if(!readChanges(root))
+        {
+            CloseHandle(root->overlapped.hEvent);
+            CloseHandle(root->directory);
+            delete root;
+            continue;
+        }
+        roots_.push_back(root);
+    }
+    if(roots_.empty())
+    {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void DirectoryWatcher::stop()
+{
+    for(std::vector<DirectoryWatcherRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        // The buffer belongs to the OS until the read is actually cancelled
+        DirectoryWatcherRoot *root = *it;
+        DWORD bytes;
+        CancelIo(root->directory);
+        GetOverlappedResult(root->directory, &root->overlapped, &bytes, TRUE);
+        CloseHandle(root->overlapped.hEvent);
+        CloseHandle(root->directory);
+        delete root;
+    }
+    roots_.clear();
+    complete_ = false;
+}
+
+bool DirectoryWatcher::readChanges(DirectoryWatcherRoot *root)
+{
+    ResetEvent(root->overlapped.hEvent);
+    return ReadDirectoryChangesW(root->directory, root->buffer, sizeof(root->buffer), recursive_ ? TRUE : FALSE, WATCH_FILTER, NULL, &root->overlapped, NULL) != 0;
+}
+
+bool DirectoryWatcher::wait(unsigned int timeoutMs, StringList &changed)
+{
+    if(roots_.empty())
+    {
+        platformSleep(timeoutMs);
+        return true;
+    }
+
+    std::vector<HANDLE> events;
+    for(std::vector<DirectoryWatcherRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        events.push_back((*it)->overlapped.hEvent);
+    }
+    DWORD result = WaitForMultipleObjects((DWORD)events.size(), &events[0], FALSE, timeoutMs);
+    if(result == WAIT_TIMEOUT)
+        return true;
+    if(result == WAIT_FAILED)
+    {
+        // It'd only fail the same way again, right away, forever
+        complete_ = false;
+        return false;
+    }
+
+    bool complete = true;
+    for(std::vector<DirectoryWatcherRoot *>::iterator it = roots_.begin(); it != roots_.end(); ++it)
+    {
+        DirectoryWatcherRoot *root = *it;
+        DWORD bytes = 0;
+        if(!GetOverlappedResult(root->directory, &root->overlapped, &bytes, FALSE))
+            continue; // nothing yet
+
+        // Zero bytes means the changes didn't fit in the buffer, and are gone
+        if(!bytes)
+            complete = false;
+
+        const char *p = (const char *)root->buffer;
+        while(bytes)
+        {
+            const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *)p;
+            int wideLength = info->FileNameLength / sizeof(WCHAR);
+            int length = WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, NULL, 0, NULL, NULL);
+            if(length > 0)
+            {
+                std::string name(length, 0);
+                WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, &name[0], length, NULL, NULL);
+                std::string path = joinPath(root->path, name);
+
+                // Directories count as modified whenever anything in them changes; the files themselves
+                // get their own notifications
+                DirectoryEntry entry;
+                if((info->Action != FILE_ACTION_MODIFIED) || !statPath(path, entry) || !entry.isDirectory)
+                    changed.push_back(path);
+            }
+
+            if(!info->NextEntryOffset)
+                break;
+            p += info->NextEntryOffset;
+        }
+
+        if(!readChanges(root))
+            complete = false;
+    }
+    return complete;
+}
+
+#else
+
+// IN_MODIFY fires for every write, but files that are appended to and never closed (logs) would
+// never show up otherwise; the caller waits for a burst of them to settle
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+DirectoryWatcher::DirectoryWatcher()
+: recursive_(false)
+, complete_(false)
+, fd_(-1)
+{
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    stop();
+}
+
+bool DirectoryWatcher::start(const StringList &paths, bool recursive)
+{
+    stop();
+    recursive_ = recursive;
+    complete_ = true;
+
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd_ < 0)
+        return false;
+
+    for(StringList::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        watchTree(*it);
+    }
+    if(watches_.empty() || !complete_)
+    {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void DirectoryWatcher::stop()
+{
+    if(fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+    watches_.clear();
+    complete_ = false;
+}
+
+// inotify only ever watches a single directory, so recursive watching means a watch per directory
+void DirectoryWatcher::watchTree(const std::string &path)
+{
+    int wd = inotify_add_watch(fd_, path.c_str(), WATCH_EVENTS);
+    if(wd < 0)
+    {
+        // Gone already, not a directory, or not readable (so the walker skips it too) is nothing to
+        // watch. Anything else (ENOSPC once max_user_watches runs out) leaves a hole.
+        if((errno != ENOENT) && (errno != ENOTDIR) && (errno != EACCES))
+            complete_ = false;
+        return;
+    }
+    watches_[wd] = path;
+
+    if(!recursive_)
+        return;
+
+    DirectoryEntryList entries;
+    if(!listDirectory(path, entries))
+        return;
+    for(DirectoryEntryList::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if(it->isDirectory && (it->name[0] != '.'))
+            watchTree(joinPath(path, it->name));
+    }
+}
+
+// Forgets about a directory that was moved away, and everything under it
+void DirectoryWatcher::unwatchTree(const std::string &path)
+{
+    std::string prefix = path + PLATFORM_PATH_SEPARATOR;
+    std::map<int, std::string>::iterator it = watches_.begin();
+    while(it != watches_.end())
+    {
+        if((it->second == path) || !it->second.compare(0, prefix.length(), prefix))
+        {
+            inotify_rm_watch(fd_, it->first);
+            watches_.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool DirectoryWatcher::wait(unsigned int timeoutMs, StringList &changed)
+{
+    if(fd_ < 0)
+    {
+        platformSleep(timeoutMs);
+        return true;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, (int)timeoutMs) <= 0)
+        return true;
+
+    bool complete = true;
+    union
+    {
+        struct inotify_event event;
+        char bytes[64 * 1024];
+    } buffer;
+    for(;;)
+    {
+        ssize_t bytes = read(fd_, buffer.bytes, sizeof(buffer.bytes));
+        if(bytes <= 0)
+            break;
+
+        for(const char *p = buffer.bytes; p < (buffer.bytes + bytes); )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                complete = false;
+                continue;
+            }
+
+            std::map<int, std::string>::iterator watch = watches_.find(event->wd);
+            if(watch == watches_.end())
+                continue;
+            if(event->mask & IN_IGNORED)
+            {
+                // The directory itself went away
+                watches_.erase(watch);
+                continue;
+            }
+            if(!event->len)
+                continue;
+
+            std::string path = joinPath(watch->second, event->name);
+            if(recursive_ && (event->mask & IN_ISDIR) && (event->name[0] != '.'))
+            {
+                if(event->mask & IN_MOVED_FROM)
+                    unwatchTree(path);
+                if(event->mask & (IN_CREATE | IN_MOVED_TO))
+                    watchTree(path);
+            }
+            changed.push_back(path);
+        }
+    }
+    return complete;
+}
+
+#endif
@@ -0,0 +1,63 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef DIRECTORYWATCHER_H
+#define DIRECTORYWATCHER_H
+
+#include "Platform.h"
+#include "SearchConfig.h"
+
+#include <map>
+
+struct DirectoryWatcherRoot;
+
+// Has the OS report changes under a set of root paths (ReadDirectoryChangesW on Windows, inotify
+// elsewhere), so a finished search can keep its output up to date without walking everything
+// again. Dot-prefixed directories aren't watched where that can be helped, but changes in them
+// can still show up.
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher();
+    ~DirectoryWatcher();
+
+    // Returns false if none of the paths could be watched, or if some directory under them couldn't
+    // be (out of inotify watches, too many roots to wait on at once)
+    bool start(const StringList &paths, bool recursive);
+    void stop();
+
+    // False once a directory that should be watched (one created since start(), say) couldn't be,
+    // or waiting itself failed; changes there go unreported from then on
+    bool complete() const { return complete_; }
+
+    // Waits up to timeoutMs for something to change, then adds the full path of everything that
+    // was created, written to, renamed or deleted since the last call to changed (duplicates and
+    // all). A path can be a file or a directory, and may not exist anymore. Returns false if the
+    // OS had to throw changes away, in which case anything could have changed.
+    bool wait(unsigned int timeoutMs, StringList &changed);
+
+protected:
+    bool recursive_;
+    bool complete_;
+#ifdef _WIN32
+    bool readChanges(DirectoryWatcherRoot *root);
+
+    std::vector<DirectoryWatcherRoot *> roots_;
+#else
+    void watchTree(const std::string &path);
+    void unwatchTree(const std::string &path);
+
+    int fd_;
+    std::map<int, std::string> watches_; // inotify watch descriptor -> directory
+#endif
+
+private:
+    DirectoryWatcher(const DirectoryWatcher &);
+    DirectoryWatcher &operator=(const DirectoryWatcher &);
+};
+
+#endif
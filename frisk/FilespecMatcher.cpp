@@ -0,0 +1,304 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "FilespecMatcher.h"
+#include "DirectoryWalker.h"
+
+#include <string.h>
+
+static inline char foldChar(char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (char)(c + ('a' - 'A')) : c;
+}
+
+static void foldString(std::string &s)
+{
+    for(size_t i = 0; i < s.length(); ++i)
+        s[i] = foldChar(s[i]);
+}
+
+// Does segment (already folded if need be) appear in text at pos?
+static bool segmentAt(const std::string &text, size_t pos, const std::string &segment, bool caseSensitive)
+{
+    if((pos + segment.length()) > text.length())
+        return false;
+    if(caseSensitive)
+        return !text.compare(pos, segment.length(), segment);
+
+    for(size_t i = 0; i < segment.length(); ++i)
+    {
+        if(foldChar(text[pos + i]) != segment[i])
+            return false;
+    }
+    return true;
+}
+
+// Regex filespecs get glued together as (?:a)|(?:b), which changes what a few things mean:
+// backreference numbers, \Q without an \E, (*VERBS) and inline options that only work up front.
+static bool canCombine(const std::string &regex)
+{
+    for(size_t i = 0; (i + 1) < regex.length(); ++i)
+    {
+        char c = regex[i];
+        char n = regex[i + 1];
+        if(c == '\\')
+        {
+            if(((n >= '0') && (n <= '9')) || strchr("QEgk", n))
+                return false;
+            i++;
+        }
+        else if(c == '(')
+        {
+            if(n == '*')
+                return false;
+            if(n == '?')
+            {
+                const char *rest = regex.c_str() + i + 2;
+                if(strncmp(rest, ":", 1) && strncmp(rest, "=", 1) && strncmp(rest, "!", 1) && strncmp(rest, "<=", 2) && strncmp(rest, "<!", 2))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void freeRegex(StudiedRegex &regex)
+{
+    if(regex.extra)
+        pcre_free_study(regex.extra);
+    if(regex.code)
+        pcre_free(regex.code);
+    regex.code = NULL;
+    regex.extra = NULL;
+}
+
+static bool compileRegex(const std::string &pattern, int flags, StudiedRegex &regex, std::string &error)
+{
+    const char *errorText;
+    int erroffset;
+    regex.extra = NULL;
+    regex.code = pcre_compile(pattern.c_str(), flags, &errorText, &erroffset, NULL);
+    if(!regex.code)
+    {
+        error = errorText;
+        return false;
+    }
+    regex.extra = pcre_study(regex.code, PCRE_STUDY_JIT_COMPILE, &errorText);
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+FilespecMatcher::FilespecMatcher()
+: caseSensitive_(false)
+{
+    combined_.code = NULL;
+    combined_.extra = NULL;
+}
+
+FilespecMatcher::~FilespecMatcher()
+{
+    clear();
+}
+
+void FilespecMatcher::clear()
+{
+    extensions_.clear();
+    globs_.clear();
+    freeRegex(combined_);
+    for(RegexList::iterator it = regexes_.begin(); it != regexes_.end(); ++it)
+        freeRegex(*it);
+    regexes_.clear();
+}
+
+bool FilespecMatcher::set(const StringList &filespecs, bool regexes, bool caseSensitive, std::string &error)
+{
+    clear();
+    caseSensitive_ = caseSensitive;
+
+    if(!regexes)
+    {
+        for(StringList::const_iterator it = filespecs.begin(); it != filespecs.end(); ++it)
+        {
+            const std::string &spec = *it;
+            if((spec.length() >= 2) && (spec[0] == '*') && (spec[1] == '.') && (spec.find_first_of("*?./\\", 2) == std::string::npos))
+            {
+                std::string extension = spec.substr(2);
+                if(!caseSensitive_)
+                    foldString(extension);
+                extensions_.insert(extension);
+            }
+            else
+            {
+                addGlob(spec);
+            }
+        }
+        return true;
+    }
+
+    int flags = 0;
+    if(!caseSensitive_)
+        flags |= PCRE_CASELESS;
+
+    // Compile each one on its own first, so errors point at the right spec
+    bool combine = (filespecs.size() > 1);
+    std::string alternation;
+    for(StringList::const_iterator it = filespecs.begin(); it != filespecs.end(); ++it)
+    {
+        StudiedRegex regex;
+        if(!compileRegex(*it, flags, regex, error))
+        {
+            clear();
+            return false;
+        }
+        regexes_.push_back(regex);
+
+        if(!canCombine(*it))
+            combine = false;
+        if(!alternation.empty())
+            alternation += "|";
+        alternation += "(?:" + *it + ")";
+    }
+
+    std::string unused;
+    if(combine && compileRegex(alternation, flags, combined_, unused))
+    {
+        for(RegexList::iterator it = regexes_.begin(); it != regexes_.end(); ++it)
+            freeRegex(*it);
+        regexes_.clear();
+    }
+    return true;
+}
+
+void FilespecMatcher::addGlob(const std::string &spec)
+{
+    Glob glob;
+    glob.pattern = spec;
+    if(!caseSensitive_)
+        foldString(glob.pattern);
+    glob.hasOptional = (spec.find('?') != std::string::npos);
+    glob.matchesPath = (spec.find_first_of("/\\") != std::string::npos);
+
+    if(!glob.hasOptional)
+    {
+        size_t start = 0;
+        for(;;)
+        {
+            size_t star = glob.pattern.find('*', start);
+            glob.segments.push_back(glob.pattern.substr(start, (star == std::string::npos) ? std::string::npos : star - start));
+            if(star == std::string::npos)
+                break;
+            start = star + 1;
+        }
+    }
+    globs_.push_back(glob);
+}
+
+bool FilespecMatcher::globMatches(const Glob &glob, const std::string &text) const
+{
+    if(!glob.hasOptional)
+    {
+        // Only stars: the first segment has to start the text, the last has to end it, and the
+        // ones in between just need to show up in order (leftmost is always the safe choice).
+        const StringList &segments = glob.segments;
+        const std::string &first = segments.front();
+        if(segments.size() == 1)
+            return (text.length() == first.length()) && segmentAt(text, 0, first, caseSensitive_);
+
+        const std::string &last = segments.back();
+        if((first.length() + last.length()) > text.length())
+            return false;
+        if(!segmentAt(text, 0, first, caseSensitive_) || !segmentAt(text, text.length() - last.length(), last, caseSensitive_))
+            return false;
+
+        size_t pos = first.length();
+        size_t limit = text.length() - last.length();
+        for(size_t i = 1; (i + 1) < segments.size(); ++i)
+        {
+            const std::string &segment = segments[i];
+            while(((pos + segment.length()) <= limit) && !segmentAt(text, pos, segment, caseSensitive_))
+                pos++;
+            if((pos + segment.length()) > limit)
+                return false;
+            pos += segment.length();
+        }
+        return true;
+    }
+
+    // With ? in the mix, track every text position the pattern so far could have reached
+    const std::string &pattern = glob.pattern;
+    size_t n = text.length();
+    std::vector<char> reached(n + 1, 0);
+    std::vector<char> next(n + 1, 0);
+    reached[0] = 1;
+    for(size_t p = 0; p < pattern.length(); ++p)
+    {
+        char pc = pattern[p];
+        if(pc == '*')
+        {
+            next[0] = reached[0];
+            for(size_t j = 1; j <= n; ++j)
+                next[j] = reached[j] || next[j - 1];
+        }
+        else if(pc == '?')
+        {
+            next[0] = reached[0];
+            for(size_t j = 1; j <= n; ++j)
+                next[j] = reached[j] || reached[j - 1];
+        }
+        else
+        {
+            next[0] = 0;
+            for(size_t j = 1; j <= n; ++j)
+            {
+                char tc = caseSensitive_ ? text[j - 1] : foldChar(text[j - 1]);
+                next[j] = reached[j - 1] && (tc == pc);
+            }
+        }
+        reached.swap(next);
+    }
+    return reached[n] != 0;
+}
+
+bool FilespecMatcher::matches(const std::string &directory, const std::string &name) const
+{
+    if(!extensions_.empty())
+    {
+        size_t dot = name.rfind('.');
+        if(dot != std::string::npos)
+        {
+            std::string extension = name.substr(dot + 1);
+            if(!caseSensitive_)
+                foldString(extension);
+            if(extensions_.count(extension))
+                return true;
+        }
+    }
+
+    std::string path; // only built if something needs it
+    for(std::vector<Glob>::const_iterator it = globs_.begin(); it != globs_.end(); ++it)
+    {
+        if(it->matchesPath && path.empty())
+            path = joinPath(directory, name);
+        if(globMatches(*it, it->matchesPath ? path : name))
+            return true;
+    }
+
+    if(combined_.code || !regexes_.empty())
+    {
+        if(path.empty())
+            path = joinPath(directory, name);
+        if(combined_.code)
+            return pcre_exec(combined_.code, combined_.extra, path.c_str(), path.length(), 0, 0, NULL, 0) >= 0;
+        for(RegexList::const_iterator it = regexes_.begin(); it != regexes_.end(); ++it)
+        {
+            if(pcre_exec(it->code, it->extra, path.c_str(), path.length(), 0, 0, NULL, 0) >= 0)
+                return true;
+        }
+    }
+    return false;
+}
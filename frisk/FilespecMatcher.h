@@ -0,0 +1,67 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef FILESPECMATCHER_H
+#define FILESPECMATCHER_H
+
+#include <config.h>
+#include <pcre.h>
+
+#include "SearchConfig.h"
+
+#include <unordered_set>
+
+// A compiled regex, plus whatever pcre_study() could add to it (JIT code, when available)
+struct StudiedRegex
+{
+    pcre *code;
+    pcre_extra *extra;
+};
+
+typedef std::vector<StudiedRegex> RegexList;
+
+// Decides which files get searched. Wildcard filespecs are never turned into regexes:
+// - "*.ext" specs all go into one set of extensions, so any number of them costs one lookup
+// - other wildcards get a small glob matcher (* is anything, ? is zero or one character)
+// - regex filespecs are glued into a single alternation and run once per file
+//
+// Wildcards without a path separator in them only look at the file name, which lets
+// DirectoryWalker reject most files before it bothers building their paths. Wildcards with one,
+// and regexes, see the whole path like they always have.
+class FilespecMatcher
+{
+public:
+    FilespecMatcher();
+    ~FilespecMatcher();
+
+    // Returns false (with error filled in) if a regex filespec doesn't compile
+    bool set(const StringList &filespecs, bool regexes, bool caseSensitive, std::string &error);
+    void clear();
+
+    // Safe to call from several threads at once
+    bool matches(const std::string &directory, const std::string &name) const;
+
+protected:
+    struct Glob
+    {
+        std::string pattern;        // folded when ignoring case
+        StringList segments;        // pattern split on *, when it has no ?
+        bool hasOptional;           // has a ?, so the segment matcher won't do
+        bool matchesPath;           // has a separator, so it sees the whole path
+    };
+
+    void addGlob(const std::string &spec);
+    bool globMatches(const Glob &glob, const std::string &text) const;
+
+    bool caseSensitive_;
+    std::unordered_set<std::string> extensions_; // from "*.ext" specs, folded
+    std::vector<Glob> globs_;
+    StudiedRegex combined_;                      // every regex filespec at once, if they'd combine
+    RegexList regexes_;                          // one at a time otherwise
+};
+
+#endif
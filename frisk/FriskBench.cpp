@@ -0,0 +1,641 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+// frisk-bench: times the search engine against a generated corpus, and prints what it found as
+// JSON on stdout. The corpus is the same bytes every time for a given CORPUS_VERSION and scale, and
+// the modes never change, so the numbers can be compared from one commit to the next (on the same
+// machine). Each mode runs in a process of its own, so its peak memory is its own too.
+
+#include "BenchRandom.h"
+#include "SearchContext.h"
+#include "cJSON.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// Bump this whenever the generator changes, so old corpora aren't mistaken for the new one
+#define CORPUS_VERSION (1)
+#define CORPUS_SEED (0x46524953) // 'FRIS'
+#define CORPUS_STAMP ".friskbench" // dotted, so the walker never searches it
+
+#define DEFAULT_RUNS (5)
+#define OUTPUT_POLL_MS (1)
+
+// ------------------------------------------------------------------------------------------------
+// Corpus
+
+// Everything the modes look for is in here somewhere, at its own (fixed) frequency
+static const char *sWords[] =
+{
+    "buffer", "count", "index", "length", "offset", "result", "value", "state", "node", "list",
+    "file", "line", "match", "search", "window", "thread", "queue", "table", "entry", "block",
+    "return", "static", "const", "struct", "while", "break", "size_t", "char", "int", "void",
+    "if", "for", "else", "NULL", "true", "false", "the", "a", "of", "to",
+    "error", "Error", "ERROR", "err_code", "errno", "errors", "TODO", "todo", "warning", "failed",
+};
+static const int sWordCount = sizeof(sWords) / sizeof(sWords[0]);
+
+static const char *sSourceExtensions[] = { ".c", ".h", ".cpp", ".txt" };
+static const char *sLogLevels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+struct CorpusStats
+{
+    CorpusStats() : files(0), directories(0), bytes(0) {}
+
+    int files;
+    int directories;
+    s64 bytes;
+};
+
+static bool writeCorpusFile(const std::string &filename, const std::string &contents, CorpusStats &stats)
+{
+    if(!writeEntireFile(filename, contents))
+    {
+        fprintf(stderr, "frisk-bench: couldn't write %s\n", filename.c_str());
+        return false;
+    }
+    stats.files++;
+    stats.bytes += (s64)contents.length();
+    return true;
+}
+
+static bool makeCorpusDirectory(const std::string &path, CorpusStats &stats)
+{
+    if(!platformMakeDirectory(path))
+    {
+        fprintf(stderr, "frisk-bench: couldn't create %s\n", path.c_str());
+        return false;
+    }
+    stats.directories++;
+    return true;
+}
+
+static void appendWords(BenchRandom &random, std::string &line, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        if(i)
+            line += random.chance(15) ? ", " : " ";
+        line += sWords[random.range(sWordCount)];
+    }
+}
+
+// Something shaped like code: indented, short lines, the odd comment
+static std::string makeSourceFile(BenchRandom &random, bool crlf)
+{
+    const char *eol = crlf ? "\r\n" : "\n";
+    std::string contents;
+    int lines = 20 + random.range(280);
+    int depth = 0;
+    for(int i = 0; i < lines; ++i)
+    {
+        contents.append(depth * 4, ' ');
+        if(random.chance(10))
+        {
+            contents += "// ";
+            appendWords(random, contents, 3 + random.range(10));
+        }
+        else
+        {
+            appendWords(random, contents, 1 + random.range(8));
+            contents += ";";
+        }
+        contents += eol;
+
+        if(random.chance(8) && (depth < 6))
+        {
+            contents.append(depth * 4, ' ');
+            contents += "{";
+            contents += eol;
+            depth++;
+        }
+        else if(depth && random.chance(10))
+        {
+            depth--;
+            contents.append(depth * 4, ' ');
+            contents += "}";
+            contents += eol;
+        }
+    }
+    return contents;
+}
+
+// Timestamped lines with a level and a message, up to size bytes
+static std::string makeLogFile(BenchRandom &random, size_t size, bool crlf)
+{
+    const char *eol = crlf ? "\r\n" : "\n";
+    std::string contents;
+    contents.reserve(size + 256);
+    unsigned int ms = 0;
+    char stamp[64];
+    while(contents.size() < size)
+    {
+        ms += 1 + random.range(250);
+        unsigned int seconds = ms / 1000;
+        sprintf(stamp, "2012-06-%02u %02u:%02u:%02u.%03u ", 1 + (seconds / 86400) % 28, (seconds / 3600) % 24, (seconds / 60) % 60, seconds % 60, ms % 1000);
+        contents += stamp;
+
+        int roll = random.range(100);
+        int level = (roll < 3) ? 0 : (roll < 83) ? 1 : (roll < 95) ? 2 : 3;
+        contents += "[";
+        contents += sLogLevels[level];
+        contents += "] ";
+        contents += sWords[random.range(20)];
+        contents += ": ";
+        appendWords(random, contents, 4 + random.range(16));
+        contents += eol;
+    }
+    return contents;
+}
+
+// Random bytes, NULs included, so the binary sniff turns them away
+static std::string makeBlob(BenchRandom &random, size_t size)
+{
+    std::string contents;
+    contents.resize(size);
+    for(size_t i = 0; i < size; ++i)
+        contents[i] = random.chance(10) ? 0 : (char)(random.next() & 0xff);
+    return contents;
+}
+
+static bool generateCorpus(const std::string &root, int scale, CorpusStats &stats)
+{
+    BenchRandom random(CORPUS_SEED);
+    char name[64];
+    const char sep = PLATFORM_PATH_SEPARATOR;
+
+    if(!makeCorpusDirectory(root, stats))
+        return false;
+
+    // Lots of small source files, a few levels down; every fourth one has CRLF line endings
+    std::string src = root + sep + "src";
+    if(!makeCorpusDirectory(src, stats))
+        return false;
+    int sourceFile = 0;
+    for(int module = 0; module < (8 * scale); ++module)
+    {
+        sprintf(name, "%cmodule%02d", sep, module);
+        std::string modulePath = src + name;
+        if(!makeCorpusDirectory(modulePath, stats))
+            return false;
+        for(int sub = 0; sub < 4; ++sub)
+        {
+            sprintf(name, "%csub%d", sep, sub);
+            std::string subPath = modulePath + name;
+            if(!makeCorpusDirectory(subPath, stats))
+                return false;
+            for(int i = 0; i < 64; ++i, ++sourceFile)
+            {
+                sprintf(name, "%cfile%03d%s", sep, i, sSourceExtensions[random.range(4)]);
+                if(!writeCorpusFile(subPath + name, makeSourceFile(random, (sourceFile % 4) == 3), stats))
+                    return false;
+            }
+        }
+    }
+
+    // One long chain of directories, with a couple of files at every level
+    std::string deep = root + sep + "deep";
+    if(!makeCorpusDirectory(deep, stats))
+        return false;
+    for(int level = 0; level < 32; ++level)
+    {
+        sprintf(name, "%clevel%02d", sep, level);
+        deep += name;
+        if(!makeCorpusDirectory(deep, stats))
+            return false;
+        for(int i = 0; i < 2; ++i)
+        {
+            sprintf(name, "%cnested%d.c", sep, i);
+            if(!writeCorpusFile(deep + name, makeSourceFile(random, (i == 1)), stats))
+                return false;
+        }
+    }
+
+    // A few huge logs, one of them CRLF
+    std::string logs = root + sep + "logs";
+    if(!makeCorpusDirectory(logs, stats))
+        return false;
+    for(int i = 0; i < 3; ++i)
+    {
+        sprintf(name, "%cserver%d.log", sep, i);
+        if(!writeCorpusFile(logs + name, makeLogFile(random, (size_t)(24 * 1024 * 1024) * scale, (i == 2)), stats))
+            return false;
+    }
+
+    // Binary blobs mixed in with everything else
+    std::string blobs = root + sep + "blobs";
+    if(!makeCorpusDirectory(blobs, stats))
+        return false;
+    for(int i = 0; i < (16 * scale); ++i)
+    {
+        sprintf(name, "%cblob%02d.bin", sep, i);
+        if(!writeCorpusFile(blobs + name, makeBlob(random, 512 * 1024), stats))
+            return false;
+    }
+    return true;
+}
+
+static std::string stampFilename(const std::string &root)
+{
+    return root + PLATFORM_PATH_SEPARATOR + CORPUS_STAMP;
+}
+
+// Reads back what a finished generation left behind; false if there's no finished corpus there
+static bool readStamp(const std::string &root, int scale, CorpusStats &stats)
+{
+    std::string contents;
+    if(!readEntireFile(stampFilename(root), contents, 0))
+        return false;
+
+    bool valid = false;
+    cJSON *json = cJSON_Parse(contents.c_str());
+    if(json)
+    {
+        cJSON *version = cJSON_GetObjectItem(json, "version");
+        cJSON *stampScale = cJSON_GetObjectItem(json, "scale");
+        cJSON *files = cJSON_GetObjectItem(json, "files");
+        cJSON *directories = cJSON_GetObjectItem(json, "directories");
+        cJSON *bytes = cJSON_GetObjectItem(json, "bytes");
+        if(version && stampScale && files && directories && bytes
+        && (version->valueint == CORPUS_VERSION) && (stampScale->valueint == scale))
+        {
+            stats.files = files->valueint;
+            stats.directories = directories->valueint;
+            stats.bytes = (s64)bytes->valuedouble;
+            valid = true;
+        }
+        cJSON_Delete(json);
+    }
+    return valid;
+}
+
+static bool writeStamp(const std::string &root, int scale, const CorpusStats &stats)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "version", CORPUS_VERSION);
+    cJSON_AddNumberToObject(json, "scale", scale);
+    cJSON_AddNumberToObject(json, "files", stats.files);
+    cJSON_AddNumberToObject(json, "directories", stats.directories);
+    cJSON_AddNumberToObject(json, "bytes", (double)stats.bytes);
+    char *text = cJSON_Print(json);
+    bool written = writeEntireFile(stampFilename(root), text);
+    free(text);
+    cJSON_Delete(json);
+    return written;
+}
+
+// The corpus lives in a directory named for its version and scale, and is only generated if that
+// directory doesn't already hold a finished one
+static bool prepareCorpus(const std::string &baseDir, int scale, std::string &root, CorpusStats &stats)
+{
+    char name[64];
+    sprintf(name, "%cv%d-x%d", PLATFORM_PATH_SEPARATOR, CORPUS_VERSION, scale);
+    root = baseDir + name;
+    if(readStamp(root, scale, stats))
+        return true;
+
+    fprintf(stderr, "frisk-bench: generating %s\n", root.c_str());
+    platformMakeDirectory(baseDir);
+    stats = CorpusStats();
+    if(!generateCorpus(root, scale, stats))
+        return false;
+    stats.directories--; // the root isn't something the search lists
+
+    if(!writeStamp(root, scale, stats))
+    {
+        fprintf(stderr, "frisk-bench: couldn't write %s\n", stampFilename(root).c_str());
+        return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Modes
+
+struct BenchMode
+{
+    const char *name;
+    const char *match;
+    int flags;
+    int contextLines;
+    const char *replace; // dry run; NULL to just search
+};
+
+// Never reorder or change these; add new ones at the end, so old results still line up
+static const BenchMode sModes[] =
+{
+    { "literal",         "error",                   0,                                                 0, NULL },
+    { "literal-case",    "Error",                   SF_MATCH_CASE_SENSITIVE,                           0, NULL },
+    { "regex",           "err(or|no|_code)\\b",     SF_MATCH_REGEXES,                                  0, NULL },
+    { "regex-case",      "\\b(Error|ERROR)\\b",     SF_MATCH_REGEXES | SF_MATCH_CASE_SENSITIVE,        0, NULL },
+    { "context",         "error",                   0,                                                 2, NULL },
+    { "replace-dry-run", "TODO",                    SF_MATCH_CASE_SENSITIVE,                           0, "DONE" },
+};
+static const int sModeCount = sizeof(sModes) / sizeof(sModes[0]);
+
+static const BenchMode *findMode(const char *name)
+{
+    for(int i = 0; i < sModeCount; ++i)
+    {
+        if(!strcmp(sModes[i].name, name))
+            return &sModes[i];
+    }
+    return NULL;
+}
+
+class BenchObserver : public SearchObserver
+{
+public:
+    BenchObserver()
+    : finished_(0)
+    , failed_(0)
+    {
+    }
+
+    virtual void searchStateChanged(bool running)
+    {
+        if(!running)
+            platformAtomicIncrement(&finished_);
+    }
+
+    virtual void searchFailed(const std::string &title, const std::string &error)
+    {
+        fprintf(stderr, "frisk-bench: %s: %s\n", title.c_str(), error.c_str());
+        platformAtomicIncrement(&failed_);
+    }
+
+    int finished() { return platformAtomicAdd(&finished_, 0); }
+    bool failed() { return platformAtomicAdd(&failed_, 0) != 0; }
+
+protected:
+    volatile int finished_;
+    volatile int failed_;
+};
+
+struct BenchRun
+{
+    double seconds;
+    int files;
+    int hits;
+    s64 outputBytes;
+};
+
+// One search, from the call to the last of its output being picked up, the way frisk-cli drives it
+static bool runSearch(SearchContext &context, BenchObserver &observer, const SearchParams &params, BenchRun &run)
+{
+    int finished = observer.finished();
+    run.outputBytes = 0;
+
+    double start = platformSeconds();
+    context.search(params);
+    for(;;)
+    {
+        bool done = (observer.finished() != finished);
+
+        PokeData *poke;
+        while((poke = context.receivePoke()) != NULL)
+        {
+            if(!poke->finished)
+                run.outputBytes += (s64)poke->textBlocks.text.size();
+            context.recyclePoke(poke);
+        }
+
+        if(done)
+            break;
+        platformSleep(OUTPUT_POLL_MS);
+    }
+    run.seconds = platformSeconds() - start;
+    run.files = context.filesSearched();
+    run.hits = context.hits();
+    return !observer.failed();
+}
+
+static double perSecond(double amount, double seconds)
+{
+    return (seconds > 0) ? (amount / seconds) : 0;
+}
+
+// Runs a mode once to warm the file cache, then runs more times, timing each one, and reports
+// the median
+static cJSON *runMode(const BenchMode &mode, const std::string &root, const CorpusStats &corpus, int runs, int threads)
+{
+    SearchParams params;
+    params.paths.push_back(root);
+    params.filespecs.push_back("*");
+    params.match = mode.match;
+    params.flags = SF_RECURSIVE | mode.flags;
+    if(mode.replace)
+    {
+        params.flags |= SF_REPLACE;
+        params.replace = mode.replace;
+        params.dryRun = true;
+    }
+
+    // Defaults, not whatever the window last saved, so machines only differ by their hardware
+    BenchObserver observer;
+    SearchContext context(&observer);
+    SearchConfig &config = context.config();
+    config.contextLines_ = mode.contextLines;
+    config.searchThreads_ = threads;
+    config.directoryManifest_ = 0;
+
+    BenchRun warmup;
+    if(!runSearch(context, observer, params, warmup))
+        return NULL;
+
+    std::vector<double> seconds;
+    BenchRun run;
+    for(int i = 0; i < runs; ++i)
+    {
+        if(!runSearch(context, observer, params, run))
+            return NULL;
+        if((run.hits != warmup.hits) || (run.outputBytes != warmup.outputBytes))
+        {
+            fprintf(stderr, "frisk-bench: %s found something different from one run to the next\n", mode.name);
+            return NULL;
+        }
+        seconds.push_back(run.seconds);
+    }
+    context.stop();
+    std::sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", mode.name);
+    cJSON_AddStringToObject(json, "match", mode.match);
+    cJSON_AddNumberToObject(json, "seconds", median);
+    cJSON_AddNumberToObject(json, "seconds_min", seconds.front());
+    cJSON_AddNumberToObject(json, "seconds_max", seconds.back());
+    cJSON_AddNumberToObject(json, "files", run.files);
+    cJSON_AddNumberToObject(json, "hits", run.hits);
+    cJSON_AddNumberToObject(json, "output_bytes", (double)run.outputBytes);
+    cJSON_AddNumberToObject(json, "files_per_sec", perSecond(run.files, median));
+    cJSON_AddNumberToObject(json, "mb_per_sec", perSecond(corpus.bytes / (1024.0 * 1024.0), median));
+    cJSON_AddNumberToObject(json, "hits_per_sec", perSecond(run.hits, median));
+    cJSON_AddNumberToObject(json, "peak_rss_kb", (double)(platformPeakMemory() / 1024));
+    cJSON_AddItemToObject(json, "last_run", cJSON_Parse(context.stats().json().c_str())); // where the time went
+    return json;
+}
+
+// Runs a mode in a fresh copy of this program, so the peak memory it reports is that mode's alone
+static cJSON *runModeProcess(const char *program, const BenchMode &mode, const std::string &baseDir, int scale, int runs, int threads)
+{
+    char options[128];
+    sprintf(options, " --scale %d --runs %d --threads %d", scale, runs, threads);
+    std::string command = std::string("\"") + program + "\" --mode " + mode.name + " --corpus \"" + baseDir + "\"" + options;
+#ifdef _WIN32
+    command = "\"" + command + "\""; // cmd.exe strips the outer pair
+#endif
+
+    FILE *child = popen(command.c_str(), "r");
+    if(!child)
+    {
+        fprintf(stderr, "frisk-bench: couldn't run %s\n", command.c_str());
+        return NULL;
+    }
+    std::string output;
+    char buffer[4096];
+    size_t bytesRead;
+    while((bytesRead = fread(buffer, 1, sizeof(buffer), child)) > 0)
+        output.append(buffer, bytesRead);
+    if(pclose(child) != 0)
+        return NULL;
+    return cJSON_Parse(output.c_str());
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: frisk-bench [options]\n"
+        "\n"
+        "Generates a corpus (once), searches it every way in the mode list, and prints the\n"
+        "timings as JSON.\n"
+        "\n"
+        "  --corpus DIR     where the corpus goes (default frisk-bench-corpus)\n"
+        "  --scale N        corpus size multiplier (default 1, about 90MB)\n"
+        "  --runs N         timed runs per mode, after one to warm up (default %d)\n"
+        "  -j, --threads N  search threads (default: one per processor)\n"
+        "  --mode NAME      just run NAME, in this process\n"
+        "  --list           list the modes\n"
+        "  -h, --help       this\n",
+        DEFAULT_RUNS);
+}
+
+int main(int argc, char **argv)
+{
+    std::string baseDir = "frisk-bench-corpus";
+    int scale = 1;
+    int runs = DEFAULT_RUNS;
+    int threads = 0;
+    const char *modeName = NULL;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        bool hasValue = (i + 1) < argc;
+        if(!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+        {
+            usage();
+            return 0;
+        }
+        else if(!strcmp(arg, "--list"))
+        {
+            for(int mode = 0; mode < sModeCount; ++mode)
+                printf("%s\n", sModes[mode].name);
+            return 0;
+        }
+        else if(!strcmp(arg, "--corpus") && hasValue)
+            baseDir = argv[++i];
+        else if(!strcmp(arg, "--scale") && hasValue)
+            scale = atoi(argv[++i]);
+        else if(!strcmp(arg, "--runs") && hasValue)
+            runs = atoi(argv[++i]);
+        else if((!strcmp(arg, "-j") || !strcmp(arg, "--threads")) && hasValue)
+            threads = atoi(argv[++i]);
+        else if(!strcmp(arg, "--mode") && hasValue)
+            modeName = argv[++i];
+        else
+        {
+            fprintf(stderr, "frisk-bench: bad option %s (try --help)\n", arg);
+            return 1;
+        }
+    }
+    if((scale < 1) || (runs < 1) || (threads < 0))
+    {
+        fprintf(stderr, "frisk-bench: --scale and --runs need to be at least 1, and --threads can't be negative\n");
+        return 1;
+    }
+
+    std::string root;
+    CorpusStats corpus;
+    if(!prepareCorpus(baseDir, scale, root, corpus))
+        return 1;
+
+    if(modeName)
+    {
+        const BenchMode *mode = findMode(modeName);
+        if(!mode)
+        {
+            fprintf(stderr, "frisk-bench: no mode called %s (try --list)\n", modeName);
+            return 1;
+        }
+        cJSON *json = runMode(*mode, root, corpus, runs, threads);
+        if(!json)
+            return 1;
+        char *text = cJSON_PrintUnformatted(json);
+        printf("%s\n", text);
+        free(text);
+        cJSON_Delete(json);
+        return 0;
+    }
+
+    cJSON *report = cJSON_CreateObject();
+    cJSON_AddStringToObject(report, "benchmark", "frisk-bench");
+    cJSON *corpusJson = cJSON_CreateObject();
+    cJSON_AddNumberToObject(corpusJson, "version", CORPUS_VERSION);
+    cJSON_AddNumberToObject(corpusJson, "scale", scale);
+    cJSON_AddNumberToObject(corpusJson, "files", corpus.files);
+    cJSON_AddNumberToObject(corpusJson, "directories", corpus.directories);
+    cJSON_AddNumberToObject(corpusJson, "bytes", (double)corpus.bytes);
+    cJSON_AddItemToObject(report, "corpus", corpusJson);
+    cJSON_AddNumberToObject(report, "threads", threads ? threads : platformProcessorCount());
+    cJSON_AddNumberToObject(report, "runs", runs);
+
+    cJSON *modes = cJSON_CreateArray();
+    cJSON_AddItemToObject(report, "modes", modes);
+    bool failed = false;
+    for(int i = 0; i < sModeCount; ++i)
+    {
+        fprintf(stderr, "frisk-bench: %s\n", sModes[i].name);
+        cJSON *json = runModeProcess(argv[0], sModes[i], baseDir, scale, runs, threads);
+        if(!json)
+        {
+            fprintf(stderr, "frisk-bench: %s failed\n", sModes[i].name);
+            failed = true;
+            break;
+        }
+        cJSON_AddItemToArray(modes, json);
+    }
+
+    if(!failed)
+    {
+        char *text = cJSON_Print(report);
+        printf("%s\n", text);
+        free(text);
+    }
+    cJSON_Delete(report);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,432 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+// frisk-cli: the same search the window does, driven from a shell. Output is the window's text,
+// without the colors, on stdout. The exit status is grep's: 0 if anything matched, 1 if nothing
+// did, 2 if the search couldn't be done at all.
+
+#include "SearchContext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define EXIT_MATCHED (0)
+#define EXIT_NO_MATCH (1)
+#define EXIT_TROUBLE (2)
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_POLL_MS (5) // how often output gets picked up while nothing's waiting
+
+// ------------------------------------------------------------------------------------------------
+
+// Collects output and hands it to the FILE in big chunks, rather than a write per batch or line
+class BufferedWriter
+{
+public:
+    BufferedWriter(FILE *file)
+    : file_(file)
+    , failed_(false)
+    {
+        buffer_.reserve(OUTPUT_BUFFER_SIZE);
+    }
+
+    ~BufferedWriter()
+    {
+        flush();
+    }
+
+    void write(const char *data, size_t length)
+    {
+        if((buffer_.size() + length) > OUTPUT_BUFFER_SIZE)
+        {
+            flush();
+            if(length > OUTPUT_BUFFER_SIZE)
+            {
+                // Not worth copying; it'd just get flushed again right away
+                failed_ = failed_ || (fwrite(data, 1, length, file_) != length);
+                return;
+            }
+        }
+        buffer_.append(data, length);
+    }
+
+    void write(const std::string &s)
+    {
+        write(s.data(), s.length());
+    }
+
+    void flush()
+    {
+        if(!buffer_.empty())
+        {
+            failed_ = failed_ || (fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size());
+            buffer_.clear();
+        }
+        failed_ = failed_ || fflush(file_);
+    }
+
+    bool failed() const { return failed_; }
+
+protected:
+    FILE *file_;
+    std::string buffer_;
+    bool failed_;
+};
+
+// Nothing to post messages to out here; the main thread just watches these
+class CliObserver : public SearchObserver
+{
+public:
+    CliObserver()
+    : done_(0)
+    , failed_(0)
+    {
+    }
+
+    virtual void searchStateChanged(bool running)
+    {
+        if(!running)
+            platformAtomicIncrement(&done_);
+    }
+
+    virtual void searchFailed(const std::string &title, const std::string &error)
+    {
+        fprintf(stderr, "frisk-cli: %s: %s\n", title.c_str(), error.c_str());
+        platformAtomicIncrement(&failed_);
+    }
+
+    bool done() { return platformAtomicAdd(&done_, 0) != 0; }
+    bool failed() { return platformAtomicAdd(&failed_, 0) != 0; }
+
+protected:
+    volatile int done_;
+    volatile int failed_;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: frisk-cli [options] MATCH [PATH...]\n"
+        "       frisk-cli --build-index [PATH...]\n"
+        "\n"
+        "Searches every PATH (the current directory if there are none) for MATCH.\n"
+        "\n"
+        "Match:\n"
+        "  -E, --regex              MATCH is a regex\n"
+        "  -S, --case-sensitive     MATCH is case sensitive\n"
+        "      --list               MATCH is a ;-separated list of strings, any of which is a hit\n"
+        "\n"
+        "Which files:\n"
+        "  -f, --filespec SPECS     ;-separated wildcards the filenames have to match (default *)\n"
+        "      --filespec-regex     SPECS are regexes\n"
+        "      --filespec-case      SPECS are case sensitive\n"
+        "      --no-recursive       don't look in subdirectories\n"
+        "      --max-size KB        skip files bigger than this\n"
+        "      --manifest N         0: never use .friskmanifest files, 1: use them where they're\n"
+        "                           there (default), 2: create them for every recursive PATH too\n"
+        "\n"
+        "Output:\n"
+        "  -C, --context N          show N lines around each hit (default 0)\n"
+        "  -l, --files-with-matches just list the files with a hit\n"
+        "  -c, --count              just count the hits in each file\n"
+        "  -m, --max-count N        stop reading a file after N hits\n"
+        "      --max-results N      stop searching after N hits\n"
+        "      --trim               show filenames relative to the first PATH\n"
+        "      --summary            finish with the summary, on stderr\n"
+        "      --stats FILE         write where the time went to FILE, as JSON\n"
+        "      --trace FILE         write a Chrome trace of the search to FILE (for Perfetto)\n"
+        "  -q, --quiet              no output at all; just the exit status\n"
+        "      --watch              after searching, keep going: every time a file changes, search\n"
+        "                           it again and print its new output (until interrupted)\n"
+        "\n"
+        "Replace:\n"
+        "  -r, --replace TEXT       replace every hit with TEXT, in place\n"
+        "      --backup EXT         first save each file it changes as FILE.EXT\n"
+        "  -n, --dry-run            show what the replace would change, but don't change it\n"
+        "\n"
+        "      --build-index        write a .friskindex (and a .friskmanifest, unless --manifest 0)\n"
+        "                           into each PATH, so later searches of it can skip files; takes\n"
+        "                           no MATCH\n"
+        "  -j, --threads N          search with N threads (default: one per processor)\n"
+        "  -h, --help               this\n"
+        "\n"
+        "Exits with 0 if anything matched, 1 if nothing did, and 2 if something went wrong.\n");
+}
+
+// Returns the value of the option at argv[i] (advancing i past it), or NULL if there isn't one
+static const char *optionValue(int argc, char **argv, int &i)
+{
+    if((i + 1) >= argc)
+    {
+        fprintf(stderr, "frisk-cli: %s needs a value\n", argv[i]);
+        return NULL;
+    }
+    return argv[++i];
+}
+
+static void splitList(const std::string &s, StringList &output)
+{
+    size_t start = 0;
+    for(;;)
+    {
+        size_t semicolon = s.find(';', start);
+        std::string item = s.substr(start, (semicolon == std::string::npos) ? std::string::npos : semicolon - start);
+        if(!item.empty())
+            output.push_back(item);
+        if(semicolon == std::string::npos)
+            break;
+        start = semicolon + 1;
+    }
+}
+
+static bool isOption(const char *arg, const char *shortName, const char *longName)
+{
+    return (shortName && !strcmp(arg, shortName)) || !strcmp(arg, longName);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    SearchParams params;
+    params.flags = SF_RECURSIVE;
+    int contextLines = 0;
+    int searchThreads = 0;
+    int directoryManifest = -1; // whatever SearchConfig defaults to
+    bool summary = false;
+    const char *statsFilename = NULL;
+    bool quiet = false;
+    StringList positional;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = NULL;
+        if(!strcmp(arg, "--"))
+        {
+            for(++i; i < argc; ++i)
+                positional.push_back(argv[i]);
+            break;
+        }
+        else if((arg[0] != '-') || !arg[1])
+            positional.push_back(arg);
+        else if(isOption(arg, "-h", "--help"))
+        {
+            usage();
+            return EXIT_MATCHED;
+        }
+        else if(isOption(arg, "-E", "--regex"))
+            params.flags |= SF_MATCH_REGEXES;
+        else if(isOption(arg, "-S", "--case-sensitive"))
+            params.flags |= SF_MATCH_CASE_SENSITIVE;
+        else if(isOption(arg, NULL, "--list"))
+            params.flags |= SF_MATCH_LIST;
+        else if(isOption(arg, "-f", "--filespec"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            splitList(value, params.filespecs);
+        }
+        else if(isOption(arg, NULL, "--filespec-regex"))
+            params.flags |= SF_FILESPEC_REGEXES;
+        else if(isOption(arg, NULL, "--filespec-case"))
+            params.flags |= SF_FILESPEC_CASE_SENSITIVE;
+        else if(isOption(arg, NULL, "--no-recursive"))
+            params.flags &= ~SF_RECURSIVE;
+        else if(isOption(arg, NULL, "--max-size"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.maxFileSize = atoi(value);
+        }
+        else if(isOption(arg, NULL, "--manifest"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            directoryManifest = atoi(value);
+        }
+        else if(isOption(arg, "-C", "--context"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            contextLines = atoi(value);
+        }
+        else if(isOption(arg, "-l", "--files-with-matches"))
+            params.flags |= SF_FILES_WITH_MATCHES;
+        else if(isOption(arg, "-c", "--count"))
+            params.flags |= SF_COUNT_ONLY;
+        else if(isOption(arg, "-m", "--max-count"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.maxHitsPerFile = atoi(value);
+        }
+        else if(isOption(arg, NULL, "--max-results"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.maxResults = atoi(value);
+        }
+        else if(isOption(arg, NULL, "--trim"))
+            params.flags |= SF_TRIM_FILENAMES;
+        else if(isOption(arg, NULL, "--summary"))
+            summary = true;
+        else if(isOption(arg, NULL, "--stats"))
+        {
+            if(!(statsFilename = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+        }
+        else if(isOption(arg, NULL, "--trace"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.traceFilename = value;
+        }
+        else if(isOption(arg, "-q", "--quiet"))
+            quiet = true;
+        else if(isOption(arg, NULL, "--watch"))
+            params.flags |= SF_WATCH;
+        else if(isOption(arg, NULL, "--build-index"))
+            params.flags |= SF_BUILD_INDEX;
+        else if(isOption(arg, "-r", "--replace"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.flags |= SF_REPLACE;
+            params.replace = value;
+        }
+        else if(isOption(arg, NULL, "--backup"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            params.flags |= SF_BACKUP;
+            params.backupExtension = value;
+        }
+        else if(isOption(arg, "-n", "--dry-run"))
+            params.dryRun = true;
+        else if(isOption(arg, "-j", "--threads"))
+        {
+            if(!(value = optionValue(argc, argv, i)))
+                return EXIT_TROUBLE;
+            searchThreads = atoi(value);
+        }
+        else
+        {
+            fprintf(stderr, "frisk-cli: unknown option %s (try --help)\n", arg);
+            return EXIT_TROUBLE;
+        }
+    }
+
+    // Building an index doesn't look for anything, so everything's a path
+    bool buildIndex = ((params.flags & SF_BUILD_INDEX) != 0);
+    if(positional.empty() && !buildIndex)
+    {
+        usage();
+        return EXIT_TROUBLE;
+    }
+    if(!buildIndex)
+    {
+        params.match = positional[0];
+        positional.erase(positional.begin());
+    }
+    params.paths = positional;
+    if(params.paths.empty())
+        params.paths.push_back(".");
+    if(params.filespecs.empty())
+        params.filespecs.push_back("*");
+
+    // Like grep -q, the first hit answers the question. Listing files reads no further than a file's
+    // first hit, and a count would only get thrown away.
+    if(quiet && !(params.flags & SF_REPLACE))
+    {
+        params.flags &= ~SF_COUNT_ONLY;
+        params.flags |= SF_FILES_WITH_MATCHES;
+        params.maxResults = 1;
+    }
+
+    // Nothing's there to search, which isn't the same thing as not matching
+    for(StringList::iterator it = params.paths.begin(); it != params.paths.end(); ++it)
+    {
+        struct stat st;
+        if(stat(it->c_str(), &st) != 0)
+        {
+            fprintf(stderr, "frisk-cli: %s: No such file or directory\n", it->c_str());
+            return EXIT_TROUBLE;
+        }
+    }
+
+    // The config file belongs to the window; the command line starts from the defaults every time
+    CliObserver observer;
+    SearchContext context(&observer);
+    SearchConfig &config = context.config();
+    config.contextLines_ = (contextLines > 0) ? contextLines : 0;
+    config.searchThreads_ = searchThreads;
+    if(directoryManifest >= 0)
+        config.directoryManifest_ = directoryManifest;
+
+    BufferedWriter out(stdout);
+    context.search(params);
+    for(;;)
+    {
+        // Checked before draining, so nothing published before the search ended gets left behind
+        bool done = observer.done();
+
+        PokeData *poke;
+        while((poke = context.receivePoke()) != NULL)
+        {
+            if(poke->finished)
+            {
+                // An index build has nothing else to say
+                if(buildIndex && !quiet)
+                {
+                    out.write(poke->textBlocks.text.c_str() + ((poke->textBlocks.text[0] == '\n') ? 1 : 0));
+                    out.write("\n", 1);
+                }
+                else if(summary)
+                {
+                    out.flush();
+                    fprintf(stderr, "%s\n", poke->textBlocks.text.c_str() + ((poke->textBlocks.text[0] == '\n') ? 1 : 0));
+                }
+            }
+            else if(!quiet)
+            {
+                out.write(poke->textBlocks.text);
+            }
+            context.recyclePoke(poke);
+        }
+
+        // A watch only ends when it's interrupted, so nothing can wait for the buffer to fill up
+        if(params.flags & SF_WATCH)
+            out.flush();
+
+        if(done)
+            break;
+        platformSleep(OUTPUT_POLL_MS);
+    }
+    context.stop();
+    out.flush();
+
+    if(observer.failed())
+        return EXIT_TROUBLE;
+    if(statsFilename && !writeEntireFile(statsFilename, context.stats().json() + "\n"))
+    {
+        fprintf(stderr, "frisk-cli: couldn't write %s\n", statsFilename);
+        return EXIT_TROUBLE;
+    }
+    if(out.failed())
+    {
+        fprintf(stderr, "frisk-cli: couldn't write the output\n");
+        return EXIT_TROUBLE;
+    }
+    if(buildIndex)
+        return EXIT_MATCHED;
+    return context.filesWithHits() ? EXIT_MATCHED : EXIT_NO_MATCH;
+}
@@ -0,0 +1,529 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+// frisk-microbench: times the engine's hot loops one at a time, on generated inputs of a few
+// sizes, with no disk or threads in the way (readEntireFile aside, which reads the same file over
+// and over, so it's the page cache being measured). Prints ns/op, ns/byte and allocations/op as
+// JSON on stdout. Like frisk-bench, the inputs never change, so results line up across commits.
+
+#include "BenchRandom.h"
+#include "SearchContext.h"
+#include "TextScan.h"
+#include "cJSON.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#define INPUT_SEED (0x4d494352) // 'MICR'
+#define DEFAULT_TRIAL_MS (100)
+#define TRIALS (5)
+#define SCRATCH_FILENAME "frisk-microbench.tmp"
+
+// ------------------------------------------------------------------------------------------------
+// Allocation counting. Every thread counts its own, and timeOps() only reads the one it runs on, so
+// an allocation made on any other thread can neither race on the count nor land in a kernel's
+// allocations/op.
+
+static thread_local s64 sAllocations = 0;
+
+void *operator new(size_t size)
+{
+    sAllocations++;
+    void *p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    free(p);
+}
+
+// Results get folded in here, so the compiler can't decide the work isn't needed
+static volatile size_t sSink = 0;
+
+// ------------------------------------------------------------------------------------------------
+// Inputs
+
+static const char *sWords[] =
+{
+    "buffer", "count", "index", "length", "offset", "result", "value", "state", "node", "list",
+    "file", "line", "match", "search", "window", "thread", "queue", "table", "entry", "block",
+    "return", "static", "const", "struct", "while", "break", "size_t", "char", "int", "void",
+};
+static const int sWordCount = sizeof(sWords) / sizeof(sWords[0]);
+
+// Lines of words, size bytes in all; nothing any of the kernels below is told to find is in here
+static std::string makeText(size_t size)
+{
+    BenchRandom random(INPUT_SEED);
+    std::string text;
+    text.reserve(size + 64);
+    while(text.size() < size)
+    {
+        int words = 2 + random.range(12);
+        for(int i = 0; i < words; ++i)
+        {
+            if(i)
+                text += ' ';
+            text += sWords[random.range(sWordCount)];
+        }
+        text += '\n';
+    }
+    text.resize(size);
+    return text;
+}
+
+// Paths shaped like a source tree, as DirectoryWalker would hand them to FilespecMatcher
+static void makeFilenames(int count, StringList &directories, StringList &names)
+{
+    static const char *extensions[] = { ".c", ".h", ".cpp", ".txt", ".o", ".log", ".png", "" };
+    BenchRandom random(INPUT_SEED);
+    char buffer[256];
+    for(int i = 0; i < count; ++i)
+    {
+        sprintf(buffer, "src%cmodule%02d%c%s", PLATFORM_PATH_SEPARATOR, random.range(16), PLATFORM_PATH_SEPARATOR, sWords[random.range(sWordCount)]);
+        directories.push_back(buffer);
+        sprintf(buffer, "%s_%s%s", sWords[random.range(sWordCount)], random.chance(20) ? "test1" : "impl", extensions[random.range(8)]);
+        names.push_back(buffer);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Kernels
+
+// One thing to time, at one size. run() is a single op; bytes() is how much input an op covers.
+class Kernel
+{
+public:
+    Kernel(const char *name, size_t size) : name_(name), size_(size) {}
+    virtual ~Kernel() {}
+
+    virtual void run() = 0;
+    virtual size_t bytes() const { return size_; }
+
+    const char *name() const { return name_; }
+    size_t size() const { return size_; }
+
+protected:
+    const char *name_;
+    size_t size_;
+};
+
+typedef std::vector<Kernel *> KernelList;
+
+class LiteralFindKernel : public Kernel
+{
+public:
+    LiteralFindKernel(const char *name, size_t size, bool caseSensitive)
+    : Kernel(name, size)
+    , text_(makeText(size))
+    {
+        matcher_.set("zqx_missing", caseSensitive);
+    }
+
+    virtual void run()
+    {
+        sSink += (size_t)matcher_.find(text_.data(), text_.data() + text_.size());
+    }
+
+protected:
+    std::string text_;
+    LiteralMatcher matcher_;
+};
+
+class MultiLiteralFindKernel : public Kernel
+{
+public:
+    MultiLiteralFindKernel(size_t size)
+    : Kernel("multi-literal-find", size)
+    , text_(makeText(size))
+    {
+        static const char *needles[] = { "zqx_missing", "sizeof", "TODO", "FIXME", "errno", "mutex", "printf", "assert" };
+        StringList list(needles, needles + (sizeof(needles) / sizeof(needles[0])));
+        matcher_.set(list, false);
+    }
+
+    virtual void run()
+    {
+        int which;
+        sSink += (size_t)matcher_.find(text_.data(), text_.data() + text_.size(), which);
+    }
+
+protected:
+    std::string text_;
+    MultiLiteralMatcher matcher_;
+};
+
+class CountNewlinesKernel : public Kernel
+{
+public:
+    CountNewlinesKernel(size_t size)
+    : Kernel("count-newlines", size)
+    , text_(makeText(size))
+    {
+    }
+
+    virtual void run()
+    {
+        sSink += (size_t)countNewlines(text_.data(), text_.data() + text_.size());
+    }
+
+protected:
+    std::string text_;
+};
+
+class LooksBinaryKernel : public Kernel
+{
+public:
+    LooksBinaryKernel(size_t size)
+    : Kernel("looks-binary", size)
+    , text_(makeText(size))
+    {
+    }
+
+    virtual void run()
+    {
+        sSink += looksBinary(text_.data(), text_.size()) ? 1 : 0;
+    }
+
+protected:
+    std::string text_;
+};
+
+// size is the number of paths; an op checks all of them
+class FilespecKernel : public Kernel
+{
+public:
+    FilespecKernel(const char *name, size_t size, const char *filespecs, bool regexes)
+    : Kernel(name, size)
+    , bytes_(0)
+    {
+        makeFilenames((int)size, directories_, names_);
+        for(size_t i = 0; i < names_.size(); ++i)
+            bytes_ += names_[i].length();
+
+        StringList specs;
+        specs.push_back(filespecs);
+        std::string error;
+        if(!matcher_.set(specs, regexes, false, error))
+            fprintf(stderr, "frisk-microbench: %s: %s\n", name, error.c_str());
+    }
+
+    virtual void run()
+    {
+        for(size_t i = 0; i < names_.size(); ++i)
+            sSink += matcher_.matches(directories_[i], names_[i]) ? 1 : 0;
+    }
+
+    virtual size_t bytes() const { return bytes_; }
+
+protected:
+    StringList directories_;
+    StringList names_;
+    size_t bytes_;
+    FilespecMatcher matcher_;
+};
+
+// size is the length of the line; there's a highlight every 40 bytes or so
+class HighlightKernel : public Kernel
+{
+public:
+    HighlightKernel(size_t size)
+    : Kernel("add-highlighted-blocks", size)
+    , text_(makeText(size))
+    {
+        for(int offset = 20; (offset + 5) <= (int)size; offset += 40)
+        {
+            TextSpan span = { offset, 5 };
+            spans_.push_back(span);
+        }
+    }
+
+    virtual void run()
+    {
+        blocks_.clear();
+        blocks_.addHighlightedBlocks(text_.data(), (int)text_.size(), spans_.empty() ? NULL : &spans_[0], (int)spans_.size(), 1, 2, true);
+        sSink += blocks_.blocks.size();
+    }
+
+protected:
+    std::string text_;
+    std::vector<TextSpan> spans_;
+    TextBlockList blocks_; // reused, the way a batch is between files
+};
+
+// Gets at a SearchContext's innards, so makePretty() can be fed a file of output by hand
+class PrettyContext : public SearchContext
+{
+public:
+    PrettyContext()
+    : SearchContext(NULL)
+    {
+        files_.push_back(std::string("src") + PLATFORM_PATH_SEPARATOR + "module00" + PLATFORM_PATH_SEPARATOR + "buffer_impl.c");
+    }
+
+    void startFile()
+    {
+        lastFile_ = -1;
+        lastLine_ = 0;
+    }
+};
+
+// size is the length of each line; an op is a file's worth (64 of them, with 2 hits apiece) going
+// through makePretty() into a fresh TextBlockList, like append() does
+class MakePrettyKernel : public Kernel
+{
+public:
+    MakePrettyKernel(size_t size)
+    : Kernel("make-pretty", size)
+    {
+        std::string text = makeText(size * 64);
+        for(int i = 0; i < 64; ++i)
+        {
+            SearchEntry &entry = results_.addLine(i + 1, false, text.data() + (i * size), size);
+            entry.file_ = 0;
+            int half = (int)size / 2;
+            for(int hit = 0; (hit < 2) && (half >= 4); ++hit)
+            {
+                TextSpan span = { hit * half, 4 };
+                results_.spans.push_back(span);
+                entry.spanCount_++;
+            }
+        }
+    }
+
+    virtual void run()
+    {
+        TextBlockList blocks;
+        context_.startFile();
+        for(SearchList::const_iterator it = results_.entries.begin(); it != results_.entries.end(); ++it)
+            sSink += (size_t)context_.makePretty(results_, *it, blocks);
+    }
+
+    virtual size_t bytes() const { return results_.text.size(); }
+
+protected:
+    SearchResults results_;
+    PrettyContext context_;
+};
+
+class ReadEntireFileKernel : public Kernel
+{
+public:
+    ReadEntireFileKernel(size_t size)
+    : Kernel("read-entire-file", size)
+    {
+        if(!writeEntireFile(SCRATCH_FILENAME, makeText(size)))
+            fprintf(stderr, "frisk-microbench: couldn't write %s\n", SCRATCH_FILENAME);
+    }
+
+    ~ReadEntireFileKernel()
+    {
+        remove(SCRATCH_FILENAME);
+    }
+
+    virtual void run()
+    {
+        std::string contents;
+        readEntireFile(SCRATCH_FILENAME, contents, 0);
+        sSink += contents.size();
+    }
+};
+
+// Everything, in the order it's reported. Built lazily, since some inputs are big.
+static Kernel *createKernel(int index)
+{
+    static const size_t textSizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    static const size_t lineSizes[] = { 40, 200, 2000 };
+    static const size_t nameCounts[] = { 1024 };
+    static const size_t fileSizes[] = { 4 * 1024, 256 * 1024, 16 * 1024 * 1024 };
+
+    for(int i = 0; i < 4; ++i, index -= 4)
+    {
+        if(index < 4)
+        {
+            size_t size = textSizes[index];
+            switch(i)
+            {
+                case 0: return new LiteralFindKernel("literal-find", size, true);
+                case 1: return new LiteralFindKernel("literal-find-nocase", size, false);
+                case 2: return new MultiLiteralFindKernel(size);
+                case 3: return new CountNewlinesKernel(size);
+            }
+        }
+    }
+    if(index-- == 0)
+        return new LooksBinaryKernel(4 * 1024);
+    if(index-- == 0)
+        return new FilespecKernel("filespec-extensions", nameCounts[0], "*.c;*.h;*.cpp", false);
+    if(index-- == 0)
+        return new FilespecKernel("filespec-glob", nameCounts[0], "*_test?.c;*impl*.h", false);
+    if(index-- == 0)
+        return new FilespecKernel("filespec-regex", nameCounts[0], "\\.(c|h|cpp)$", true);
+    if(index < 3)
+        return new HighlightKernel(lineSizes[index] * 10);
+    index -= 3;
+    if(index < 3)
+        return new MakePrettyKernel(lineSizes[index]);
+    index -= 3;
+    if(index < 3)
+        return new ReadEntireFileKernel(fileSizes[index]);
+    return NULL;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+struct KernelTiming
+{
+    double nsPerOp;
+    double allocationsPerOp;
+};
+
+static double timeOps(Kernel &kernel, s64 ops, s64 &allocations)
+{
+    s64 allocationsBefore = sAllocations;
+    double start = platformSeconds();
+    for(s64 i = 0; i < ops; ++i)
+        kernel.run();
+    double seconds = platformSeconds() - start;
+    allocations = sAllocations - allocationsBefore;
+    return seconds;
+}
+
+// Finds how many ops take about trialMs, then keeps the fastest of a few trials of that many
+static KernelTiming timeKernel(Kernel &kernel, int trialMs)
+{
+    s64 allocations;
+    s64 ops = 1;
+    double target = trialMs / 1000.0;
+    double seconds = timeOps(kernel, ops, allocations);
+    while(seconds < (target / 10))
+    {
+        ops *= 2;
+        seconds = timeOps(kernel, ops, allocations);
+    }
+    ops = (s64)(ops * (target / seconds)) + 1;
+
+    KernelTiming timing;
+    timing.nsPerOp = 0;
+    timing.allocationsPerOp = 0;
+    for(int trial = 0; trial < TRIALS; ++trial)
+    {
+        seconds = timeOps(kernel, ops, allocations);
+        double nsPerOp = (seconds * 1000000000.0) / (double)ops;
+        if(!trial || (nsPerOp < timing.nsPerOp))
+            timing.nsPerOp = nsPerOp;
+        timing.allocationsPerOp = (double)allocations / (double)ops;
+    }
+    return timing;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: frisk-microbench [options]\n"
+        "\n"
+        "Times each of the engine's kernels at a few input sizes, and prints the results as JSON.\n"
+        "\n"
+        "  --filter TEXT   only kernels with TEXT in their names\n"
+        "  --time MS       how long each of the %d trials should take (default %d)\n"
+        "  --list          list the kernels and sizes, without timing them\n"
+        "  -h, --help      this\n",
+        TRIALS, DEFAULT_TRIAL_MS);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL;
+    int trialMs = DEFAULT_TRIAL_MS;
+    bool list = false;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        bool hasValue = (i + 1) < argc;
+        if(!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+        {
+            usage();
+            return 0;
+        }
+        else if(!strcmp(arg, "--list"))
+            list = true;
+        else if(!strcmp(arg, "--filter") && hasValue)
+            filter = argv[++i];
+        else if(!strcmp(arg, "--time") && hasValue)
+            trialMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "frisk-microbench: bad option %s (try --help)\n", arg);
+            return 1;
+        }
+    }
+    if(trialMs < 1)
+    {
+        fprintf(stderr, "frisk-microbench: --time needs to be at least 1\n");
+        return 1;
+    }
+
+    cJSON *report = cJSON_CreateObject();
+    cJSON_AddStringToObject(report, "benchmark", "frisk-microbench");
+    cJSON_AddStringToObject(report, "literal_engine", LiteralMatcher::engine());
+    cJSON *kernels = cJSON_CreateArray();
+    cJSON_AddItemToObject(report, "kernels", kernels);
+
+    Kernel *kernel;
+    for(int index = 0; (kernel = createKernel(index)) != NULL; ++index)
+    {
+        if(filter && !strstr(kernel->name(), filter))
+        {
+            delete kernel;
+            continue;
+        }
+        if(list)
+        {
+            printf("%s %u\n", kernel->name(), (unsigned int)kernel->size());
+            delete kernel;
+            continue;
+        }
+
+        fprintf(stderr, "frisk-microbench: %s %u\n", kernel->name(), (unsigned int)kernel->size());
+        KernelTiming timing = timeKernel(*kernel, trialMs);
+
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "name", kernel->name());
+        cJSON_AddNumberToObject(json, "size", (double)kernel->size());
+        cJSON_AddNumberToObject(json, "bytes_per_op", (double)kernel->bytes());
+        cJSON_AddNumberToObject(json, "ns_per_op", timing.nsPerOp);
+        cJSON_AddNumberToObject(json, "ns_per_byte", kernel->bytes() ? (timing.nsPerOp / (double)kernel->bytes()) : 0);
+        cJSON_AddNumberToObject(json, "allocations_per_op", timing.allocationsPerOp);
+        cJSON_AddItemToArray(kernels, json);
+        delete kernel;
+    }
+
+    if(!list)
+    {
+        char *text = cJSON_Print(report);
+        printf("%s\n", text);
+        free(text);
+    }
+    cJSON_Delete(report);
+    return 0;
+}
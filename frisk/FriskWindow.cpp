@@ -11,6 +11,10 @@
 
 #include <Commdlg.h>
 
+// Output is picked up from the search thread on a timer, about once a frame
+#define OUTPUT_TIMER_ID (1)
+#define OUTPUT_TIMER_MS (16)
+
 static FriskWindow *sWindow = NULL;
 
 // ------------------------------------------------------------------------------------------------
@@ -50,6 +54,21 @@ void setWindowText(HWND ctrl, const std::string &s)
     SetWindowText(ctrl, s.c_str());
 }
 
+// Limits show up blank when there isn't one
+static void setLimitText(HWND ctrl, int limit)
+{
+    char buffer[32] = "";
+    if(limit > 0)
+        sprintf(buffer, "%d", limit);
+    SetWindowText(ctrl, buffer);
+}
+
+static int getLimitText(HWND ctrl)
+{
+    int limit = atoi(getWindowText(ctrl).c_str());
+    return (limit > 0) ? limit : 0;
+}
+
 static void comboClear(HWND ctrl)
 {
     SendMessage(ctrl, CB_RESETCONTENT, 0, 0);
@@ -114,12 +133,26 @@ FriskWindow::FriskWindow(HINSTANCE instance)
 FriskWindow::~FriskWindow()
 {
     DeleteObject(font_);
+    if(context_)
+        context_->config().save();
     delete context_;
     sWindow = NULL;
 }
 
 // ------------------------------------------------------------------------------------------------
 
+void FriskWindow::searchStateChanged(bool running)
+{
+    PostMessage(dialog_, WM_SEARCHCONTEXT_STATE, running ? 1 : 0, 0);
+}
+
+void FriskWindow::searchFailed(const std::string &title, const std::string &error)
+{
+    MessageBox(dialog_, error.c_str(), title.c_str(), MB_OK);
+}
+
+// ------------------------------------------------------------------------------------------------
+
 void FriskWindow::outputClear()
 {
     CHARRANGE charRange;
@@ -160,13 +193,21 @@ int FriskWindow::flagsFromControls()
         | SF_FILESPEC_CASE_SENSITIVE
         | SF_MATCH_REGEXES
         | SF_MATCH_CASE_SENSITIVE
-        | SF_BACKUP);
+        | SF_MATCH_LIST
+        | SF_BACKUP
+        | SF_WATCH
+        | SF_FILES_WITH_MATCHES
+        | SF_COUNT_ONLY);
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_RECURSIVE)))      flags |= SF_RECURSIVE;
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_FILESPEC_REGEX))) flags |= SF_FILESPEC_REGEXES;
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_FILESPEC_CASE)))  flags |= SF_FILESPEC_CASE_SENSITIVE;
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_MATCH_REGEXES)))  flags |= SF_MATCH_REGEXES;
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_MATCH_CASE)))     flags |= SF_MATCH_CASE_SENSITIVE;
+    if(ctrlIsChecked(GetDlgItem(dialog_, IDC_MATCH_LIST)))     flags |= SF_MATCH_LIST;
     if(ctrlIsChecked(GetDlgItem(dialog_, IDC_BACKUP)))         flags |= SF_BACKUP;
+    if(ctrlIsChecked(GetDlgItem(dialog_, IDC_WATCH)))          flags |= SF_WATCH;
+    if(ctrlIsChecked(GetDlgItem(dialog_, IDC_FILES_WITH_MATCHES))) flags |= SF_FILES_WITH_MATCHES;
+    if(ctrlIsChecked(GetDlgItem(dialog_, IDC_COUNT_ONLY)))     flags |= SF_COUNT_ONLY;
 
     return flags;
 }
@@ -178,7 +219,11 @@ void FriskWindow::flagsToControls(int flags)
     checkCtrl(GetDlgItem(dialog_, IDC_FILESPEC_CASE),  0 != (flags & SF_FILESPEC_CASE_SENSITIVE));
     checkCtrl(GetDlgItem(dialog_, IDC_MATCH_REGEXES),  0 != (flags & SF_MATCH_REGEXES));
     checkCtrl(GetDlgItem(dialog_, IDC_MATCH_CASE),     0 != (flags & SF_MATCH_CASE_SENSITIVE));
+    checkCtrl(GetDlgItem(dialog_, IDC_MATCH_LIST),     0 != (flags & SF_MATCH_LIST));
     checkCtrl(GetDlgItem(dialog_, IDC_BACKUP),         0 != (flags & SF_BACKUP));
+    checkCtrl(GetDlgItem(dialog_, IDC_WATCH),          0 != (flags & SF_WATCH));
+    checkCtrl(GetDlgItem(dialog_, IDC_FILES_WITH_MATCHES), 0 != (flags & SF_FILES_WITH_MATCHES));
+    checkCtrl(GetDlgItem(dialog_, IDC_COUNT_ONLY),     0 != (flags & SF_COUNT_ONLY));
 }
 
 void FriskWindow::configToControls()
@@ -189,6 +234,8 @@ void FriskWindow::configToControls()
     comboSet(replaceCtrl_, config_->replaces_);
     comboSet(backupExtCtrl_, config_->backupExtensions_);
     comboSet(fileSizesCtrl_, config_->fileSizes_);
+    setLimitText(maxHitsPerFileCtrl_, config_->maxHitsPerFile_);
+    setLimitText(maxResultsCtrl_, config_->maxResults_);
     flagsToControls(config_->flags_);
 }
 
@@ -200,6 +247,8 @@ void FriskWindow::controlsToConfig()
     comboLRU(replaceCtrl_, config_->replaces_, 10);
     comboLRU(backupExtCtrl_, config_->backupExtensions_, 10);
     comboLRU(fileSizesCtrl_, config_->fileSizes_, 10);
+    config_->maxHitsPerFile_ = getLimitText(maxHitsPerFileCtrl_);
+    config_->maxResults_ = getLimitText(maxResultsCtrl_);
     config_->flags_ = flagsFromControls();
 }
 
@@ -236,8 +285,9 @@ void FriskWindow::updateState(const std::string &progress)
 INT_PTR FriskWindow::onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam)
 {
     dialog_            = hDlg;
-    context_           = new SearchContext(dialog_);
+    context_           = new SearchContext(this);
     config_            = &(context_->config());
+    config_->load();
     outputCtrl_        = GetDlgItem(hDlg, IDC_OUTPUT);
     pathCtrl_          = GetDlgItem(hDlg, IDC_PATH);
     filespecCtrl_      = GetDlgItem(hDlg, IDC_FILESPEC);
@@ -246,6 +296,8 @@ INT_PTR FriskWindow::onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam)
     replaceCtrl_       = GetDlgItem(hDlg, IDC_REPLACE);
     backupExtCtrl_     = GetDlgItem(hDlg, IDC_BACKUP_EXT);
     fileSizesCtrl_     = GetDlgItem(hDlg, IDC_FILESIZE);
+    maxHitsPerFileCtrl_ = GetDlgItem(hDlg, IDC_MAX_HITS_PER_FILE);
+    maxResultsCtrl_    = GetDlgItem(hDlg, IDC_MAX_RESULTS);
     savedSearchesCtrl_ = GetDlgItem(hDlg, IDC_SAVEDSEARCHES);
 
     HDC dc = GetDC(NULL);
@@ -260,6 +312,8 @@ INT_PTR FriskWindow::onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam)
     SendMessage(replaceCtrl_,       WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
     SendMessage(backupExtCtrl_,     WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
     SendMessage(savedSearchesCtrl_, WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
+    SendMessage(maxHitsPerFileCtrl_, WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
+    SendMessage(maxResultsCtrl_,    WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
 
     // SendMessage(GetDlgItem(dialog_, IDC_RECURSIVE),      WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
     // SendMessage(GetDlgItem(dialog_, IDC_FILESPEC_REGEX), WM_SETFONT, (WPARAM)font_, MAKEWORD(TRUE, 0));
@@ -278,6 +332,7 @@ INT_PTR FriskWindow::onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam)
     SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&charRange);
 
     SendMessage(outputCtrl_, EM_AUTOURLDETECT, 0, 0);
+    SetTimer(dialog_, OUTPUT_TIMER_ID, OUTPUT_TIMER_MS, NULL);
 
     ReleaseDC(NULL, dc);
 
@@ -311,7 +366,7 @@ INT_PTR FriskWindow::onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam)
     return TRUE;
 }
 
-void FriskWindow::appendText(const std::string &text, int color, bool link)
+void FriskWindow::appendBlocks(const TextBlockList &blocks)
 {
     // Find out where the last character position is (for appending)
     GETTEXTLENGTHEX textLengthEx;
@@ -319,36 +374,48 @@ void FriskWindow::appendText(const std::string &text, int color, bool link)
     textLengthEx.flags = GTL_NUMCHARS;
     int textLength = SendMessage(outputCtrl_, EM_GETTEXTLENGTHEX, (WPARAM)&textLengthEx, 0);
 
-    // Move the caret to the end of the text
+    insertBlocks(textLength, blocks);
+}
+
+void FriskWindow::insertBlocks(int position, const TextBlockList &blocks)
+{
+    // Move the caret to the insertion point
     CHARRANGE charRange;
-    charRange.cpMin = textLength;
-    charRange.cpMax = textLength;
+    charRange.cpMin = position;
+    charRange.cpMax = position;
     SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&charRange);
 
-    // Append the incoming text
-    SendMessage(outputCtrl_, EM_REPLACESEL, FALSE, (LPARAM)text.c_str());
-
-    charRange.cpMax += text.size();
-    SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&charRange);
+    // Insert all of the incoming text at once, then color it a block at a time
+    SendMessage(outputCtrl_, EM_REPLACESEL, FALSE, (LPARAM)blocks.text.c_str());
 
-    CHARFORMAT2 charFormat;
-    ZeroMemory(&charFormat, sizeof(charFormat));
-    charFormat.cbSize = sizeof(charFormat);
-    charFormat.dwMask = CFM_FACE|CFM_EFFECTS|CFM_COLOR|CFM_SIZE|CFM_UNDERLINETYPE;
-    charFormat.crTextColor = color;
-    charFormat.dwEffects = 0;
-    charFormat.yHeight = config_->textSize_ * 20;
-    strcpy(charFormat.szFaceName, config_->fontFamily_.c_str());
-    SendMessage(outputCtrl_, EM_SETCHARFORMAT, SCF_SELECTION, (LPARAM)&charFormat);
-
-    if(link)
+    for(std::vector<TextBlock>::const_iterator it = blocks.blocks.begin(); it != blocks.blocks.end(); ++it)
     {
+        if(!it->length)
+            continue;
+
+        charRange.cpMin = position + it->start;
+        charRange.cpMax = charRange.cpMin + it->length;
+        SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&charRange);
+
         CHARFORMAT2 charFormat;
         ZeroMemory(&charFormat, sizeof(charFormat));
         charFormat.cbSize = sizeof(charFormat);
-        charFormat.dwMask = CFM_EFFECTS;
-        charFormat.dwEffects = CFE_LINK;
+        charFormat.dwMask = CFM_FACE|CFM_EFFECTS|CFM_COLOR|CFM_SIZE|CFM_UNDERLINETYPE;
+        charFormat.crTextColor = it->color;
+        charFormat.dwEffects = 0;
+        charFormat.yHeight = config_->textSize_ * 20;
+        strcpy(charFormat.szFaceName, config_->fontFamily_.c_str());
         SendMessage(outputCtrl_, EM_SETCHARFORMAT, SCF_SELECTION, (LPARAM)&charFormat);
+
+        if(it->link)
+        {
+            CHARFORMAT2 charFormat;
+            ZeroMemory(&charFormat, sizeof(charFormat));
+            charFormat.cbSize = sizeof(charFormat);
+            charFormat.dwMask = CFM_EFFECTS;
+            charFormat.dwEffects = CFE_LINK;
+            SendMessage(outputCtrl_, EM_SETCHARFORMAT, SCF_SELECTION, (LPARAM)&charFormat);
+        }
     }
 }
 
@@ -391,45 +458,98 @@ void FriskWindow::updateSavedSearchControl()
     }
 }
 
-INT_PTR FriskWindow::onPoke(WPARAM wParam, LPARAM lParam)
+// Shows everything the search thread has published since last time, under a single redraw
+void FriskWindow::drainOutput()
 {
-    PokeData *pokeData = (PokeData *)lParam;
+    PokeData *pokeData = context_->receivePoke();
+    if(!pokeData)
+        return;
 
-    if(wParam != context_->searchID())
-        return FALSE;
+    bool current = false;
+    bool redrawDisabled = false;
+    std::string progress;
+    CHARRANGE prevRange;
+    POINT prevScrollPos;
+    for(; pokeData; pokeData = context_->receivePoke())
+    {
+        if(pokeData->id != context_->searchID())
+        {
+            context_->recyclePoke(pokeData);
+            continue;
+        }
 
-    updateState(pokeData->progress);
+        current = true;
+        progress = pokeData->progress;
 
-    if(pokeData->textBlocks.empty())
-        return TRUE;
+        if(!pokeData->textBlocks.empty() || (pokeData->patchStart >= 0))
+        {
+            if(!redrawDisabled)
+            {
+                // Disable redrawing briefly
+                SendMessage(outputCtrl_, WM_SETREDRAW, FALSE, 0);
+                redrawDisabled = true;
 
-    // Disable redrawing briefly
-    SendMessage(outputCtrl_, WM_SETREDRAW, FALSE, 0);
+                // Stash off the previous caret and scroll positions
+                SendMessage(outputCtrl_, EM_EXGETSEL, 0, (LPARAM)&prevRange);
+                SendMessage(outputCtrl_, EM_GETSCROLLPOS, 0, (LPARAM)&prevScrollPos);
+            }
 
-    // Stash off the previous caret and scroll positions
-    CHARRANGE prevRange;
-    SendMessage(outputCtrl_, EM_EXGETSEL, 0, (LPARAM)&prevRange);
-    POINT prevScrollPos;
-    SendMessage(outputCtrl_, EM_GETSCROLLPOS, 0, (LPARAM)&prevScrollPos);
+            if(pokeData->patchStart >= 0)
+            {
+                // A watched file changed; swap its old output for the new
+                CHARRANGE charRange;
+                charRange.cpMin = pokeData->patchStart;
+                charRange.cpMax = pokeData->patchStart + pokeData->patchLength;
+                SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&charRange);
+                SendMessage(outputCtrl_, EM_REPLACESEL, FALSE, (LPARAM)"");
 
-    for(TextBlockList::iterator it = pokeData->textBlocks.begin(); it != pokeData->textBlocks.end(); it++)
+                insertBlocks(pokeData->patchStart, pokeData->textBlocks);
+
+                // Keep the caret on the same text, if it was after the change
+                if(prevRange.cpMin >= charRange.cpMax)
+                {
+                    int delta = (int)pokeData->textBlocks.text.size() - pokeData->patchLength;
+                    prevRange.cpMin += delta;
+                    prevRange.cpMax += delta;
+                }
+            }
+            else
+            {
+                appendBlocks(pokeData->textBlocks);
+            }
+        }
+        context_->recyclePoke(pokeData);
+    }
+
+    if(current)
+        updateState(progress);
+
+    if(redrawDisabled)
     {
-        appendText(it->text, it->color, it->link);
+        // Move the caret/selection back to where it was, and scroll to the previous view
+        SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&prevRange);
+        SendMessage(outputCtrl_, EM_SETSCROLLPOS, 0, (LPARAM)&prevScrollPos);
+
+        // Reenable redrawing and invalidate the window's contents
+        SendMessage(outputCtrl_, WM_SETREDRAW, TRUE, 0);
+        InvalidateRect(outputCtrl_, NULL, TRUE);
     }
-    delete pokeData;
+}
 
-    // Move the caret/selection back to where it was, and scroll to the previous view
-    SendMessage(outputCtrl_, EM_EXSETSEL, 0, (LPARAM)&prevRange);
-    SendMessage(outputCtrl_, EM_SETSCROLLPOS, 0, (LPARAM)&prevScrollPos);
+INT_PTR FriskWindow::onTimer(WPARAM wParam, LPARAM lParam)
+{
+    if(wParam != OUTPUT_TIMER_ID)
+        return FALSE;
 
-    // Reenable redrawing and invalidate the window's contents
-    SendMessage(outputCtrl_, WM_SETREDRAW, TRUE, 0);
-    InvalidateRect(outputCtrl_, NULL, TRUE);
+    drainOutput();
     return TRUE;
 }
 
 INT_PTR FriskWindow::onState(WPARAM wParam, LPARAM lParam)
 {
+    // Everything the search said before changing state should be showing first
+    drainOutput();
+
     running_ = (wParam != 0);
     updateState();
     return TRUE;
@@ -512,7 +632,15 @@ void FriskWindow::onCancel()
 
 void FriskWindow::search(int extraFlags)
 {
-    if(!hasWindowText(matchCtrl_)
+    if(extraFlags & SF_BUILD_INDEX)
+    {
+        if(!hasWindowText(pathCtrl_))
+        {
+            MessageBox(dialog_, "Please fill out Where.", "Not so fast!", MB_OK);
+            return;
+        }
+    }
+    else if(!hasWindowText(matchCtrl_)
     || !hasWindowText(pathCtrl_)
     || !hasWindowText(filespecCtrl_))
     {
@@ -538,6 +666,8 @@ void FriskWindow::search(int extraFlags)
     params.maxFileSize = atoi(config_->fileSizes_[0].c_str());
     if(params.maxFileSize < 0)
         params.maxFileSize = 0;
+    params.maxHitsPerFile = config_->maxHitsPerFile_;
+    params.maxResults = config_->maxResults_;
     context_->search(params);
 
     updateState();
@@ -554,6 +684,11 @@ void FriskWindow::onReplace()
         search(SF_REPLACE);
 }
 
+void FriskWindow::onBuildIndex()
+{
+    search(SF_BUILD_INDEX);
+}
+
 void FriskWindow::onSettings()
 {
     SettingsWindow settings(instance_, dialog_, config_);
@@ -618,6 +753,8 @@ void FriskWindow::onLoad()
             setWindowText(fileSizesCtrl_, it->fileSize);
             setWindowText(replaceCtrl_, it->replace);
             setWindowText(backupExtCtrl_, it->backupExtension);
+            setLimitText(maxHitsPerFileCtrl_, it->maxHitsPerFile);
+            setLimitText(maxResultsCtrl_, it->maxResults);
             flagsToControls(it->flags);
 
             SendMessage(dialog_, WM_SETFOCUS, (WPARAM)matchCtrl_, 0);
@@ -647,6 +784,8 @@ void FriskWindow::onSave()
     savedSearch.replace = getWindowText(replaceCtrl_);
     savedSearch.backupExtension = getWindowText(backupExtCtrl_);
     savedSearch.flags = flagsFromControls();
+    savedSearch.maxHitsPerFile = getLimitText(maxHitsPerFileCtrl_);
+    savedSearch.maxResults = getLimitText(maxResultsCtrl_);
     config_->savedSearches_.push_back(savedSearch);
 
     updateSavedSearchControl();
@@ -675,25 +814,16 @@ void FriskWindow::onSavedSearch(WPARAM wParam, LPARAM lParam)
 
 void FriskWindow::onClickLink(int offset)
 {
-    context_->lock();
-    SearchList &list = context_->list();
-    const SearchEntry *entry = NULL;
-    for(SearchList::const_iterator it = list.begin(); it != list.end(); ++it)
-    {
-        if(it->offset_ > offset)
-        {
-            entry = &(*it);
-            break;
-        }
-    }
-    if(entry)
+    std::string filename;
+    int line;
+    if(context_->findLine(offset, filename, line))
     {
         //std::string cmd = "c:\\vim\\vim73\\gvim.exe --remote-silent +!LINE! +zz \"!FILENAME!\"";
         std::string cmd = config_->cmdTemplate_;
         char lineBuffer[32];
-        sprintf(lineBuffer, "%d", entry->line_);
+        sprintf(lineBuffer, "%d", line);
         replaceAll(cmd, "!LINE!", lineBuffer);
-        replaceAll(cmd, "!FILENAME!", entry->filename_.c_str());
+        replaceAll(cmd, "!FILENAME!", filename.c_str());
 
 #if 0
 //        MessageBox(NULL, cmd.c_str(), "wat", MB_OK);
@@ -709,7 +839,6 @@ void FriskWindow::onClickLink(int offset)
         }
 #endif
     }
-    context_->unlock();
 }
 
 void FriskWindow::checkClick()
@@ -729,7 +858,7 @@ static INT_PTR CALLBACK FriskProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
     switch (message)
     {
         processMessageH(WM_INITDIALOG, onInitDialog);
-        processMessage(WM_SEARCHCONTEXT_POKE, onPoke);
+        processMessage(WM_TIMER, onTimer);
         processMessage(WM_SEARCHCONTEXT_STATE, onState);
         processMessage(WM_NOTIFY, onNotify);
         processMessage(WM_MOVE, onMove);
@@ -743,6 +872,7 @@ static INT_PTR CALLBACK FriskProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
                 processCommand(IDC_SEARCH, onSearch);
                 processCommand(IDC_DOREPLACE, onReplace);
                 processCommand(IDC_SETTINGS, onSettings);
+                processCommand(IDC_BUILD_INDEX, onBuildIndex);
                 processCommand(IDC_BROWSE, onBrowse);
                 processCommand(IDC_STOP, onStop);
                 processCommand(IDC_LOAD, onLoad);
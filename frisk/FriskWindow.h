@@ -14,12 +14,18 @@
 
 #include "SearchContext.h"
 
-class FriskWindow
+#define WM_SEARCHCONTEXT_STATE (WM_USER+1)
+
+class FriskWindow : public SearchObserver
 {
 public:
     FriskWindow(HINSTANCE instance);
     ~FriskWindow();
 
+    // SearchObserver; these just hand things over to the UI thread
+    virtual void searchStateChanged(bool running);
+    virtual void searchFailed(const std::string &title, const std::string &error);
+
     void show();
 
     void outputClear();
@@ -32,10 +38,12 @@ public:
     void updateState(const std::string &progress = "");
     void checkClick();
 
-	void appendText(const std::string &text, int color, bool link = false);
+	void appendBlocks(const TextBlockList &blocks);
+	void insertBlocks(int position, const TextBlockList &blocks);
+	void drainOutput();
 
     INT_PTR onInitDialog(HWND hDlg, WPARAM wParam, LPARAM lParam);
-    INT_PTR onPoke(WPARAM wParam, LPARAM lParam);
+    INT_PTR onTimer(WPARAM wParam, LPARAM lParam);
     INT_PTR onState(WPARAM wParam, LPARAM lParam);
     INT_PTR onNotify(WPARAM wParam, LPARAM lParam);
     INT_PTR onMove(WPARAM wParam, LPARAM lParam);
@@ -55,6 +63,7 @@ public:
     void onReplace();
     void onClickLink(int offset);
     void onSettings();
+    void onBuildIndex();
     void onBrowse();
 	void onStop();
 	void onSave();
@@ -73,6 +82,8 @@ protected:
     HWND replaceCtrl_;
 	HWND backupExtCtrl_;
     HWND fileSizesCtrl_;
+    HWND maxHitsPerFileCtrl_;
+    HWND maxResultsCtrl_;
 	HWND savedSearchesCtrl_;
     SearchContext *context_;
     SearchConfig *config_;
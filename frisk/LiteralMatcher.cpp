@@ -0,0 +1,301 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "LiteralMatcher.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define LITERAL_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+enum LiteralEngine
+{
+    ENGINE_UNKNOWN = 0,
+    ENGINE_SCALAR,
+    ENGINE_SSE2,
+    ENGINE_AVX2
+};
+
+static int detectEngine()
+{
+#ifdef LITERAL_X86
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] >= 7)
+    {
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if(osxsave && avx && ((_xgetbv(0) & 6) == 6))
+        {
+            __cpuidex(info, 7, 0);
+            if(info[1] & (1 << 5))
+                return ENGINE_AVX2;
+        }
+    }
+#else
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return ENGINE_AVX2;
+#endif
+    return ENGINE_SSE2;
+#else
+    return ENGINE_SCALAR;
+#endif
+}
+
+static int engineLevel()
+{
+    // Racing threads all come up with the same answer, so no need to lock
+    static int engine = ENGINE_UNKNOWN;
+    if(engine == ENGINE_UNKNOWN)
+        engine = detectEngine();
+    return engine;
+}
+
+static inline unsigned char foldByte(unsigned char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+static inline bool isLetter(unsigned char c)
+{
+    c = foldByte(c);
+    return (c >= 'a') && (c <= 'z');
+}
+
+// Rough guess at how common a byte is in the kind of text people search: lower is more common.
+// Anything not listed (control bytes, high bytes, rarely used punctuation) is considered rare.
+static int byteCommonness(unsigned char c, bool caseSensitive)
+{
+    static const char *commonBytes = " etaoinsrl\tcdhumpf_.,;()=gbyw\"'/-*\r\nv0k1x2>:<j3{}[]q45z6789#&|+!\\";
+
+    int penalty = 0;
+    if((c >= 'A') && (c <= 'Z'))
+    {
+        c = foldByte(c);
+        if(caseSensitive)
+            penalty = 40; // capitals are rarer than their lower case twins
+    }
+
+    const char *found = strchr(commonBytes, c);
+    if(!c || !found)
+        return 1000;
+    return (int)(found - commonBytes) + penalty;
+}
+
+static inline int lowestBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// ------------------------------------------------------------------------------------------------
+
+LiteralMatcher::LiteralMatcher()
+: caseSensitive_(true)
+, rareOffset_(0)
+, otherOffset_(0)
+, rareByte_(0)
+, otherByte_(0)
+, rareFold_(0)
+, otherFold_(0)
+{
+}
+
+void LiteralMatcher::set(const std::string &needle, bool caseSensitive)
+{
+    needle_ = needle;
+    caseSensitive_ = caseSensitive;
+    folded_ = needle;
+    if(!caseSensitive_)
+    {
+        for(size_t i = 0; i < folded_.size(); ++i)
+            folded_[i] = (char)foldByte((unsigned char)folded_[i]);
+    }
+
+    // The two rarest bytes at different offsets make the first stage filter
+    rareOffset_ = 0;
+    otherOffset_ = 0;
+    int n = (int)needle_.size();
+    for(int i = 1; i < n; ++i)
+    {
+        if(byteCommonness(needle_[i], caseSensitive_) > byteCommonness(needle_[rareOffset_], caseSensitive_))
+            rareOffset_ = i;
+    }
+    otherOffset_ = rareOffset_;
+    for(int i = 0; i < n; ++i)
+    {
+        if(i == rareOffset_)
+            continue;
+        if((otherOffset_ == rareOffset_) || (byteCommonness(needle_[i], caseSensitive_) > byteCommonness(needle_[otherOffset_], caseSensitive_)))
+            otherOffset_ = i;
+    }
+
+    if(n)
+    {
+        rareByte_ = folded_[rareOffset_];
+        otherByte_ = folded_[otherOffset_];
+        rareFold_ = (!caseSensitive_ && isLetter(rareByte_)) ? 0x20 : 0;
+        otherFold_ = (!caseSensitive_ && isLetter(otherByte_)) ? 0x20 : 0;
+    }
+
+    engineLevel();
+}
+
+const char *LiteralMatcher::engine()
+{
+    switch(engineLevel())
+    {
+        case ENGINE_AVX2: return "avx2";
+        case ENGINE_SSE2: return "sse2";
+    }
+    return "scalar";
+}
+
+const char *LiteralMatcher::find(const char *begin, const char *end) const
+{
+    if(needle_.empty())
+        return (begin <= end) ? begin : NULL;
+    if((size_t)(end - begin) < needle_.size())
+        return NULL;
+
+    switch(engineLevel())
+    {
+        case ENGINE_AVX2: return findAVX2(begin, end);
+        case ENGINE_SSE2: return findSSE2(begin, end);
+    }
+    return findScalar(begin, end);
+}
+
+bool LiteralMatcher::matchesAt(const char *p) const
+{
+    if(caseSensitive_)
+        return !memcmp(p, needle_.data(), needle_.size());
+
+    for(size_t i = 0; i < folded_.size(); ++i)
+    {
+        if(foldByte((unsigned char)p[i]) != (unsigned char)folded_[i])
+            return false;
+    }
+    return true;
+}
+
+const char *LiteralMatcher::findScalar(const char *begin, const char *end) const
+{
+    if((size_t)(end - begin) < needle_.size())
+        return NULL;
+
+    const char *last = end - needle_.size();
+    if(caseSensitive_)
+    {
+        for(const char *front = begin; front <= last; ++front)
+        {
+            const char *rare = (const char *)memchr(front + rareOffset_, rareByte_, (last - front) + 1);
+            if(!rare)
+                return NULL;
+            front = rare - rareOffset_;
+            if(matchesAt(front))
+                return front;
+        }
+        return NULL;
+    }
+
+    for(const char *front = begin; front <= last; ++front)
+    {
+        if(((unsigned char)(front[rareOffset_] | rareFold_) == rareByte_) && matchesAt(front))
+            return front;
+    }
+    return NULL;
+}
+
+#ifdef LITERAL_X86
+
+const char *LiteralMatcher::findSSE2(const char *begin, const char *end) const
+{
+    const __m128i rare = _mm_set1_epi8((char)rareByte_);
+    const __m128i rareFold = _mm_set1_epi8((char)rareFold_);
+    const __m128i other = _mm_set1_epi8((char)otherByte_);
+    const __m128i otherFold = _mm_set1_epi8((char)otherFold_);
+    const char *last = end - needle_.size();
+    int reach = ((rareOffset_ > otherOffset_) ? rareOffset_ : otherOffset_) + 16;
+
+    const char *p = begin;
+    for(; (end - p) >= reach; p += 16)
+    {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + rareOffset_)), rareFold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + otherOffset_)), otherFold);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, rare), _mm_cmpeq_epi8(b, other)));
+        while(mask)
+        {
+            const char *candidate = p + lowestBit(mask);
+            if(candidate > last)
+                return NULL;
+            if(matchesAt(candidate))
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return findScalar(p, end);
+}
+
+AVX2_FUNCTION const char *LiteralMatcher::findAVX2(const char *begin, const char *end) const
+{
+    const __m256i rare = _mm256_set1_epi8((char)rareByte_);
+    const __m256i rareFold = _mm256_set1_epi8((char)rareFold_);
+    const __m256i other = _mm256_set1_epi8((char)otherByte_);
+    const __m256i otherFold = _mm256_set1_epi8((char)otherFold_);
+    const char *last = end - needle_.size();
+    int reach = ((rareOffset_ > otherOffset_) ? rareOffset_ : otherOffset_) + 32;
+
+    const char *p = begin;
+    for(; (end - p) >= reach; p += 32)
+    {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + rareOffset_)), rareFold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + otherOffset_)), otherFold);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, rare), _mm256_cmpeq_epi8(b, other)));
+        while(mask)
+        {
+            const char *candidate = p + lowestBit(mask);
+            if(candidate > last)
+                return NULL;
+            if(matchesAt(candidate))
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return findSSE2(p, end);
+}
+
+#else
+
+const char *LiteralMatcher::findSSE2(const char *begin, const char *end) const
+{
+    return findScalar(begin, end);
+}
+
+const char *LiteralMatcher::findAVX2(const char *begin, const char *end) const
+{
+    return findScalar(begin, end);
+}
+
+#endif
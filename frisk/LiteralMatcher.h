@@ -0,0 +1,48 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef LITERALMATCHER_H
+#define LITERALMATCHER_H
+
+#include <string>
+
+// Plain substring search, optionally ignoring ASCII case. Candidates are found by checking two of
+// the needle's rarest bytes at once (16 or 32 positions at a time with SSE2/AVX2, picked at
+// runtime), and only those get compared in full.
+class LiteralMatcher
+{
+public:
+    LiteralMatcher();
+
+    void set(const std::string &needle, bool caseSensitive);
+    const std::string &needle() const { return needle_; }
+
+    // First occurrence in [begin, end), or NULL
+    const char *find(const char *begin, const char *end) const;
+
+    // Which implementation find() ended up with: "avx2", "sse2" or "scalar"
+    static const char *engine();
+
+protected:
+    bool matchesAt(const char *p) const;
+
+    const char *findScalar(const char *begin, const char *end) const;
+    const char *findSSE2(const char *begin, const char *end) const;
+    const char *findAVX2(const char *begin, const char *end) const;
+
+    std::string needle_;
+    std::string folded_;      // needle_ in lower case, when ignoring case
+    bool caseSensitive_;
+    int rareOffset_;          // rarest byte in the needle
+    int otherOffset_;         // next rarest, at a different offset (same as rareOffset_ for 1 byte needles)
+    unsigned char rareByte_;  // folded
+    unsigned char otherByte_; // folded
+    unsigned char rareFold_;  // 0x20 if rareByte_ is a letter and case is ignored, 0 otherwise
+    unsigned char otherFold_;
+};
+
+#endif
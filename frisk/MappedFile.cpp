@@ -0,0 +1,544 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "MappedFile.h"
+
+#include <limits>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Fuck WinDefs.h
+#undef max
+
+#define FALLBACK_READ_SIZE (64 * 1024)
+#define WRITE_BUFFER_SIZE (256 * 1024)
+
+static bool sizeAllowed(s64 size, s64 maxSizeKb)
+{
+    if(maxSizeKb && ((size / 1024) > maxSizeKb))
+        return false;
+
+    // Compared unsigned; on 64-bit builds the size_t limit doesn't fit in an s64
+    unsigned long long maxSize = std::numeric_limits<std::size_t>::max();
+    if((unsigned long long)size >= maxSize)
+        return false;
+    return true;
+}
+
+MappedFile::MappedFile()
+: data_(NULL)
+, size_(0)
+, shouldStream_(false)
+#ifdef _WIN32
+, file_(INVALID_HANDLE_VALUE)
+, mapping_(NULL)
+#else
+, fd_(-1)
+, map_(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &filename, s64 maxSizeKb, s64 streamAboveKb)
+{
+    close();
+    shouldStream_ = false;
+
+    file_ = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(file_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    if(GetFileType(file_) != FILE_TYPE_DISK)
+        return readFallback(0, maxSizeKb);
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(file_, &fileSize))
+        return readFallback(0, maxSizeKb);
+
+    s64 size = fileSize.QuadPart;
+    if(!size || !sizeAllowed(size, maxSizeKb))
+    {
+        close();
+        return false;
+    }
+    if(streamAboveKb && ((size / 1024) > streamAboveKb))
+    {
+        close();
+        shouldStream_ = true;
+        return false;
+    }
+
+    mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping_)
+    {
+        data_ = (const char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        if(data_)
+        {
+            size_ = (size_t)size;
+            return true;
+        }
+        CloseHandle(mapping_);
+        mapping_ = NULL;
+    }
+
+    // Couldn't map it (out of address space, odd filesystem); read it the old way
+    return readFallback(size, maxSizeKb);
+}
+
+void MappedFile::close()
+{
+    if(mapping_)
+    {
+        if(data_)
+            UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+    }
+    if(file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+
+    data_ = NULL;
+    size_ = 0;
+    mapping_ = NULL;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+bool MappedFile::readFallback(s64 expectedSize, s64 maxSizeKb)
+{
+    size_t used = 0;
+    bool tooBig = false;
+    buffer_.resize(expectedSize ? (size_t)expectedSize : FALLBACK_READ_SIZE);
+    for(;;)
+    {
+        if(used == buffer_.size())
+        {
+            if(expectedSize)
+                break;
+            if(!sizeAllowed(buffer_.size() * 2, maxSizeKb))
+            {
+                tooBig = true; // or exactly at the limit; not worth a probe read to find out
+                break;
+            }
+            buffer_.resize(buffer_.size() * 2);
+        }
+
+        DWORD bytesRead = 0;
+        if(!ReadFile(file_, &buffer_[used], (DWORD)(buffer_.size() - used), &bytesRead, NULL) || !bytesRead)
+            break;
+        used += bytesRead;
+    }
+
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+
+    if(!used || tooBig || !sizeAllowed(used, maxSizeKb))
+        return false;
+
+    data_ = buffer_.data();
+    size_ = used;
+    return true;
+}
+
+#else
+
+bool MappedFile::open(const std::string &filename, s64 maxSizeKb, s64 streamAboveKb)
+{
+    close();
+    shouldStream_ = false;
+
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if(fd_ < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd_, &st) != 0)
+    {
+        close();
+        return false;
+    }
+
+    // Special files, and files that lie about being empty (procfs, sysfs), get read instead
+    if(!S_ISREG(st.st_mode) || (st.st_size == 0))
+        return readFallback(0, maxSizeKb);
+
+    s64 size = (s64)st.st_size;
+    if(!sizeAllowed(size, maxSizeKb))
+    {
+        close();
+        return false;
+    }
+    if(streamAboveKb && ((size / 1024) > streamAboveKb))
+    {
+        close();
+        shouldStream_ = true;
+        return false;
+    }
+
+    map_ = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if(map_ == MAP_FAILED)
+    {
+        map_ = NULL;
+        return readFallback(size, maxSizeKb);
+    }
+    madvise(map_, (size_t)size, MADV_SEQUENTIAL);
+
+    data_ = (const char *)map_;
+    size_ = (size_t)size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(map_)
+        munmap(map_, size_);
+    if(fd_ >= 0)
+        ::close(fd_);
+
+    data_ = NULL;
+    size_ = 0;
+    map_ = NULL;
+    fd_ = -1;
+}
+
+bool MappedFile::readFallback(s64 expectedSize, s64 maxSizeKb)
+{
+    size_t used = 0;
+    bool tooBig = false;
+    buffer_.resize(expectedSize ? (size_t)expectedSize : FALLBACK_READ_SIZE);
+    for(;;)
+    {
+        if(used == buffer_.size())
+        {
+            if(expectedSize)
+                break;
+            if(!sizeAllowed(buffer_.size() * 2, maxSizeKb))
+            {
+                tooBig = true; // or exactly at the limit; not worth a probe read to find out
+                break;
+            }
+            buffer_.resize(buffer_.size() * 2);
+        }
+
+        ssize_t bytesRead = pread(fd_, &buffer_[used], buffer_.size() - used, (off_t)used);
+        if(bytesRead <= 0)
+            break;
+        used += bytesRead;
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+
+    if(!used || tooBig || !sizeAllowed(used, maxSizeKb))
+        return false;
+
+    data_ = buffer_.data();
+    size_ = used;
+    return true;
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+FileStream::FileStream()
+: file_(INVALID_HANDLE_VALUE)
+{
+}
+
+bool FileStream::open(const std::string &filename)
+{
+    close();
+    file_ = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    return file_ != INVALID_HANDLE_VALUE;
+}
+
+void FileStream::close()
+{
+    if(file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+size_t FileStream::read(char *buffer, size_t size)
+{
+    size_t used = 0;
+    while(used < size)
+    {
+        size_t remaining = size - used;
+        DWORD chunk = (remaining > 0x40000000) ? 0x40000000 : (DWORD)remaining;
+        DWORD bytesRead = 0;
+        if(!ReadFile(file_, buffer + used, chunk, &bytesRead, NULL) || !bytesRead)
+            break;
+        used += bytesRead;
+    }
+    return used;
+}
+
+#else
+
+FileStream::FileStream()
+: fd_(-1)
+{
+}
+
+bool FileStream::open(const std::string &filename)
+{
+    close();
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if(fd_ < 0)
+        return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+void FileStream::close()
+{
+    if(fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+}
+
+size_t FileStream::read(char *buffer, size_t size)
+{
+    size_t used = 0;
+    while(used < size)
+    {
+        ssize_t bytesRead = ::read(fd_, buffer + used, size - used);
+        if(bytesRead <= 0)
+            break;
+        used += bytesRead;
+    }
+    return used;
+}
+
+#endif
+
+FileStream::~FileStream()
+{
+    close();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Dot-prefixed, so walkers going by never mistake it for something to search
+static std::string tempFilenameFor(const std::string &filename)
+{
+    size_t separator = filename.rfind(PLATFORM_PATH_SEPARATOR);
+    size_t nameStart = (separator == std::string::npos) ? 0 : separator + 1;
+    return filename.substr(0, nameStart) + "." + filename.substr(nameStart) + ".frisktmp";
+}
+
+#ifdef _WIN32
+
+FileWriter::FileWriter()
+: used_(0)
+, failed_(false)
+, file_(INVALID_HANDLE_VALUE)
+{
+}
+
+bool FileWriter::open(const std::string &filename)
+{
+    abort();
+
+    std::string target = platformResolvePath(filename);
+    DWORD attributes = GetFileAttributes(target.c_str());
+    if((attributes != INVALID_FILE_ATTRIBUTES) && (attributes & FILE_ATTRIBUTE_READONLY))
+        return false;
+
+    filename_ = target;
+    tempFilename_ = tempFilenameFor(target);
+    file_ = CreateFile(tempFilename_.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file_ == INVALID_HANDLE_VALUE)
+    {
+        tempFilename_.clear();
+        return false;
+    }
+    buffer_.resize(WRITE_BUFFER_SIZE);
+    used_ = 0;
+    failed_ = false;
+    return true;
+}
+
+bool FileWriter::writeRaw(const char *data, size_t size)
+{
+    while(!failed_ && size)
+    {
+        DWORD chunk = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+        DWORD written = 0;
+        if(!WriteFile(file_, data, chunk, &written, NULL) || !written)
+            failed_ = true;
+        data += written;
+        size -= written;
+    }
+    return !failed_;
+}
+
+bool FileWriter::closeFile()
+{
+    if(file_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool ok = flush() && FlushFileBuffers(file_);
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+    return ok;
+}
+
+void FileWriter::abort()
+{
+    if(file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+    if(!tempFilename_.empty())
+        DeleteFile(tempFilename_.c_str());
+    tempFilename_.clear();
+    filename_.clear();
+    used_ = 0;
+}
+
+#else
+
+FileWriter::FileWriter()
+: used_(0)
+, failed_(false)
+, fd_(-1)
+{
+}
+
+bool FileWriter::open(const std::string &filename)
+{
+    abort();
+
+    // Renaming over a read-only file would work just fine here, which isn't the point
+    std::string target = platformResolvePath(filename);
+    struct stat st;
+    mode_t mode = 0644;
+    if(stat(target.c_str(), &st) == 0)
+    {
+        if(access(target.c_str(), W_OK) != 0)
+            return false;
+        mode = st.st_mode & 07777;
+    }
+
+    filename_ = target;
+    tempFilename_ = tempFilenameFor(target);
+    fd_ = ::open(tempFilename_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd_ < 0)
+    {
+        tempFilename_.clear();
+        return false;
+    }
+    fchmod(fd_, mode);
+    buffer_.resize(WRITE_BUFFER_SIZE);
+    used_ = 0;
+    failed_ = false;
+    return true;
+}
+
+bool FileWriter::writeRaw(const char *data, size_t size)
+{
+    while(!failed_ && size)
+    {
+        ssize_t written = ::write(fd_, data, size);
+        if(written <= 0)
+        {
+            failed_ = true;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+    return !failed_;
+}
+
+bool FileWriter::closeFile()
+{
+    if(fd_ < 0)
+        return false;
+
+    bool ok = flush() && (fsync(fd_) == 0);
+    if(::close(fd_) != 0)
+        ok = false;
+    fd_ = -1;
+    return ok;
+}
+
+void FileWriter::abort()
+{
+    if(fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    if(!tempFilename_.empty())
+        unlink(tempFilename_.c_str());
+    tempFilename_.clear();
+    filename_.clear();
+    used_ = 0;
+}
+
+#endif
+
+FileWriter::~FileWriter()
+{
+    abort();
+}
+
+bool FileWriter::write(const char *data, size_t size)
+{
+    if(failed_ || tempFilename_.empty())
+        return false;
+
+    if((used_ + size) > buffer_.size())
+    {
+        if(!flush())
+            return false;
+
+        // Too big to be worth buffering; straight to the file
+        if(size >= buffer_.size())
+            return writeRaw(data, size);
+    }
+
+    if(size)
+        memcpy(&buffer_[used_], data, size);
+    used_ += size;
+    return true;
+}
+
+bool FileWriter::flush()
+{
+    if(used_)
+        writeRaw(&buffer_[0], used_);
+    used_ = 0;
+    return !failed_;
+}
+
+// Makes sure every byte is on disk before the temp file is moved over the original, so there's
+// never a moment where filename is only partly written
+bool FileWriter::commit()
+{
+    bool ok = closeFile() && platformReplaceFile(tempFilename_, filename_);
+    if(ok)
+        tempFilename_.clear();
+    abort();
+    return ok;
+}
@@ -0,0 +1,120 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "Platform.h"
+#include "SearchConfig.h"
+
+// Read-only view of an entire file. Regular files are memory mapped; anything that refuses to be
+// mapped (pipes, procfs-style files that report a size of 0, mapping failures) is read into an
+// internal buffer instead, which is kept around so the next fallback read can reuse it.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Same rules as readEntireFile(): fails on empty files, or files over maxSizeKb (0 = no limit).
+    // Regular files over streamAboveKb (0 = no limit) aren't opened either, but set shouldStream().
+    bool open(const std::string &filename, s64 maxSizeKb, s64 streamAboveKb = 0);
+    void close();
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // After a failed open(): the file is fine, just big enough that it's better read with FileStream
+    bool shouldStream() const { return shouldStream_; }
+
+protected:
+    bool readFallback(s64 expectedSize, s64 maxSizeKb);
+
+    const char *data_;
+    size_t size_;
+    bool shouldStream_;
+    std::string buffer_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#else
+    int fd_;
+    void *map_;
+#endif
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Plain sequential reads, for files too big to want mapped all at once
+class FileStream
+{
+public:
+    FileStream();
+    ~FileStream();
+
+    bool open(const std::string &filename);
+    void close();
+
+    // Fills as much of buffer as it can; returns 0 at the end of the file (or on a read error)
+    size_t read(char *buffer, size_t size);
+
+protected:
+#ifdef _WIN32
+    HANDLE file_;
+#else
+    int fd_;
+#endif
+
+private:
+    FileStream(const FileStream &);
+    FileStream &operator=(const FileStream &);
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Buffered writes into a temp file next to filename, which only takes filename's place on commit().
+// If anything goes wrong before that (or abort() is called), filename is left exactly as it was.
+// A symlink is followed first, so it's the file it points at that gets replaced, not the link.
+class FileWriter
+{
+public:
+    FileWriter();
+    ~FileWriter();
+
+    // Fails if filename exists but isn't writable, same as overwriting it in place would
+    bool open(const std::string &filename);
+    bool write(const char *data, size_t size);
+    bool write(const std::string &data) { return write(data.data(), data.size()); }
+    bool commit();
+    void abort();
+
+protected:
+    bool flush();
+    bool writeRaw(const char *data, size_t size);
+    bool closeFile(); // false if anything written so far didn't make it to disk
+
+    std::string filename_;
+    std::string tempFilename_;
+    std::vector<char> buffer_;
+    size_t used_;
+    bool failed_;
+#ifdef _WIN32
+    HANDLE file_;
+#else
+    int fd_;
+#endif
+
+private:
+    FileWriter(const FileWriter &);
+    FileWriter &operator=(const FileWriter &);
+};
+
+#endif
@@ -0,0 +1,174 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "MultiLiteralMatcher.h"
+
+#include <deque>
+#include <string.h>
+
+static inline unsigned char foldByte(unsigned char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+MultiLiteralMatcher::MultiLiteralMatcher()
+{
+    clear();
+}
+
+void MultiLiteralMatcher::clear()
+{
+    needles_.clear();
+    longest_ = 0;
+    memset(classes_, 0, sizeof(classes_));
+    memset(startBytes_, 0, sizeof(startBytes_));
+    classCount_ = 1;
+    transitions_.clear();
+    output_.clear();
+}
+
+void MultiLiteralMatcher::set(const StringList &needles, bool caseSensitive)
+{
+    clear();
+
+    // Give every byte that shows up in a needle its own column; upper case shares with lower case
+    // when ignoring case
+    for(StringList::const_iterator it = needles.begin(); it != needles.end(); ++it)
+    {
+        for(size_t i = 0; i < it->length(); ++i)
+        {
+            unsigned char c = (unsigned char)(*it)[i];
+            if(!caseSensitive)
+                c = foldByte(c);
+            if(!classes_[c])
+                classes_[c] = (unsigned short)classCount_++;
+        }
+    }
+    if(!caseSensitive)
+    {
+        for(int c = 'A'; c <= 'Z'; ++c)
+            classes_[c] = classes_[foldByte((unsigned char)c)];
+    }
+
+    // Trie first, with -1 for missing edges
+    transitions_.assign(classCount_, -1);
+    output_.assign(1, -1);
+    for(StringList::const_iterator it = needles.begin(); it != needles.end(); ++it)
+    {
+        const std::string &needle = *it;
+        if(needle.empty())
+            continue;
+
+        int state = 0;
+        for(size_t i = 0; i < needle.length(); ++i)
+        {
+            int column = classes_[(unsigned char)needle[i]];
+            int next = transitions_[state * classCount_ + column];
+            if(next < 0)
+            {
+                next = (int)output_.size();
+                transitions_[state * classCount_ + column] = next;
+                transitions_.resize(transitions_.size() + classCount_, -1);
+                output_.push_back(-1);
+            }
+            state = next;
+        }
+        if(output_[state] >= 0)
+            continue; // duplicate
+
+        output_[state] = (int)needles_.size();
+        needles_.push_back(needle);
+        if(needle.length() > longest_)
+            longest_ = needle.length();
+    }
+
+    // Breadth first, fill in every missing edge with wherever the failure link would have led, and
+    // let states inherit the output of their failure state when they don't have one of their own.
+    // A state's own needle is always the longest one ending there.
+    std::vector<int> failure(output_.size(), 0);
+    std::deque<int> queue;
+    for(int column = 0; column < classCount_; ++column)
+    {
+        int &next = transitions_[column];
+        if(next < 0)
+        {
+            next = 0;
+        }
+        else
+        {
+            failure[next] = 0;
+            queue.push_back(next);
+        }
+    }
+    while(!queue.empty())
+    {
+        int state = queue.front();
+        queue.pop_front();
+        for(int column = 0; column < classCount_; ++column)
+        {
+            int &next = transitions_[state * classCount_ + column];
+            int fallback = transitions_[failure[state] * classCount_ + column];
+            if(next < 0)
+            {
+                next = fallback;
+            }
+            else
+            {
+                failure[next] = fallback;
+                if(output_[next] < 0)
+                    output_[next] = output_[fallback];
+                queue.push_back(next);
+            }
+        }
+    }
+
+    for(int c = 0; c < 256; ++c)
+        startBytes_[c] = (transitions_[classes_[c]] != 0);
+}
+
+const char *MultiLiteralMatcher::find(const char *begin, const char *end, int &which) const
+{
+    if(needles_.empty())
+        return NULL;
+
+    const unsigned char *p = (const unsigned char *)begin;
+    const unsigned char *stop = (const unsigned char *)end;
+    const char *best = NULL;
+    size_t bestLength = 0;
+    int state = 0;
+    while(p < stop)
+    {
+        if(!state)
+        {
+            while((p < stop) && !startBytes_[*p])
+                p++;
+            if(p == stop)
+                break;
+        }
+
+        state = transitions_[state * classCount_ + classes_[*p]];
+        p++;
+
+        int out = output_[state];
+        if(out >= 0)
+        {
+            size_t length = needles_[out].length();
+            const char *start = (const char *)p - length;
+            if(!best || (start < best) || ((start == best) && (length > bestLength)))
+            {
+                best = start;
+                bestLength = length;
+                which = out;
+            }
+        }
+
+        // Anything starting at or before best has finished by now
+        if(best && ((size_t)((const char *)p - best) >= longest_))
+            break;
+    }
+    return best;
+}
@@ -0,0 +1,43 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef MULTILITERALMATCHER_H
+#define MULTILITERALMATCHER_H
+
+#include "SearchConfig.h"
+
+// Finds any of a list of plain strings in one pass, no matter how many there are (Aho-Corasick,
+// built out into a full DFA). Bytes that don't appear in any needle share a column, so the table
+// is states * (distinct bytes + 1) rather than states * 256. While sitting at the root, bytes that
+// can't start a needle are skipped without touching the table.
+class MultiLiteralMatcher
+{
+public:
+    MultiLiteralMatcher();
+
+    // Empty and duplicate needles are dropped
+    void set(const StringList &needles, bool caseSensitive);
+    void clear();
+
+    bool empty() const { return needles_.empty(); }
+    const StringList &needles() const { return needles_; }
+
+    // Leftmost occurrence of any needle in [begin, end) (the longest one, if several start at the
+    // same spot), or NULL. which is its index in needles().
+    const char *find(const char *begin, const char *end, int &which) const;
+
+protected:
+    StringList needles_;
+    size_t longest_;                // longest needle, in bytes
+    unsigned short classes_[256];   // byte -> column in transitions_ (0 for bytes in no needle)
+    bool startBytes_[256];          // bytes that leave the root state
+    int classCount_;
+    std::vector<int> transitions_;  // state * classCount_ + class -> next state
+    std::vector<int> output_;       // longest needle ending at each state, or -1
+};
+
+#endif
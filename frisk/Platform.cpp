@@ -0,0 +1,477 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "Platform.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+PlatformMutex::PlatformMutex()
+{
+    InitializeCriticalSection(&criticalSection_);
+}
+
+PlatformMutex::~PlatformMutex()
+{
+    DeleteCriticalSection(&criticalSection_);
+}
+
+void PlatformMutex::lock()
+{
+    EnterCriticalSection(&criticalSection_);
+}
+
+void PlatformMutex::unlock()
+{
+    LeaveCriticalSection(&criticalSection_);
+}
+
+#else
+
+PlatformMutex::PlatformMutex()
+{
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+PlatformMutex::~PlatformMutex()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+void PlatformMutex::lock()
+{
+    pthread_mutex_lock(&mutex_);
+}
+
+void PlatformMutex::unlock()
+{
+    pthread_mutex_unlock(&mutex_);
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+PlatformEvent::PlatformEvent()
+{
+    event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+PlatformEvent::~PlatformEvent()
+{
+    CloseHandle(event_);
+}
+
+void PlatformEvent::signal()
+{
+    SetEvent(event_);
+}
+
+bool PlatformEvent::wait(unsigned int timeoutMs)
+{
+    return (WaitForSingleObject(event_, timeoutMs) == WAIT_OBJECT_0);
+}
+
+#else
+
+PlatformEvent::PlatformEvent()
+: signaled_(false)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+PlatformEvent::~PlatformEvent()
+{
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void PlatformEvent::signal()
+{
+    pthread_mutex_lock(&mutex_);
+    signaled_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+bool PlatformEvent::wait(unsigned int timeoutMs)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + (timeoutMs / 1000);
+    deadline.tv_nsec = (now.tv_usec * 1000) + ((timeoutMs % 1000) * 1000000);
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&mutex_);
+    while(!signaled_)
+    {
+        if(pthread_cond_timedwait(&cond_, &mutex_, &deadline) == ETIMEDOUT)
+            break;
+    }
+    bool ret = signaled_;
+    signaled_ = false;
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+PlatformSemaphore::PlatformSemaphore()
+{
+    semaphore_ = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+}
+
+PlatformSemaphore::~PlatformSemaphore()
+{
+    CloseHandle(semaphore_);
+}
+
+void PlatformSemaphore::post(int count)
+{
+    ReleaseSemaphore(semaphore_, count, NULL);
+}
+
+void PlatformSemaphore::wait()
+{
+    WaitForSingleObject(semaphore_, INFINITE);
+}
+
+#else
+
+PlatformSemaphore::PlatformSemaphore()
+: count_(0)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+PlatformSemaphore::~PlatformSemaphore()
+{
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void PlatformSemaphore::post(int count)
+{
+    pthread_mutex_lock(&mutex_);
+    count_ += count;
+    if(count > 1)
+        pthread_cond_broadcast(&cond_);
+    else
+        pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void PlatformSemaphore::wait()
+{
+    pthread_mutex_lock(&mutex_);
+    while(!count_)
+        pthread_cond_wait(&cond_, &mutex_);
+    count_--;
+    pthread_mutex_unlock(&mutex_);
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+static DWORD WINAPI staticThreadProc(void *param)
+{
+    PlatformThread *thread = (PlatformThread *)param;
+    thread->proc_(thread->param_);
+    return 0;
+}
+
+PlatformThread::PlatformThread()
+: proc_(NULL)
+, param_(NULL)
+, started_(false)
+, thread_(INVALID_HANDLE_VALUE)
+{
+}
+
+PlatformThread::~PlatformThread()
+{
+    join();
+}
+
+bool PlatformThread::start(PlatformThreadProc proc, void *param)
+{
+    proc_ = proc;
+    param_ = param;
+
+    DWORD id;
+    thread_ = CreateThread(NULL, 0, staticThreadProc, (void*)this, 0, &id);
+    started_ = (thread_ != NULL);
+    return started_;
+}
+
+void PlatformThread::join()
+{
+    if(started_)
+    {
+        WaitForSingleObject(thread_, INFINITE);
+        CloseHandle(thread_);
+        thread_ = INVALID_HANDLE_VALUE;
+        started_ = false;
+    }
+}
+
+#else
+
+static void *staticThreadProc(void *param)
+{
+    PlatformThread *thread = (PlatformThread *)param;
+    thread->proc_(thread->param_);
+    return NULL;
+}
+
+PlatformThread::PlatformThread()
+: proc_(NULL)
+, param_(NULL)
+, started_(false)
+{
+}
+
+PlatformThread::~PlatformThread()
+{
+    join();
+}
+
+bool PlatformThread::start(PlatformThreadProc proc, void *param)
+{
+    proc_ = proc;
+    param_ = param;
+
+    started_ = (pthread_create(&thread_, NULL, staticThreadProc, (void*)this) == 0);
+    return started_;
+}
+
+void PlatformThread::join()
+{
+    if(started_)
+    {
+        pthread_join(thread_, NULL);
+        started_ = false;
+    }
+}
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+int platformAtomicIncrement(volatile int *value)
+{
+    return InterlockedIncrement((volatile LONG *)value);
+}
+
+int platformAtomicDecrement(volatile int *value)
+{
+    return InterlockedDecrement((volatile LONG *)value);
+}
+
+int platformAtomicAdd(volatile int *value, int amount)
+{
+    return InterlockedExchangeAdd((volatile LONG *)value, amount) + amount;
+}
+
+int platformProcessorCount()
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    return (int)systemInfo.dwNumberOfProcessors;
+}
+
+unsigned int platformThreadId()
+{
+    return (unsigned int)GetCurrentThreadId();
+}
+
+void platformSleep(unsigned int ms)
+{
+    Sleep(ms);
+}
+
+unsigned int platformTicks()
+{
+    return GetTickCount();
+}
+
+double platformSeconds()
+{
+    LARGE_INTEGER frequency, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)frequency.QuadPart;
+}
+
+size_t platformPeakMemory()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+}
+
+bool platformMakeDirectory(const std::string &path)
+{
+    return (_mkdir(path.c_str()) == 0) || (errno == EEXIST);
+}
+
+bool platformReplaceFile(const std::string &from, const std::string &to)
+{
+    return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+std::string platformResolvePath(const std::string &path)
+{
+    HANDLE file = CreateFile(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return path;
+
+    std::string resolved;
+    DWORD length = GetFinalPathNameByHandle(file, NULL, 0, FILE_NAME_NORMALIZED);
+    if(length)
+    {
+        std::vector<char> buffer(length + 1);
+        length = GetFinalPathNameByHandle(file, &buffer[0], (DWORD)buffer.size(), FILE_NAME_NORMALIZED);
+        if(length && (length < buffer.size()))
+            resolved.assign(&buffer[0], length);
+    }
+    CloseHandle(file);
+    if(resolved.empty())
+        return path;
+
+    // It comes back as \\?\C:\... or \\?\UNC\server\share\..., which not everything takes
+    if(!resolved.compare(0, 8, "\\\\?\\UNC\\"))
+        return "\\" + resolved.substr(7);
+    if(!resolved.compare(0, 4, "\\\\?\\"))
+        return resolved.substr(4);
+    return resolved;
+}
+
+#else
+
+int platformAtomicIncrement(volatile int *value)
+{
+    return __sync_add_and_fetch(value, 1);
+}
+
+int platformAtomicDecrement(volatile int *value)
+{
+    return __sync_sub_and_fetch(value, 1);
+}
+
+int platformAtomicAdd(volatile int *value, int amount)
+{
+    return __sync_add_and_fetch(value, amount);
+}
+
+int platformProcessorCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+}
+
+unsigned int platformThreadId()
+{
+#ifdef __linux__
+    return (unsigned int)syscall(SYS_gettid);
+#else
+    return (unsigned int)(size_t)pthread_self();
+#endif
+}
+
+void platformSleep(unsigned int ms)
+{
+    usleep(ms * 1000);
+}
+
+unsigned int platformTicks()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned int)((now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+double platformSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + ((double)now.tv_nsec / 1000000000.0);
+}
+
+size_t platformPeakMemory()
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss; // already bytes there
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+bool platformMakeDirectory(const std::string &path)
+{
+    return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+}
+
+bool platformReplaceFile(const std::string &from, const std::string &to)
+{
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+std::string platformResolvePath(const std::string &path)
+{
+    char *resolved = realpath(path.c_str(), NULL);
+    if(!resolved)
+        return path;
+
+    std::string result(resolved);
+    free(resolved);
+    return result;
+}
+
+#endif
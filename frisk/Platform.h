@@ -0,0 +1,159 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <string>
+
+#ifdef _WIN32
+#define PLATFORM_PATH_SEPARATOR '\\'
+#else
+#define PLATFORM_PATH_SEPARATOR '/'
+
+// Colors are kept as COLORREFs everywhere, whether or not there's anything to draw them
+#define RGB(r, g, b) ((unsigned int)(((r) & 0xff) | (((g) & 0xff) << 8) | (((b) & 0xff) << 16)))
+#endif
+
+typedef void (*PlatformThreadProc)(void *param);
+
+class PlatformMutex
+{
+public:
+    PlatformMutex();
+    ~PlatformMutex();
+
+    void lock();
+    void unlock();
+
+protected:
+#ifdef _WIN32
+    CRITICAL_SECTION criticalSection_;
+#else
+    pthread_mutex_t mutex_;
+#endif
+
+private:
+    PlatformMutex(const PlatformMutex &);
+    PlatformMutex &operator=(const PlatformMutex &);
+};
+
+class PlatformScopedLock
+{
+public:
+    PlatformScopedLock(PlatformMutex &mutex) : mutex_(mutex) { mutex_.lock(); }
+    ~PlatformScopedLock() { mutex_.unlock(); }
+
+protected:
+    PlatformMutex &mutex_;
+
+private:
+    PlatformScopedLock(const PlatformScopedLock &);
+    PlatformScopedLock &operator=(const PlatformScopedLock &);
+};
+
+// Auto-reset event: signal() releases one waiter, or the next one to arrive.
+class PlatformEvent
+{
+public:
+    PlatformEvent();
+    ~PlatformEvent();
+
+    void signal();
+    bool wait(unsigned int timeoutMs); // true if signaled, false on timeout
+
+protected:
+#ifdef _WIN32
+    HANDLE event_;
+#else
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    bool signaled_;
+#endif
+
+private:
+    PlatformEvent(const PlatformEvent &);
+    PlatformEvent &operator=(const PlatformEvent &);
+};
+
+// Counting semaphore: wait() takes one, blocking until there's one to take
+class PlatformSemaphore
+{
+public:
+    PlatformSemaphore();
+    ~PlatformSemaphore();
+
+    void post(int count = 1);
+    void wait();
+
+protected:
+#ifdef _WIN32
+    HANDLE semaphore_;
+#else
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    int count_;
+#endif
+
+private:
+    PlatformSemaphore(const PlatformSemaphore &);
+    PlatformSemaphore &operator=(const PlatformSemaphore &);
+};
+
+class PlatformThread
+{
+public:
+    PlatformThread();
+    ~PlatformThread();
+
+    bool start(PlatformThreadProc proc, void *param);
+    void join();
+
+    PlatformThreadProc proc_;
+    void *param_;
+
+protected:
+    bool started_;
+#ifdef _WIN32
+    HANDLE thread_;
+#else
+    pthread_t thread_;
+#endif
+
+private:
+    PlatformThread(const PlatformThread &);
+    PlatformThread &operator=(const PlatformThread &);
+};
+
+// All of these return the new value
+int platformAtomicIncrement(volatile int *value);
+int platformAtomicDecrement(volatile int *value);
+int platformAtomicAdd(volatile int *value, int amount);
+
+int platformProcessorCount();
+unsigned int platformThreadId(); // the calling thread's, as the OS (and its tools) number them
+void platformSleep(unsigned int ms);
+unsigned int platformTicks(); // milliseconds, from some arbitrary point; wraps like GetTickCount()
+double platformSeconds();     // the best resolution there is, from some arbitrary point
+size_t platformPeakMemory();  // the most this process has had resident at once, in bytes
+
+bool platformMakeDirectory(const std::string &path); // true if it's there afterwards
+
+// Moves from over to, replacing to if it already exists
+bool platformReplaceFile(const std::string &from, const std::string &to);
+
+// The file path really names, with every symlink along the way followed; path itself if it can't be
+// resolved (it doesn't exist yet, say)
+std::string platformResolvePath(const std::string &path);
+
+#endif
@@ -0,0 +1,321 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "RequiredLiteral.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t BAD_PATTERN = std::string::npos;
+
+static bool isDigit(char c)
+{
+    return (c >= '0') && (c <= '9');
+}
+
+// {n}, {n,} or {n,m} at pos. PCRE treats anything else starting with { as a literal.
+static bool parseBraces(const std::string &pattern, size_t pos, int &minRepeat, size_t &end)
+{
+    size_t i = pos + 1;
+    size_t digits = i;
+    while((i < pattern.length()) && isDigit(pattern[i]))
+        i++;
+    if(i == digits)
+        return false;
+    minRepeat = atoi(pattern.c_str() + digits);
+
+    if((i < pattern.length()) && (pattern[i] == ','))
+    {
+        i++;
+        while((i < pattern.length()) && isDigit(pattern[i]))
+            i++;
+    }
+    if((i >= pattern.length()) || (pattern[i] != '}'))
+        return false;
+
+    end = i + 1;
+    return true;
+}
+
+// Returns the position just past an escape like \d, \x41, \p{Lu} or \g{-1} starting at pos
+static size_t skipEscape(const std::string &pattern, size_t pos)
+{
+    size_t i = pos + 2;
+    if(i > pattern.length())
+        return BAD_PATTERN;
+
+    char e = pattern[pos + 1];
+    char arg = (i < pattern.length()) ? pattern[i] : 0;
+    char close = 0;
+    switch(e)
+    {
+        case 'Q':
+        {
+            size_t end = pattern.find("\\E", i);
+            return (end == std::string::npos) ? pattern.length() : end + 2;
+        }
+
+        case 'c':
+            return (i < pattern.length()) ? i + 1 : BAD_PATTERN;
+
+        case 'x':
+            if(arg == '{')
+                close = '}';
+            else
+            {
+                for(int digits = 0; (digits < 2) && (i < pattern.length()) && isxdigit((unsigned char)pattern[i]); ++digits)
+                    i++;
+                return i;
+            }
+            break;
+
+        case 'p':
+        case 'P':
+            if(arg == '{')
+                close = '}';
+            else
+                return (i < pattern.length()) ? i + 1 : BAD_PATTERN;
+            break;
+
+        case 'g':
+        case 'k':
+            if(arg == '{')
+                close = '}';
+            else if(arg == '<')
+                close = '>';
+            else if(arg == '\'')
+                close = '\'';
+            else
+            {
+                if(arg == '-')
+                    i++;
+                while((i < pattern.length()) && isDigit(pattern[i]))
+                    i++;
+                return i;
+            }
+            break;
+
+        default:
+            if(isDigit(e))
+            {
+                // Backreference or octal; either way the digits belong to it
+                while((i < pattern.length()) && isDigit(pattern[i]))
+                    i++;
+            }
+            return i;
+    }
+
+    size_t end = pattern.find(close, i + 1);
+    return (end == std::string::npos) ? BAD_PATTERN : end + 1;
+}
+
+// Returns the position just past the class starting at pos
+static size_t skipClass(const std::string &pattern, size_t pos)
+{
+    size_t i = pos + 1;
+    if((i < pattern.length()) && (pattern[i] == '^'))
+        i++;
+    if((i < pattern.length()) && (pattern[i] == ']'))
+        i++; // a leading ] is just a character
+
+    while(i < pattern.length())
+    {
+        char c = pattern[i];
+        if(c == '\\')
+        {
+            i += 2;
+        }
+        else if((c == '[') && ((i + 1) < pattern.length()) && (pattern[i + 1] == ':'))
+        {
+            size_t end = pattern.find(":]", i + 2);
+            if(end == std::string::npos)
+                return BAD_PATTERN;
+            i = end + 2;
+        }
+        else if(c == ']')
+        {
+            return i + 1;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return BAD_PATTERN;
+}
+
+// Returns the position just past the group starting at pos
+static size_t skipGroup(const std::string &pattern, size_t pos)
+{
+    int depth = 0;
+    size_t i = pos;
+    while(i < pattern.length())
+    {
+        char c = pattern[i];
+        if(c == '\\')
+        {
+            i += 2;
+            continue;
+        }
+        if(c == '[')
+        {
+            i = skipClass(pattern, i);
+            if(i == BAD_PATTERN)
+                return BAD_PATTERN;
+            continue;
+        }
+        if(c == '(')
+        {
+            depth++;
+        }
+        else if(c == ')')
+        {
+            if(--depth == 0)
+                return i + 1;
+        }
+        i++;
+    }
+    return BAD_PATTERN;
+}
+
+// Does the actual work for findRequiredLiteral(), but can give up with part of a run already in
+// literal; the caller is the one that throws that away
+static bool scanForLiteral(const std::string &pattern, std::string &literal, bool &wholePattern)
+{
+    std::string run;
+    bool sawMeta = false;
+    size_t i = 0;
+    while(i < pattern.length())
+    {
+        // Figure out the next element, and whether it's a plain character
+        char c = pattern[i];
+        int literalChar = -1;
+        size_t next = i + 1;
+        switch(c)
+        {
+            case '\\':
+                if(next >= pattern.length())
+                    return false;
+                if(isalnum((unsigned char)pattern[next]))
+                {
+                    next = skipEscape(pattern, i);
+                    if(next == BAD_PATTERN)
+                        return false;
+                }
+                else
+                {
+                    literalChar = (unsigned char)pattern[next];
+                    next++;
+                }
+                break;
+
+            case '|':
+                return false;
+
+            case '(':
+                if((next < pattern.length()) && (pattern[next] == '?') && ((next + 1) < pattern.length()) && strchr("imsxJUX-", pattern[next + 1]))
+                    return false; // (?i) and friends change how everything after them matches
+                next = skipGroup(pattern, i);
+                if(next == BAD_PATTERN)
+                    return false;
+                break;
+
+            case '[':
+                next = skipClass(pattern, i);
+                if(next == BAD_PATTERN)
+                    return false;
+                break;
+
+            case '.':
+            case '^':
+            case '$':
+                break;
+
+            case '*':
+            case '+':
+            case '?':
+            case ')':
+                return false; // won't compile anyway
+
+            case '{':
+            {
+                int unused;
+                size_t end;
+                if(parseBraces(pattern, i, unused, end))
+                    return false;
+                literalChar = (unsigned char)c;
+                break;
+            }
+
+            default:
+                literalChar = (unsigned char)c;
+                break;
+        }
+
+        // Is it repeated?
+        int minRepeat = 1;
+        bool repeated = false;
+        if(next < pattern.length())
+        {
+            char q = pattern[next];
+            size_t end;
+            if((q == '*') || (q == '?'))
+            {
+                minRepeat = 0;
+                repeated = true;
+                next++;
+            }
+            else if(q == '+')
+            {
+                repeated = true;
+                next++;
+            }
+            else if((q == '{') && parseBraces(pattern, next, minRepeat, end))
+            {
+                repeated = true;
+                next = end;
+            }
+
+            // Lazy or possessive
+            if(repeated && (next < pattern.length()) && ((pattern[next] == '?') || (pattern[next] == '+')))
+                next++;
+        }
+
+        if((literalChar >= 0) && (minRepeat > 0))
+            run += (char)literalChar;
+
+        if((literalChar < 0) || repeated)
+        {
+            // Whatever comes next isn't necessarily right after this run
+            sawMeta = true;
+            if(run.length() > literal.length())
+                literal = run;
+            run.clear();
+        }
+        i = next;
+    }
+
+    if(run.length() > literal.length())
+        literal = run;
+
+    wholePattern = !sawMeta && !literal.empty();
+    return !literal.empty();
+}
+
+bool findRequiredLiteral(const std::string &pattern, std::string &literal, bool &wholePattern)
+{
+    literal.clear();
+    wholePattern = false;
+    if(scanForLiteral(pattern, literal, wholePattern))
+        return true;
+
+    // Whatever was collected before giving up isn't required at all (think foo|bar)
+    literal.clear();
+    wholePattern = false;
+    return false;
+}
@@ -0,0 +1,22 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef REQUIREDLITERAL_H
+#define REQUIREDLITERAL_H
+
+#include <string>
+
+// Looks for a run of plain characters that every match of a PCRE pattern has to contain, so
+// anything without it can be skipped without running the regex. Only the top level of the pattern
+// is considered (groups and classes just end a run), and patterns with a top level | or inline
+// option changes give up. Returns false, with literal left empty, if there's no such run.
+//
+// wholePattern is set when the pattern is nothing but that literal (escaped punctuation included),
+// meaning a plain substring search finds exactly the same matches.
+bool findRequiredLiteral(const std::string &pattern, std::string &literal, bool &wholePattern);
+
+#endif
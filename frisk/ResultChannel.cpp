@@ -0,0 +1,92 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "ResultChannel.h"
+#include "SearchContext.h"
+
+// Recycled batches give up buffers bigger than this, so one huge file doesn't pin its output
+#define MAX_RECYCLED_TEXT (1024 * 1024)
+
+// ------------------------------------------------------------------------------------------------
+
+PokeRing::PokeRing()
+: head_(0)
+, tail_(0)
+, count_(0)
+{
+}
+
+bool PokeRing::push(PokeData *batch)
+{
+    if(platformAtomicAdd(&count_, 0) == RESULT_CHANNEL_SLOTS)
+        return false;
+
+    slots_[tail_] = batch;
+    tail_ = (tail_ + 1) % RESULT_CHANNEL_SLOTS;
+
+    // Also a full barrier, so the slot is filled before the consumer can see it
+    platformAtomicIncrement(&count_);
+    return true;
+}
+
+PokeData *PokeRing::pop()
+{
+    if(!platformAtomicAdd(&count_, 0))
+        return NULL;
+
+    PokeData *batch = slots_[head_];
+    head_ = (head_ + 1) % RESULT_CHANNEL_SLOTS;
+    platformAtomicDecrement(&count_);
+    return batch;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+ResultChannel::ResultChannel()
+{
+}
+
+ResultChannel::~ResultChannel()
+{
+    PokeData *batch;
+    while((batch = published_.pop()) != NULL)
+        delete batch;
+    while((batch = recycled_.pop()) != NULL)
+        delete batch;
+}
+
+PokeData *ResultChannel::acquire()
+{
+    PokeData *batch = recycled_.pop();
+    if(!batch)
+        return new PokeData;
+
+    // Done here rather than in recycle() to keep the UI thread's share of the work down
+    if(batch->textBlocks.text.capacity() > MAX_RECYCLED_TEXT)
+    {
+        delete batch;
+        return new PokeData;
+    }
+    batch->clear();
+    return batch;
+}
+
+bool ResultChannel::publish(PokeData *batch)
+{
+    return published_.push(batch);
+}
+
+PokeData *ResultChannel::receive()
+{
+    return published_.pop();
+}
+
+void ResultChannel::recycle(PokeData *batch)
+{
+    if(!recycled_.push(batch))
+        delete batch;
+}
@@ -0,0 +1,60 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef RESULTCHANNEL_H
+#define RESULTCHANNEL_H
+
+#include "Platform.h"
+
+#define RESULT_CHANNEL_SLOTS 64
+
+struct PokeData;
+
+// A fixed-size ring of batches for one producer thread and one consumer thread. Neither side
+// ever waits or takes a lock; they just find out that the ring is full or empty.
+class PokeRing
+{
+public:
+    PokeRing();
+
+    bool push(PokeData *batch); // producer only; false if full
+    PokeData *pop();            // consumer only; NULL if empty
+
+protected:
+    PokeData *slots_[RESULT_CHANNEL_SLOTS];
+    int head_;           // next to pop, touched by the consumer only
+    int tail_;           // next to fill, touched by the producer only
+    volatile int count_; // the only thing both sides touch
+
+private:
+    PokeRing(const PokeRing &);
+    PokeRing &operator=(const PokeRing &);
+};
+
+// Carries output from the search thread to the UI thread a batch (usually a file's worth) at a
+// time, and carries the drained batches back so their buffers get reused rather than
+// reallocated.
+class ResultChannel
+{
+public:
+    ResultChannel();
+    ~ResultChannel(); // both threads have to be done with it
+
+    // Search thread
+    PokeData *acquire();           // an empty batch
+    bool publish(PokeData *batch); // false if the UI is too far behind; the batch is still yours
+
+    // UI thread
+    PokeData *receive();           // the oldest batch not yet received, or NULL
+    void recycle(PokeData *batch);
+
+protected:
+    PokeRing published_;
+    PokeRing recycled_;
+};
+
+#endif
@@ -6,16 +6,25 @@
 // ---------------------------------------------------------------------------
 
 #include "SearchConfig.h"
+#include "Platform.h"
 
 #include <limits>
 
-#include <windows.h>
+#ifdef _WIN32
 #include <shlobj.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define _ftelli64 ftello
+#endif
 #include <cJSON.h>
 
 // ------------------------------------------------------------------------------------------------
 // Helper functions
 
+#ifdef _WIN32
+
 static std::string calcConfigFilename()
 {
     char buffer[MAX_PATH];
@@ -33,6 +42,35 @@ static std::string calcConfigFilename()
     return filename;
 }
 
+static std::string calcDefaultPath()
+{
+    TCHAR tempPath[MAX_PATH];
+    if(SUCCEEDED(SHGetFolderPath(NULL, CSIDL_DESKTOPDIRECTORY|CSIDL_FLAG_CREATE, NULL, 0, tempPath)))
+        return tempPath;
+    return "";
+}
+
+#else
+
+// There's no good place next to the executable, so it's a dotfile in $HOME instead
+static std::string calcConfigFilename()
+{
+    const char *home = getenv("HOME");
+    if(!home || !home[0])
+        return "";
+    std::string filename = home;
+    filename += "/.frisk.conf";
+    return filename;
+}
+
+static std::string calcDefaultPath()
+{
+    const char *home = getenv("HOME");
+    return home ? home : "";
+}
+
+#endif
+
 // Fuck WinDefs.h
 #undef max
 
@@ -184,6 +222,10 @@ static bool jsonGetSavedSearch(cJSON *json, SavedSearch &savedSearch)
 	jsonGetString(json, "replace", savedSearch.replace);
 	jsonGetString(json, "backupExtension", savedSearch.backupExtension);
 	jsonGetInt(json, "flags", savedSearch.flags);
+	savedSearch.maxHitsPerFile = 0;
+	savedSearch.maxResults = 0;
+	jsonGetInt(json, "maxHitsPerFile", savedSearch.maxHitsPerFile);
+	jsonGetInt(json, "maxResults", savedSearch.maxResults);
 
 	return true;
 }
@@ -201,6 +243,8 @@ static bool jsonSetSavedSearch(cJSON *json, SavedSearch &savedSearch)
 	jsonSetString(json, "replace", savedSearch.replace);
 	jsonSetString(json, "backupExtension", savedSearch.backupExtension);
 	jsonSetInt(json, "flags", savedSearch.flags);
+	jsonSetInt(json, "maxHitsPerFile", savedSearch.maxHitsPerFile);
+	jsonSetInt(json, "maxResults", savedSearch.maxResults);
 
 	return true;
 }
@@ -220,6 +264,14 @@ SearchConfig::SearchConfig()
 	contextColor_ = RGB(137, 189, 255);
 	textSize_ = 8;
 	contextLines_ = 2;
+    searchThreads_ = 0;
+    walkerThreads_ = 1;
+    bufferScan_ = 1;
+    binaryFiles_ = BINARY_SKIP;
+    streamAboveKb_ = 256 * 1024;
+    directoryManifest_ = 1;
+    maxHitsPerFile_ = 0;
+    maxResults_ = 0;
     backgroundColor_ = RGB(0, 0, 0);
 	highlightColor_ = RGB(0, 255, 0);
     cmdTemplate_ = "notepad.exe \"!FILENAME!\"";
@@ -227,9 +279,9 @@ SearchConfig::SearchConfig()
 	backupExtensions_.push_back("friskbackup");
     fileSizes_.push_back("5000");
 
-    TCHAR tempPath[MAX_PATH];
-    if(SUCCEEDED(SHGetFolderPath(NULL, CSIDL_DESKTOPDIRECTORY|CSIDL_FLAG_CREATE, NULL, 0, tempPath)))
-        paths_.push_back(tempPath);
+    std::string defaultPath = calcDefaultPath();
+    if(!defaultPath.empty())
+        paths_.push_back(defaultPath);
     filespecs_.push_back("*.txt;*.ini");
 }
 
@@ -263,6 +315,14 @@ void SearchConfig::load()
     jsonGetInt(json, "contextColor", contextColor_);
     jsonGetInt(json, "textSize", textSize_);
     jsonGetInt(json, "contextLines", contextLines_);
+    jsonGetInt(json, "searchThreads", searchThreads_);
+    jsonGetInt(json, "walkerThreads", walkerThreads_);
+    jsonGetInt(json, "bufferScan", bufferScan_);
+    jsonGetInt(json, "binaryFiles", binaryFiles_);
+    jsonGetInt(json, "streamAboveKb", streamAboveKb_);
+    jsonGetInt(json, "directoryManifest", directoryManifest_);
+    jsonGetInt(json, "maxHitsPerFile", maxHitsPerFile_);
+    jsonGetInt(json, "maxResults", maxResults_);
     jsonGetInt(json, "backgroundColor", backgroundColor_);
     jsonGetInt(json, "highlightColor", highlightColor_);
     jsonGetString(json, "cmdTemplate", cmdTemplate_);
@@ -308,6 +368,14 @@ void SearchConfig::save()
     jsonSetInt(json, "contextColor", contextColor_);
     jsonSetInt(json, "textSize", textSize_);
     jsonSetInt(json, "contextLines", contextLines_);
+    jsonSetInt(json, "searchThreads", searchThreads_);
+    jsonSetInt(json, "walkerThreads", walkerThreads_);
+    jsonSetInt(json, "bufferScan", bufferScan_);
+    jsonSetInt(json, "binaryFiles", binaryFiles_);
+    jsonSetInt(json, "streamAboveKb", streamAboveKb_);
+    jsonSetInt(json, "directoryManifest", directoryManifest_);
+    jsonSetInt(json, "maxHitsPerFile", maxHitsPerFile_);
+    jsonSetInt(json, "maxResults", maxResults_);
     jsonSetInt(json, "backgroundColor", backgroundColor_);
     jsonSetInt(json, "highlightColor", highlightColor_);
     jsonSetString(json, "cmdTemplate", cmdTemplate_);
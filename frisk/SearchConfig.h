@@ -18,6 +18,14 @@ typedef std::vector<std::string> StringList;
 bool readEntireFile(const std::string &filename, std::string &contents, s64 maxSizeKb);
 bool writeEntireFile(const std::string &filename, const std::string &contents);
 
+// What to do with files that look binary (see looksBinary())
+enum BinaryFileMode
+{
+    BINARY_SEARCH = 0, // search them like any other file
+    BINARY_SKIP,       // don't search them at all
+    BINARY_REPORT      // just say whether they match, without line output
+};
+
 enum SearchFlag
 {
     SF_RECURSIVE               = (1 << 0),
@@ -28,6 +36,11 @@ enum SearchFlag
     SF_REPLACE                 = (1 << 5),
     SF_BACKUP                  = (1 << 6),
 	SF_TRIM_FILENAMES          = (1 << 7),
+    SF_MATCH_LIST              = (1 << 8),
+    SF_BUILD_INDEX             = (1 << 9), // write a trigram index for each path instead of searching
+    SF_WATCH                   = (1 << 10), // keep the output up to date as files change, until stopped
+    SF_FILES_WITH_MATCHES      = (1 << 11), // just list the files that match, stopping at each one's first hit
+    SF_COUNT_ONLY              = (1 << 12), // just count the hits in each file, and list the files by count
 
     SF_COUNT
 };
@@ -42,6 +55,8 @@ struct SavedSearch
 	std::string replace;
 	std::string backupExtension;
 	int flags;
+	int maxHitsPerFile;
+	int maxResults;
 };
 
 typedef std::vector<SavedSearch> SavedSearchList;
@@ -77,6 +92,14 @@ public:
     int backgroundColor_;
 	int highlightColor_;
 	int contextLines_;
+    int searchThreads_; // 0 means one per hardware thread
+    int walkerThreads_; // directory listing threads; more than 1 helps on network shares
+    int bufferScan_;    // match against whole files, only splitting out lines that hit
+    int binaryFiles_;   // BinaryFileMode
+    int streamAboveKb_; // files bigger than this are read a window at a time instead of mapped (0 = never)
+    int directoryManifest_; // 0 = always list directories, 1 = use .friskmanifest where one exists, 2 = create them too
+    int maxHitsPerFile_;    // stop searching a file after this many hits (0 = no limit)
+    int maxResults_;        // stop the whole search after this many hits (0 = no limit)
 
 	SavedSearchList savedSearches_;
 };
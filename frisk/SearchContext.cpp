@@ -6,192 +6,548 @@
 // ---------------------------------------------------------------------------
 
 #include "SearchContext.h"
+#include "DirectoryManifest.h"
+#include "DirectoryWalker.h"
+#include "DirectoryWatcher.h"
+#include "LiteralMatcher.h"
+#include "MappedFile.h"
+#include "MultiLiteralMatcher.h"
+#include "RequiredLiteral.h"
+#include "TextScan.h"
+#include "TrigramIndex.h"
+
+#include <cJSON.h>
 
 #include <algorithm>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <deque>
+#include <set>
 
 #define POKES_PER_SECOND (5)
+#define MAX_QUEUED_JOBS_PER_WORKER (64)
+#define JIT_STACK_START_SIZE (32 * 1024)
+#define JIT_STACK_MAX_SIZE (1024 * 1024)
+#define STREAM_WINDOW_SIZE (4 * 1024 * 1024)
+#define MAX_LISTED_NEEDLES (20) // in the summary after a match list search
+#define WATCH_POLL_MS (100)
+#define WATCH_SETTLE_MS (250) // quiet time before searching changed files, so a burst of saves costs one pass
+#define WATCH_MAX_DELAY_MS (2000) // a file that's written to nonstop (a log) still gets searched this often
+
+static bool startsWithCaseless(const std::string &s, const std::string &prefix)
+{
+    if(prefix.length() > s.length())
+        return false;
+    for(size_t i = 0; i < prefix.length(); ++i)
+    {
+        if(tolower((unsigned char)s[i]) != tolower((unsigned char)prefix[i]))
+            return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// ------------------------------------------------------------------------------------------------
+
+SearchEntry::SearchEntry()
+    : file_(-1)
+    , line_(0)
+    , offset_(0)
+    , contextOnly_(false)
+    , color_(0)
+    , textStart_(0)
+    , textLength_(0)
+    , spanStart_(0)
+    , spanCount_(0)
+{
+}
+
+SearchEntry::~SearchEntry()
+{
+}
+
+SearchEntry &SearchResults::addLine(int line, bool contextOnly, const char *lineText, size_t length)
+{
+    entries.push_back(SearchEntry());
+    SearchEntry &entry = entries.back();
+    entry.line_ = line;
+    entry.contextOnly_ = contextOnly;
+    entry.textStart_ = (int)text.size();
+    entry.textLength_ = (int)length;
+    entry.spanStart_ = (int)spans.size();
+    text.append(lineText, length);
+    return entry;
+}
+
+SearchEntry &SearchResults::addMessage(const std::string &message, int color)
+{
+    SearchEntry &entry = addLine(0, false, message.data(), message.length());
+    entry.color_ = color;
+    return entry;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+PokeData::PokeData()
+: id(0)
+, finished(false)
+, patchStart(-1)
+, patchLength(0)
+{
+}
+
+void PokeData::clear()
+{
+    id = 0;
+    finished = false;
+    progress.clear();
+    textBlocks.clear();
+    patchStart = -1;
+    patchLength = 0;
+}
 
-static char * strstri(char * haystack, const char * needle)
+// ------------------------------------------------------------------------------------------------
+
+SearchParams::SearchParams()
+: maxFileSize(0)
+, flags(0)
+, maxHitsPerFile(0)
+, maxResults(0)
+, dryRun(false)
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+
+SearchStats::SearchStats()
+: totalSeconds(0)
+, listSeconds(0)
+, filterSeconds(0)
+, readSeconds(0)
+, matchSeconds(0)
+, writeSeconds(0)
+, formatSeconds(0)
+, deliverSeconds(0)
+, bytesRead(0)
+, linesScanned(0)
+, directoriesListed(0)
+, filesSearched(0)
+, filesWithHits(0)
+, hits(0)
+{
+}
+
+void SearchStats::add(const SearchStats &other)
+{
+    listSeconds += other.listSeconds;
+    filterSeconds += other.filterSeconds;
+    readSeconds += other.readSeconds;
+    matchSeconds += other.matchSeconds;
+    writeSeconds += other.writeSeconds;
+    formatSeconds += other.formatSeconds;
+    deliverSeconds += other.deliverSeconds;
+    bytesRead += other.bytesRead;
+    linesScanned += other.linesScanned;
+}
+
+std::string SearchStats::json() const
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "total_seconds", totalSeconds);
+    cJSON *phases = cJSON_CreateObject();
+    cJSON_AddNumberToObject(phases, "list", listSeconds);
+    cJSON_AddNumberToObject(phases, "filter", filterSeconds);
+    cJSON_AddNumberToObject(phases, "read", readSeconds);
+    cJSON_AddNumberToObject(phases, "match", matchSeconds);
+    cJSON_AddNumberToObject(phases, "write", writeSeconds);
+    cJSON_AddNumberToObject(phases, "format", formatSeconds);
+    cJSON_AddNumberToObject(phases, "deliver", deliverSeconds);
+    cJSON_AddItemToObject(json, "phase_seconds", phases);
+    cJSON_AddNumberToObject(json, "bytes_read", (double)bytesRead);
+    cJSON_AddNumberToObject(json, "lines_scanned", (double)linesScanned);
+    cJSON_AddNumberToObject(json, "directories_listed", directoriesListed);
+    cJSON_AddNumberToObject(json, "files_searched", filesSearched);
+    cJSON_AddNumberToObject(json, "files_with_hits", filesWithHits);
+    cJSON_AddNumberToObject(json, "hits", hits);
+
+    char *text = cJSON_Print(json);
+    std::string s = text;
+    free(text);
+    cJSON_Delete(json);
+    return s;
+}
+
+// Adds the time from construction (or the last switchTo()) to whichever phase it's timing,
+// until it's stopped or goes out of scope. Given a trace buffer, each stretch is also a span
+// named for what was going on, about detail.
+class PhaseTimer
 {
-    char *front = haystack;
-    for(; *front; front++)
+public:
+    PhaseTimer(double &phase, TraceBuffer *trace = NULL, const char *span = NULL, const std::string &detail = std::string())
+    : phase_(&phase)
+    , trace_(trace)
+    , span_(span)
+    , start_(platformSeconds())
     {
-        const char *a = front;
-        const char *b = needle;
+        if(trace_)
+            detail_ = detail;
+    }
 
-        while(*a && *b)
-        {
-            if(tolower(*a) != tolower(*b))
-                break;
-            a++;
-            b++;
-        }
-        if(!*b)
-            return front;
+    ~PhaseTimer()
+    {
+        stop();
+    }
+
+    void switchTo(double &phase, const char *span = NULL)
+    {
+        if((phase_ == &phase) && (span_ == span))
+            return;
+
+        double now = platformSeconds();
+        finish(now);
+        phase_ = &phase;
+        span_ = span;
+        start_ = now;
+    }
+
+    void stop()
+    {
+        finish(platformSeconds());
+        phase_ = NULL;
+    }
+
+protected:
+    void finish(double now)
+    {
+        if(!phase_)
+            return;
+        *phase_ += now - start_;
+        if(trace_ && span_)
+            trace_->add(span_, start_, now, detail_);
     }
-    return NULL;
-}
+
+    double *phase_;
+    TraceBuffer *trace_;
+    const char *span_;
+    std::string detail_;
+    double start_;
+};
 
 // ------------------------------------------------------------------------------------------------
 
-HANDLE WTFMUTEX;
+SearchJob::SearchJob()
+: searched(false)
+, done(false)
+, matched(false)
+, binary(false)
+, linesWithHits(0)
+, hits(0)
+, firstHitLine(0)
+{
+}
 
-ScopedMutex::ScopedMutex(HANDLE mutex)
-: mutex_(mutex)
+SearchWorker::SearchWorker(SearchContext *context)
+: context(context)
+, jitStack(NULL)
+, matchExtra(NULL)
+, bufferExtra(NULL)
+, trace(NULL)
 {
-    WaitForSingleObject(mutex_, INFINITE);
 }
 
-ScopedMutex::~ScopedMutex()
+SearchWorker::~SearchWorker()
 {
-    ReleaseMutex(mutex_);
+    if(matchExtra)
+        pcre_free_study(matchExtra);
+    if(bufferExtra)
+        pcre_free_study(bufferExtra);
+    if(jitStack)
+        pcre_jit_stack_free(jitStack);
 }
 
 // ------------------------------------------------------------------------------------------------
 
-SearchEntry::SearchEntry()
-    : contextOnly_(false)
+// JIT compiles the regex if PCRE was built with JIT support and knows this CPU. Otherwise this just
+// returns whatever the interpreter can use (possibly NULL), and pcre_exec() copes either way.
+static pcre_extra *studyRegex(pcre *regex)
 {
+    const char *error = NULL;
+    return pcre_study(regex, PCRE_STUDY_JIT_COMPILE, &error);
 }
 
-SearchEntry::~SearchEntry()
+static bool isJitCompiled(pcre_extra *extra)
 {
+    int jit = 0;
+    return extra && !pcre_fullinfo(NULL, extra, PCRE_INFO_JIT, &jit) && jit;
 }
 
 // ------------------------------------------------------------------------------------------------
 
-SearchContext::SearchContext(HWND window)
-: thread_(INVALID_HANDLE_VALUE)
+SearchContext::SearchContext(SearchObserver *observer)
+: filesRuledOut_(0)
+, filesUpdated_(-1)
+, limitReached_(0)
+, contextLines_(0)
+, observer_(observer)
 , stop_(0)
 , searchID_(0)
-, window_(window)
 , pokeData_(NULL)
+, matchRegex_(NULL)
+, bufferRegex_(NULL)
+, trace_(NULL)
+, threadTrace_(NULL)
+, workerThreads_(0)
 {
-    WTFMUTEX = CreateMutex(NULL, FALSE, NULL);
-
-    mutex_ = CreateMutex(NULL, FALSE, NULL);
-    config_.load();
-    lastPoke_ = GetTickCount();
+    lastPoke_ = platformTicks();
 }
 
 SearchContext::~SearchContext()
 {
     stop();
     clear();
-
-    config_.save();
-
-    CloseHandle(mutex_);
 }
 
 void SearchContext::clear()
 {
-    ScopedMutex lock(mutex_);
+    PlatformScopedLock lock(mutex_);
 
     list_.clear();
+    files_.clear();
 }
 
-void SearchContext::makePretty(SearchEntry &entry)
+// filename as it should show up in the output
+std::string SearchContext::displayFilename(const std::string &filename)
 {
-    if(entry.filename_.empty())
-        return;
-
-    std::string s;
-    TextBlockList blocks;
-
-    if(lastFilename_ != entry.filename_)
+    std::string s = filename;
+    if(params_.flags & SF_TRIM_FILENAMES)
     {
-        s = entry.filename_.c_str();
-        if(params_.flags & SF_TRIM_FILENAMES)
+        std::string &startingPath = params_.paths[0];
+        if(startsWithCaseless(s, startingPath))
         {
-            std::string &startingPath = params_.paths[0];
-            if(strstri((char *)s.c_str(), startingPath.c_str()) == s.c_str())
+            s = s.substr(startingPath.length());
+            if(s.length() && (s[0] == PLATFORM_PATH_SEPARATOR))
             {
-                s = s.substr(startingPath.length());
-                if(s.length() && (s[0] == '\\'))
-                {
-                    s.erase(s.begin());
-                }
+                s.erase(s.begin());
             }
         }
+    }
+    return s;
+}
 
-        s.insert(0, "\n");
-        s += ":\n";
-        blocks.addBlock(s, config_.contextColor_);
+// Adds entry's output to blocks, returning how many characters that was
+int SearchContext::makePretty(const SearchResults &results, const SearchEntry &entry, TextBlockList &blocks)
+{
+    size_t firstLength = blocks.text.size();
+    const char *text = results.text.data() + entry.textStart_;
 
-        lastFilename_ = entry.filename_;
+    if(!entry.line_)
+    {
+        // Errors and binary file mentions are already as pretty as they get
+        blocks.addBlock(text, (size_t)entry.textLength_, entry.color_);
+    }
+    else if(params_.flags & SF_COUNT_ONLY)
+    {
+        // A row of sendCounts()'s table; the filename is the link
+        const TextSpan *spans = entry.spanCount_ ? &results.spans[entry.spanStart_] : NULL;
+        blocks.addHighlightedBlocks(text, entry.textLength_, spans, entry.spanCount_, config_.textColor_, config_.textColor_, true);
+        blocks.addBlock("\n", config_.textColor_);
     }
-    else if(entry.line_ != (lastLine_ + 1))
+    else if(params_.flags & SF_FILES_WITH_MATCHES)
     {
-        blocks.addBlock("  ...\n", config_.contextColor_);
+        // Just the name, which opens the file at its first hit
+        blocks.addBlock(displayFilename(files_[entry.file_]), config_.textColor_, true);
+        blocks.addBlock("\n", config_.textColor_);
     }
+    else
+    {
+        if(lastFile_ != entry.file_)
+        {
+            std::string s = displayFilename(files_[entry.file_]);
+            s.insert(0, "\n");
+            s += ":\n";
+            blocks.addBlock(s, config_.contextColor_);
+
+            lastFile_ = entry.file_;
+        }
+        else if(entry.line_ != (lastLine_ + 1))
+        {
+            blocks.addBlock("  ...\n", config_.contextColor_);
+        }
 
-    lastLine_ = entry.line_;
+        lastLine_ = entry.line_;
 
-    char lineNo[64];
-    sprintf(lineNo, "%5d%s ", entry.line_, entry.contextOnly_ ? " " : ":");
-    blocks.addBlock(lineNo, config_.contextColor_);
+        char lineNo[64];
+        sprintf(lineNo, "%5d%s ", entry.line_, entry.contextOnly_ ? " " : ":");
+        blocks.addBlock(lineNo, config_.contextColor_);
 
-    for(TextBlockList::iterator it = entry.textBlocks.begin(); it != entry.textBlocks.end(); ++it)
-    {
-        blocks.push_back(*it);
+        const TextSpan *spans = entry.spanCount_ ? &results.spans[entry.spanStart_] : NULL;
+        blocks.addHighlightedBlocks(text, entry.textLength_, spans, entry.spanCount_, config_.textColor_, config_.highlightColor_, true);
+
+        blocks.addBlock("\n", config_.textColor_);
     }
 
-    blocks.addBlock("\n", config_.textColor_);
+    // A NUL would end the whole batch early in the output control, while every offset after it still
+    // counted the rest; a space takes up the same room, so nothing else has to move
+    for(size_t nul = blocks.text.find('\0', firstLength); nul != std::string::npos; nul = blocks.text.find('\0', nul + 1))
+        blocks.text[nul] = ' ';
 
-    blocks.swap(entry.textBlocks);
+    return (int)(blocks.text.size() - firstLength);
 }
 
 void SearchContext::sendError(int id, const std::string &error)
 {
-    TextBlockList textBlocks;
-    textBlocks.addBlock(error, RGB(255, 0, 0));
-    poke(id, textBlocks, false);
+    // Goes in the list like anything else, so the offsets of everything after it stay right
+    SearchResults results;
+    results.addMessage(error, RGB(255, 0, 0));
+    append(id, results);
 }
 
-void SearchContext::append(int id, SearchEntry &entry)
+void SearchContext::append(int id, SearchResults &results)
 {
-    lock();
-
-    makePretty(entry);
-
     TextBlockList textBlocks;
-    textBlocks.swap(entry.textBlocks);
-    for(TextBlockList::iterator it = textBlocks.begin(); it != textBlocks.end(); ++it)
     {
-        offset_ += it->text.size();
-    }
-    entry.offset_ = offset_;
-    list_.push_back(entry);
+        PhaseTimer timer(phaseStats_.formatSeconds, threadTrace_, "format");
+        PlatformScopedLock lock(mutex_);
 
-    unlock();
+        for(SearchList::iterator it = results.entries.begin(); it != results.entries.end(); ++it)
+        {
+            offset_ += makePretty(results, *it, textBlocks);
+            it->offset_ = offset_;
+        }
+        list_.insert(list_.end(), results.entries.begin(), results.entries.end());
+    }
 
     poke(id, textBlocks, false);
 }
 
+// Output goes out a file at a time, whenever there's some; otherwise progress still goes out a
+// few times a second
 void SearchContext::poke(int id, TextBlockList &textBlocks, bool finished)
 {
-    if(textBlocks.size())
+    // The summary goes out in a batch of its own, so it can be told apart from the output
+    if(finished && observer_ && !pokeData_->textBlocks.empty() && !publishPoke(id, true))
+        return;
+
+    if(pokeData_->textBlocks.empty())
         pokeData_->textBlocks.swap(textBlocks);
+    else
+        pokeData_->textBlocks.append(textBlocks);
 
-    if(window_ != INVALID_HANDLE_VALUE)
+    if(observer_)
     {
-        UINT now = GetTickCount();
-        if(finished || (now > (lastPoke_ + (1000 / POKES_PER_SECOND))) || pokeData_->textBlocks.size())
+        unsigned int now = platformTicks();
+        bool patch = (pokeData_->patchStart >= 0);
+        if(finished || patch || !pokeData_->textBlocks.empty() || (now > (lastPoke_ + (1000 / POKES_PER_SECOND))))
         {
             lastPoke_ = now;
 
             char buffer[256];
-            sprintf(buffer, "%d hits, %d dirs, %d files", hits_, directoriesSearched_+directoriesSkipped_, filesSearched_+filesSkipped_);
-            if(!finished)
+            if(filesUpdated_ >= 0)
+                sprintf(buffer, "Watching for changes, %d files updated", filesUpdated_);
+            else
+                sprintf(buffer, "%d hits, %d dirs, %d files", currentHits(), walkerStats_.directoriesListed+walkerStats_.directoriesSkipped, filesSearched_+filesSkipped_+filesRuledOut_+walkerStats_.filesSkipped);
+            if(finished)
+                pokeData_->progress.clear();
+            else
                 pokeData_->progress = buffer;
+            pokeData_->finished = finished;
+
+            publishPoke(id, finished || patch);
+        }
+    }
+}
+
+// Hands the batch being filled to the UI. If the UI's behind, output just keeps piling into the
+// same batch until there's room, but patches and the end of a search can't be merged with
+// anything, so those wait for it (unless the search is being stopped, and nobody's listening).
+bool SearchContext::publishPoke(int id, bool wait)
+{
+    PhaseTimer timer(phaseStats_.deliverSeconds, threadTrace_, "publish");
+    pokeData_->id = id;
+    while(!channel_.publish(pokeData_))
+    {
+        if(!wait || stop_)
+            return false;
+        platformSleep(1);
+    }
+    pokeData_ = channel_.acquire();
+    return true;
+}
+
+PokeData *SearchContext::receivePoke()
+{
+    return channel_.receive();
+}
+
+void SearchContext::recyclePoke(PokeData *poke)
+{
+    channel_.recycle(poke);
+}
+
+// Swaps whatever output filename had for results (which may be empty), adding it after everything
+// else if it had none, and shifts the offsets of everything after it to match
+void SearchContext::patchFile(int id, const std::string &filename, SearchResults &results)
+{
+    TextBlockList textBlocks;
+    int start;
+    int length;
+    {
+        PlatformScopedLock lock(mutex_);
+
+        int file = (int)files_.size() - 1;
+        while((file >= 0) && (files_[file] != filename))
+            --file;
+        if(file < 0)
+        {
+            if(results.entries.empty())
+                return;
+            file = (int)files_.size();
+            files_.push_back(filename);
+        }
 
-            PostMessage(window_, WM_SEARCHCONTEXT_POKE, id, (LPARAM)pokeData_);
-            pokeData_ = new PokeData;
+        size_t first = 0;
+        while((first < list_.size()) && (list_[first].file_ != file))
+            ++first;
+        size_t last = first;
+        while((last < list_.size()) && (list_[last].file_ == file))
+            ++last;
+        if((first == last) && results.entries.empty())
+            return;
+
+        start = first ? list_[first - 1].offset_ : 0;
+        length = ((last > first) ? list_[last - 1].offset_ : start) - start;
+
+        int end = start;
+        lastFile_ = -1;
+        for(SearchList::iterator it = results.entries.begin(); it != results.entries.end(); ++it)
+        {
+            it->file_ = file;
+            end += makePretty(results, *it, textBlocks);
+            it->offset_ = end;
+        }
+
+        int delta = (end - start) - length;
+        for(size_t i = last; i < list_.size(); ++i)
+        {
+            list_[i].offset_ += delta;
         }
+        offset_ += delta;
+
+        list_.erase(list_.begin() + first, list_.begin() + last);
+        list_.insert(list_.begin() + first, results.entries.begin(), results.entries.end());
+        filesUpdated_++;
     }
+
+    // Anything still waiting to go out has to get there first, or the offsets will be off
+    if(!pokeData_->textBlocks.empty() && !publishPoke(id, true))
+        return;
+
+    pokeData_->patchStart = start;
+    pokeData_->patchLength = length;
+    poke(id, textBlocks, false);
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -207,306 +563,1209 @@ void replaceAll(std::string &s, const char *f, const char *r)
     }
 }
 
-void convertWildcard(std::string &regex)
-{
-    // Pretty terrible and crazy stuff.
-    replaceAll(regex, "[", "\\[");
-    replaceAll(regex, "]", "\\]");
-    replaceAll(regex, "\\", "\\\\");
-    replaceAll(regex, ".", "\\.");
-    replaceAll(regex, "*", ".*");
-    replaceAll(regex, "?", ".?");
-    regex.insert(0, "^");
-    regex.append("$");
-}
-
 #define stopCheck() { if(stop_) goto cleanup; }
 
-static char *nextToken(char **p, char sep)
+struct LineSpan
 {
-    char *front = *p;
-    if(!front || !*front)
-        return NULL;
-
-    char *end = front;
-    while(*end && (*end != sep))
-    {
-        end++;
-    }
-    if(*end == sep)
-    {
-        *end = 0;
-        *p = end+1;
-    }
-    else
+    const char *text;
+    int length;
+};
+
+// Whole-buffer regex scans only find candidates, and every candidate line is re-checked on its own.
+// That's only sound if anything matching a line by itself also matches at the same spot in the
+// buffer, so refuse anything that can see or eat line endings, or that behaves differently once it
+// can see past the end of the line (anchors, lookarounds, possessive/atomic groups, verbs).
+static bool regexStaysWithinLines(const std::string &pattern)
+{
+    static const char *safeEscapes = "bBdhSwNtfeaKQE";
+    for(size_t i = 0; i < pattern.length(); ++i)
     {
-        *p = NULL;
+        char c = pattern[i];
+        char next = ((i + 1) < pattern.length()) ? pattern[i + 1] : 0;
+        switch(c)
+        {
+            case '\\':
+                if(isalnum((unsigned char)next))
+                {
+                    if(!strchr(safeEscapes, next))
+                        return false;
+                }
+                else if(!next)
+                {
+                    return false;
+                }
+                i++;
+                break;
+            case '$':
+                return false;
+            case '(':
+                if((next == '?') || (next == '*'))
+                    return false;
+                break;
+            case '[':
+                if((next == '^') || (next == ':'))
+                    return false;
+                break;
+            case '*':
+            case '+':
+            case '?':
+            case '}':
+                if(next == '+')
+                    return false;
+                break;
+        }
     }
-    return front;
+    return true;
 }
 
-bool SearchContext::searchFile(int id, const std::string &filename, RegexList &filespecRegexes, pcre *matchRegex)
+struct FileScan
 {
-    bool matchesOneFilespec = false;
-    for(RegexList::iterator it = filespecRegexes.begin(); it != filespecRegexes.end(); ++it)
+    FileScan(SearchWorker &worker, SearchJob &job, const char *contents, size_t size)
+    : worker(worker)
+    , job(job)
+    , contents(contents)
+    , contentsEnd(contents + size)
+    , trailingContextLines(0)
+    , lineNumber(1)
+    , hitsLeft(0)
+    , full(false)
     {
-        pcre *regex = *it;
-        if(pcre_exec(regex, NULL, filename.c_str(), filename.length(), 0, 0, NULL, 0) >= 0)
-        {
-            matchesOneFilespec = true;
-            break;
-        }
     }
-    if(!matchesOneFilespec)
-        return false;
-
-    std::string contents;
-    if(!readEntireFile(filename, contents, params_.maxFileSize))
-        return false;
 
-    std::string workBuffer = contents;
-    std::string updatedContents;
+    SearchWorker &worker;
+    SearchJob &job;
+    const char *contents;
+    const char *contentsEnd;
 
-    std::deque<char *> contextLines;
+    std::deque<LineSpan> contextLines; // recent unprinted lines, in case a match wants them
+    int trailingContextLines;          // lines still owed to the last match
+    int lineNumber;
+    int hitsLeft; // before the file's had all the hits it's allowed; 0 for no limit
+    bool full;    // hitsLeft ran out, so there's no point looking any further
+};
 
-    bool atLeastOneMatch = false;
+// First match in [line, lineEnd), if any. needle is which match list entry it was, or -1.
+bool SearchContext::findMatch(SearchWorker &worker, const char *line, const char *lineEnd, int &matchPos, int &matchLen, int &needle)
+{
+    needle = -1;
+    worker.stats.linesScanned++;
 
-    int trailingContextLines = 0;
-    int lineNumber = 1;
-    char *p = &workBuffer[0];
-    char *line;
-    while((line = nextToken(&p, '\n')) != NULL)
+    // Either invoke PCRE or do a boring literal search
+    if(matchRegex_)
     {
-        char *originalLine = line;
-        std::string replacedLine;
-        SearchEntry entry;
         int ovector[100];
+        if(pcre_exec(matchRegex_, worker.matchExtra, line, lineEnd - line, 0, 0, ovector, sizeof(ovector) / sizeof(ovector[0])) < 0)
+            return false;
+        matchPos = ovector[0];
+        matchLen = ovector[1] - ovector[0];
+        return true;
+    }
+
+    const char *match;
+    if(!matchList_.empty())
+    {
+        match = matchList_.find(line, lineEnd, needle);
+        if(match)
+            matchLen = matchList_.needles()[needle].length();
+    }
+    else
+    {
+        match = literal_.find(line, lineEnd);
+        matchLen = literal_.needle().length();
+    }
+    if(!match)
+        return false;
+    matchPos = match - line;
+    return true;
+}
 
-        // Strip newline, but remember exactly what kind it was
-        bool hasCarriageReturn = false;
-        int lineLen = strlen(line);
-        if(lineLen && (line[lineLen - 1] == '\r'))
+// Matches, outputs and (for replace) rewrites the line starting at originalLine. Returns the start
+// of the following line.
+const char *SearchContext::scanLine(FileScan &scan, const char *originalLine)
+{
+    SearchWorker &worker = scan.worker;
+    const char *newline = (const char *)memchr(originalLine, '\n', scan.contentsEnd - originalLine);
+    const char *lineEnd = newline ? newline : scan.contentsEnd;
+    const char *nextLine = newline ? newline + 1 : scan.contentsEnd;
+
+    const char *line = originalLine;
+    bool lineChanged = false;
+
+    // The line's output goes straight into the job's buffers, and is backed out again if it
+    // turns out nobody wants it
+    SearchResults &results = scan.job.results;
+    size_t textStart = results.text.size();
+    size_t spanStart = results.spans.size();
+
+    // Strip newline; replace copies it over untouched along with everything else between matches
+    if((lineEnd > line) && (lineEnd[-1] == '\r'))
+        lineEnd--;
+    int originalLineLen = lineEnd - originalLine;
+
+    // Matching loop (we might find our string a few times on a single line)
+    bool lineMatched = false;
+    do
+    {
+        int matchPos;
+        int matchLen;
+        int needle;
+        bool matches = findMatch(worker, line, lineEnd, matchPos, matchLen, needle);
+        if(matches)
         {
-            line[lineLen - 1] = 0;
-            hasCarriageReturn = true;
+            lineMatched = true;
+            if(needle >= 0)
+                worker.needleHits[needle]++;
         }
 
-        // Matching loop (we might find our string a few times on a single line)
-        bool lineMatched = false;
-        do
+        // Handle the match. For replace or find, we:
+        // * Add output explaining the match
+        // * Advance the line pointer for another match attempt
+        // ... or ...
+        // * "break", which leaves the matching loop
+        if(params_.flags & SF_REPLACE)
         {
-            bool matches = false;
-            int matchPos;
-            int matchLen;
-
-            // The actual match. Either invoke PCRE or do a boring strstr
-            if(matchRegex)
+            if(matches)
             {
-                int rc;
-                if(rc = pcre_exec(matchRegex, 0, line, strlen(line), 0, 0, ovector, sizeof(ovector)) >= 0)
+                // Matches that would be replaced with themselves don't need remembering; whatever
+                // isn't remembered gets copied over as is
+                const char *match = line + matchPos;
+                if((matchLen != (int)params_.replace.length()) || memcmp(match, params_.replace.data(), matchLen))
                 {
-                    matches = true;
-                    matchPos = ovector[0];
-                    matchLen = ovector[1] - ovector[0];
+                    ReplaceSpan span;
+                    span.offset = match - scan.contents;
+                    span.length = matchLen;
+                    worker.replacements.push_back(span);
+                    lineChanged = true;
                 }
+                results.text.append(line, matchPos);
+                TextSpan highlight;
+                highlight.offset = (int)(results.text.size() - textStart);
+                highlight.length = (int)params_.replace.length();
+                results.spans.push_back(highlight);
+                results.text.append(params_.replace);
+                line += matchPos + matchLen;
             }
             else
             {
-                char *match;
-                if(params_.flags & SF_MATCH_CASE_SENSITIVE)
-                    match = strstr(line, params_.match.c_str());
-                else
-                    match = strstri(line, params_.match.c_str());
-                if(match != NULL)
-                {
-                    matches = true;
-                    matchPos = match - line;
-                    matchLen = params_.match.length();
-                }
+                break;
             }
-
+        }
+        else
+        {
             if(matches)
-                lineMatched = true;
-
-            // Handle the match. For replace or find, we:
-            // * Add output explaining the match
-            // * Advance the line pointer for another match attempt
-            // ... or ...
-            // * "break", which leaves the matching loop
-            if(params_.flags & SF_REPLACE)
             {
-                if(matches)
-                {
-                    std::string temp(line, matchPos);
-                    replacedLine.append(temp);
-                    replacedLine.append(params_.replace);
-                    entry.textBlocks.addBlock(temp, config_.textColor_);
-                    entry.textBlocks.addBlock(params_.replace, config_.highlightColor_, true);
-                    line += matchPos + matchLen;
-                }
-                else
-                {
-                    break;
-                }
+                TextSpan highlight;
+                highlight.offset = matchPos + (int)(line - originalLine);
+                highlight.length = matchLen;
+                results.spans.push_back(highlight);
+                line += matchPos + matchLen;
             }
             else
             {
-                if(matches)
-                {
-                    entry.textBlocks.addHighlightedBlock(originalLine, matchPos + (line - originalLine), matchLen, config_.textColor_, config_.highlightColor_, true);
-                    line += matchPos + matchLen;
-                }
-                else
-                {
-                    break;
-                }
+                break;
             }
-
-            if(matches)
-                hits_++;
         }
-        while(*line); // end of matching loop
 
-        // If we're doing a replace, finish the line and append to the final updated contents
-        if(params_.flags & SF_REPLACE)
+        if(matches)
         {
-            if(line && *line)
+            scan.job.hits++;
+            if(scan.hitsLeft && !--scan.hitsLeft)
             {
-                replacedLine += line;
-                entry.textBlocks.addBlock(line, config_.textColor_);
+                scan.full = true;
+                break;
             }
-            if(hasCarriageReturn)
+
+            // An empty match would otherwise match again in the same spot forever
+            if(!matchLen && (line < lineEnd))
             {
-                replacedLine += "\r";
+                if(params_.flags & SF_REPLACE)
+                    results.text.push_back(*line);
+                line++;
             }
-            replacedLine += "\n";
-            updatedContents += replacedLine;
         }
+    }
+    while(line < lineEnd); // end of matching loop
 
-        bool outputMatch = false;
-        if(lineMatched)
-        {
-            // keep stats
-            linesWithHits_++;
-            atLeastOneMatch = true;
+    // Finish the line's output; a plain find shows the line as is, highlights and all
+    if(lineMatched)
+    {
+        if(params_.flags & SF_REPLACE)
+            results.text.append(line, lineEnd - line);
+        else
+            results.text.append(originalLine, originalLineLen);
+    }
 
-            // If we matched, consider notifying the user. We'll always say something
-            // unless the replaced text doesn't actually change the line.
-            outputMatch = ( !(params_.flags & SF_REPLACE) ) || (replacedLine != originalLine);
+    bool outputMatch = false;
+    if(lineMatched)
+    {
+        // keep stats
+        scan.job.linesWithHits++;
+        scan.job.matched = true;
 
-            if(outputMatch)
-            {
-                entry.filename_ = filename;
-                entry.line_ = lineNumber;
+        // If we matched, consider notifying the user. We'll always say something
+        // unless the replaced text doesn't actually change the line.
+        outputMatch = ( !(params_.flags & SF_REPLACE) ) || lineChanged;
 
-                // output all existing context lines
-                if(contextLines.size())
+        if(outputMatch)
+        {
+            SearchEntry entry;
+            entry.line_ = scan.lineNumber;
+            entry.textStart_ = (int)textStart;
+            entry.textLength_ = (int)(results.text.size() - textStart);
+            entry.spanStart_ = (int)spanStart;
+            entry.spanCount_ = (int)(results.spans.size() - spanStart);
+
+            // output all existing context lines
+            if(scan.contextLines.size())
+            {
+                int currLine = scan.lineNumber - scan.contextLines.size();
+                for(std::deque<LineSpan>::iterator it = scan.contextLines.begin(); it != scan.contextLines.end(); ++it)
                 {
-                    SearchEntry contextEntry;
-                    contextEntry.filename_ = entry.filename_;
-                    contextEntry.contextOnly_ = true;
-                    int currLine = entry.line_ - contextLines.size();
-                    for(std::deque<char *>::iterator it = contextLines.begin(); it != contextLines.end(); ++it)
-                    {
-                        TextBlockList textBlocks;
-                        textBlocks.addBlock(*it, config_.textColor_);
-                        contextEntry.textBlocks.swap(textBlocks);
-                        contextEntry.line_ = currLine++;
-                        append(id, contextEntry);
-                    }
-
-                    contextLines.clear();
+                    results.addLine(currLine++, true, it->text, it->length);
                 }
 
-                append(id, entry);
+                scan.contextLines.clear();
             }
 
-            // Remember that we'd like the next few lines, even if they don't match
-            trailingContextLines = config_.contextLines_;
+            results.entries.push_back(entry);
         }
 
-        if(!outputMatch)
-        {
-            // Didn't output a match. Keep track or output the line anyway for contextual reasons.
-
-            if(trailingContextLines > 0)
-            {
-                // A recent match wants to see this line in the output anyway
-
-                SearchEntry trailingEntry;
-                trailingEntry.filename_ = filename;
-                trailingEntry.line_ = lineNumber;
-                trailingEntry.contextOnly_ = true;
-                trailingEntry.textBlocks.addBlock(originalLine, config_.textColor_);
-                append(id, trailingEntry);
-                trailingContextLines--;
-            }
-            else
-            {
-                // didn't output a match, and wasn't output as context. stash it in contextLines
-
-                contextLines.push_back(originalLine);
-                if((int)contextLines.size() > config_.contextLines_)
-                    contextLines.pop_front();
-            }
-        }
+        // Remember that we'd like the next few lines, even if they don't match
+        scan.trailingContextLines = contextLines_;
+    }
 
-        lineNumber++;
-    } // end of line loop (done reading file)
+    if(!outputMatch)
+    {
+        results.text.resize(textStart);
+        results.spans.resize(spanStart);
+
+        // Didn't output a match. Keep track or output the line anyway for contextual reasons.
+        LineSpan span;
+        span.text = originalLine;
+        span.length = originalLineLen;
+        keepUnmatchedLine(scan, span);
+    }
 
-    if(atLeastOneMatch)
-        filesWithHits_++;
+    scan.lineNumber++;
+    return nextLine;
+}
 
-    if(params_.flags & SF_REPLACE)
+void SearchContext::keepUnmatchedLine(FileScan &scan, const LineSpan &span)
+{
+    if(scan.trailingContextLines > 0)
     {
-        if((contents != updatedContents))
-        {
-            bool overwriteFile = true;
-            if(params_.flags & SF_BACKUP)
-            {
-                std::string backupFilename = filename;
-                backupFilename += ".";
-                backupFilename += params_.backupExtension;
-
-                if(!writeEntireFile(backupFilename, contents))
-                {
-                    std::string err = "WARNING: Couldn't write backup file (skipping replacement): ";
-                    err += backupFilename;
-                    err += "\n";
-                    sendError(id, err);
+        // A recent match wants to see this line in the output anyway
 
-                    overwriteFile = false;
-                }
-            }
+        scan.job.results.addLine(scan.lineNumber, true, span.text, span.length);
+        scan.trailingContextLines--;
+    }
+    else
+    {
+        // didn't output a match, and wasn't output as context. stash it in contextLines
 
-            if(overwriteFile)
-            {
-                if(writeEntireFile(filename, updatedContents))
-                {
-                    return true;
-                }
-                else
-                {
-                    std::string err = "WARNING: Couldn't write to file: ";
-                    err += filename;
-                    err += "\n";
-                    sendError(id, err);
-                }
-            }
-        }
-        return false;
+        scan.contextLines.push_back(span);
+        if((int)scan.contextLines.size() > contextLines_)
+            scan.contextLines.pop_front();
     }
-    return true;
 }
 
-// ------------------------------------------------------------------------------------------------
-
-static DWORD WINAPI staticSearchProc(void *param)
+// Same as running scanLine() over every line in [begin, end), for lines already known not to match.
+// Only the lines that can still end up as context get looked at individually.
+void SearchContext::skipLines(FileScan &scan, const char *begin, const char *end)
 {
-    SearchContext * context = (SearchContext *)param;
-    context->searchProc();
-    return 0;
-}
+    if(begin >= end)
+        return;
+
+    int count = countNewlines(begin, end);
+    if(end[-1] != '\n')
+        count++; // unterminated last line
+
+    // Pay off the trailing context first, walking forward
+    const char *p = begin;
+    while((count > 0) && (scan.trailingContextLines > 0))
+    {
+        const char *newline = (const char *)memchr(p, '\n', end - p);
+        const char *lineEnd = newline ? newline : end;
+        LineSpan span;
+        span.text = p;
+        span.length = lineEnd - p;
+        if((lineEnd > p) && (lineEnd[-1] == '\r'))
+            span.length--;
+        keepUnmatchedLine(scan, span);
+        scan.lineNumber++;
+        count--;
+        p = newline ? newline + 1 : end;
+    }
+    if(!count)
+        return;
+
+    // Everything else could only be leading context for a later match, so only the last few lines
+    // matter. Walk backward to find them.
+    int keep = std::min(count, contextLines_);
+    std::deque<LineSpan> lastLines;
+    const char *cursor = end;
+    for(int i = 0; i < keep; ++i)
+    {
+        const char *lineEnd = cursor;
+        if((lineEnd > p) && (lineEnd[-1] == '\n'))
+            lineEnd--;
+        const char *lineStart = findLineStart(p, lineEnd);
+        LineSpan span;
+        span.text = lineStart;
+        span.length = lineEnd - lineStart;
+        if((lineEnd > lineStart) && (lineEnd[-1] == '\r'))
+            span.length--;
+        lastLines.push_front(span);
+        cursor = lineStart;
+    }
+
+    if(count >= contextLines_)
+        scan.contextLines.clear();
+    scan.contextLines.insert(scan.contextLines.end(), lastLines.begin(), lastLines.end());
+    while((int)scan.contextLines.size() > contextLines_)
+        scan.contextLines.pop_front();
+    scan.lineNumber += count;
+}
+
+// Finds the next spot at or after from that might match. Sets failed if the regex gave up (match
+// limit, etc) and the rest of the file needs to be done line by line.
+const char *SearchContext::findCandidate(FileScan &scan, const char *from, bool &failed)
+{
+    if(!matchRegex_)
+    {
+        int which;
+        if(!matchList_.empty())
+            return matchList_.find(from, scan.contentsEnd, which);
+        return literal_.find(from, scan.contentsEnd);
+    }
+
+    // Lines without the required literal can't match, so the regex only needs to see lines with it.
+    // A single common character isn't much of a filter though; let the regex hunt if it can.
+    const std::string &required = requiredLiteral_.needle();
+    if(!required.empty() && ((required.length() > 1) || !bufferRegex_))
+        return requiredLiteral_.find(from, scan.contentsEnd);
+
+    int ovector[3];
+    int rc = pcre_exec(bufferRegex_, scan.worker.bufferExtra, scan.contents, scan.contentsEnd - scan.contents, from - scan.contents, 0, ovector, 3);
+    if(rc >= 0)
+        return scan.contents + ovector[0];
+    if(rc != PCRE_ERROR_NOMATCH)
+        failed = true;
+    return NULL;
+}
+
+// Whether candidates can be hunted for across the whole buffer (see scanRange())
+bool SearchContext::canBufferScan(size_t size)
+{
+    return config_.bufferScan_ && (!matchRegex_ || bufferRegex_ || !requiredLiteral_.needle().empty()) && (size < INT_MAX);
+}
+
+// Same as calling scanLine() on every line from p to the end of the scan
+void SearchContext::scanRange(FileScan &scan, const char *p, bool bufferScan)
+{
+    // Look for candidates across the whole buffer, and only split out the lines they land on
+    while(bufferScan && !scan.full && (p < scan.contentsEnd))
+    {
+        bool failed = false;
+        const char *candidate = findCandidate(scan, p, failed);
+        if(failed)
+            break;
+        if(!candidate)
+        {
+            skipLines(scan, p, scan.contentsEnd);
+            p = scan.contentsEnd;
+            break;
+        }
+
+        const char *lineStart = findLineStart(p, candidate);
+        skipLines(scan, p, lineStart);
+        p = scanLine(scan, lineStart);
+    }
+
+    while(!scan.full && (p < scan.contentsEnd))
+    {
+        p = scanLine(scan, p);
+    }
+
+    if(scan.full)
+    {
+        // The last hit still gets its trailing context, and that's all that gets looked at
+        const char *end = p;
+        for(int i = 0; (i < scan.trailingContextLines) && (end < scan.contentsEnd); ++i)
+        {
+            const char *newline = (const char *)memchr(end, '\n', scan.contentsEnd - end);
+            end = newline ? newline + 1 : scan.contentsEnd;
+        }
+        skipLines(scan, p, end);
+    }
+}
+
+// Counts what scanRange() would, for SF_COUNT_ONLY. There's no output and no context, so lines
+// only get split out where there's a candidate, and line numbers only get counted up to the first hit.
+void SearchContext::countRange(FileScan &scan, const char *p, bool bufferScan)
+{
+    SearchJob &job = scan.job;
+    while(p < scan.contentsEnd)
+    {
+        bool failed = false;
+        const char *candidate = bufferScan ? findCandidate(scan, p, failed) : p;
+        if(failed)
+        {
+            bufferScan = false;
+            continue;
+        }
+        if(!candidate)
+        {
+            if(!job.firstHitLine)
+                scan.lineNumber += countNewlines(p, scan.contentsEnd);
+            return;
+        }
+
+        const char *lineStart = findLineStart(p, candidate);
+        const char *newline = (const char *)memchr(candidate, '\n', scan.contentsEnd - candidate);
+        const char *lineEnd = newline ? newline : scan.contentsEnd;
+        if((lineEnd > lineStart) && (lineEnd[-1] == '\r'))
+            lineEnd--;
+
+        // Same matching loop as scanLine(), minus everything but the counting
+        int hits = 0;
+        const char *line = lineStart;
+        do
+        {
+            int matchPos, matchLen, needle;
+            if(!findMatch(scan.worker, line, lineEnd, matchPos, matchLen, needle))
+                break;
+            if(needle >= 0)
+                scan.worker.needleHits[needle]++;
+            hits++;
+
+            line += matchPos + matchLen;
+            if(!matchLen && (line < lineEnd))
+                line++;
+        }
+        while(line < lineEnd);
+
+        if(!job.firstHitLine)
+        {
+            scan.lineNumber += countNewlines(p, lineStart);
+            if(hits)
+                job.firstHitLine = scan.lineNumber;
+            else if(newline)
+                scan.lineNumber++;
+        }
+        if(hits)
+        {
+            job.hits += hits;
+            job.linesWithHits++;
+            job.matched = true;
+        }
+        p = newline ? newline + 1 : scan.contentsEnd;
+    }
+}
+
+// Whether anything from p on matches at all, without producing any output
+bool SearchContext::fileHasMatch(FileScan &scan, const char *p, bool bufferScan)
+{
+    while(p < scan.contentsEnd)
+    {
+        bool failed = false;
+        const char *candidate = bufferScan ? findCandidate(scan, p, failed) : p;
+        if(failed)
+        {
+            bufferScan = false;
+            continue;
+        }
+        if(!candidate)
+            return false;
+
+        const char *lineStart = findLineStart(p, candidate);
+        const char *newline = (const char *)memchr(candidate, '\n', scan.contentsEnd - candidate);
+        const char *lineEnd = newline ? newline : scan.contentsEnd;
+        if((lineEnd > lineStart) && (lineEnd[-1] == '\r'))
+            lineEnd--;
+
+        int matchPos, matchLen, needle;
+        if(findMatch(scan.worker, lineStart, lineEnd, matchPos, matchLen, needle))
+            return true;
+        p = newline ? newline + 1 : scan.contentsEnd;
+    }
+    return false;
+}
+
+bool SearchContext::searchFile(SearchWorker &worker, SearchJob &job)
+{
+    const std::string &filename = job.filename;
+
+    // Huge files get read a window at a time instead, unless they're about to be rewritten
+    MappedFile &file = worker.file;
+    s64 streamAboveKb = (params_.flags & SF_REPLACE) ? 0 : config_.streamAboveKb_;
+    PhaseTimer timer(worker.stats.readSeconds, worker.trace, "read", filename);
+    if(!file.open(filename, params_.maxFileSize, streamAboveKb))
+    {
+        timer.stop();
+        return file.shouldStream() && streamFile(worker, job);
+    }
+    timer.switchTo(worker.stats.matchSeconds, "match");
+
+    // The file is scanned in place and never written to; lines are (pointer, length) pairs into it
+    const char *contents = file.data();
+    const char *contentsEnd = contents + file.size();
+    worker.replacements.clear();
+
+    // Binary files never get line output (and are never replaced in); at most they get a mention.
+    // Only the first few KB get looked at to decide, so a mapped file is never read in full.
+    if((config_.binaryFiles_ != BINARY_SEARCH) && looksBinary(contents, file.size()))
+    {
+        job.binary = true;
+        bool report = (config_.binaryFiles_ == BINARY_REPORT) && !(params_.flags & SF_REPLACE);
+        if(report)
+        {
+            FileScan scan(worker, job, contents, file.size());
+            if(fileHasMatch(scan, contents, canBufferScan(file.size())))
+                reportBinaryMatch(job);
+        }
+        if(report)
+            worker.stats.bytesRead += (s64)file.size();
+        file.close();
+        return report;
+    }
+    worker.stats.bytesRead += (s64)file.size();
+
+    // Anything without the literal we're after (or that every regex match has to contain) is a miss
+    const LiteralMatcher &prefilter = matchRegex_ ? requiredLiteral_ : literal_;
+    if(!prefilter.needle().empty() && !prefilter.find(contents, contentsEnd))
+    {
+        file.close();
+        return !(params_.flags & SF_REPLACE);
+    }
+
+    FileScan scan(worker, job, contents, file.size());
+    scan.hitsLeft = fileHitLimit();
+    if(params_.flags & SF_COUNT_ONLY)
+        countRange(scan, contents, canBufferScan(file.size()));
+    else
+        scanRange(scan, contents, canBufferScan(file.size()));
+
+    if(params_.flags & SF_REPLACE)
+    {
+        // Nothing would actually change, so nothing gets written
+        timer.switchTo(worker.stats.writeSeconds, "write");
+        bool updated = !worker.replacements.empty() && (params_.dryRun || replaceFile(worker, job));
+        file.close();
+        return updated;
+    }
+    file.close();
+    return true;
+}
+
+// Writes the file back out with every remembered replacement made, copying everything between them
+// straight out of the mapping. The new contents go to a temp file that's only moved over the
+// original once it's complete, so a crash or a full disk never leaves a half written file behind.
+bool SearchContext::replaceFile(SearchWorker &worker, SearchJob &job)
+{
+    const std::string &filename = job.filename;
+    MappedFile &file = worker.file;
+    FileWriter &writer = worker.writer;
+    const char *contents = file.data();
+    size_t contentsSize = file.size();
+
+    if(params_.flags & SF_BACKUP)
+    {
+        std::string backupFilename = filename;
+        backupFilename += ".";
+        backupFilename += params_.backupExtension;
+
+        if(!writer.open(backupFilename) || !writer.write(contents, contentsSize) || !writer.commit())
+        {
+            writer.abort();
+
+            std::string err = "WARNING: Couldn't write backup file (skipping replacement): ";
+            err += backupFilename;
+            err += "\n";
+            job.errors.push_back(err);
+            return false;
+        }
+    }
+
+    bool written = writer.open(filename);
+    size_t copied = 0;
+    for(std::vector<ReplaceSpan>::iterator it = worker.replacements.begin(); written && (it != worker.replacements.end()); ++it)
+    {
+        written = writer.write(contents + copied, it->offset - copied) && writer.write(params_.replace);
+        copied = it->offset + it->length;
+    }
+    written = written && writer.write(contents + copied, contentsSize - copied);
+
+    // Let go of the mapping before moving anything over the file underneath it
+    file.close();
+
+    if(written && writer.commit())
+        return true;
+
+    writer.abort();
+    std::string err = "WARNING: Couldn't write to file: ";
+    err += filename;
+    err += "\n";
+    job.errors.push_back(err);
+    return false;
+}
+
+void SearchContext::reportBinaryMatch(SearchJob &job)
+{
+    // SF_COUNT_ONLY gives it a row of its own instead
+    if(!(params_.flags & SF_COUNT_ONLY))
+        job.results.addMessage("\nBinary file " + job.filename + " matches\n", config_.contextColor_);
+    job.matched = true;
+}
+
+// Searches a file too big to map in fixed size windows. Each window is cut at its last newline, and
+// the partial line after that is carried over to the front of the next one, along with copies of the
+// lines contextLines still points at. Memory use is the window size plus the longest line.
+bool SearchContext::streamFile(SearchWorker &worker, SearchJob &job)
+{
+    FileStream &stream = worker.stream;
+    PhaseTimer timer(worker.stats.readSeconds, worker.trace, "read", job.filename);
+    if(!stream.open(job.filename))
+        return false;
+
+    std::string &window = worker.window;
+    FileScan scan(worker, job, NULL, 0);
+    scan.hitsLeft = fileHitLimit();
+    std::vector<std::pair<size_t, int> > carriedContext; // offset/length of each context line in window
+    size_t used = 0;     // bytes in window
+    size_t scanFrom = 0; // first byte not scanned yet
+    bool binary = false;
+    bool binaryMatch = false;
+    bool skipped = false;
+    bool first = true;
+    bool atEnd = false;
+    s64 totalRead = 0;
+    while(!atEnd && !stop_)
+    {
+        timer.switchTo(worker.stats.readSeconds, "read");
+        if(window.size() < (used + STREAM_WINDOW_SIZE))
+            window.resize(used + STREAM_WINDOW_SIZE);
+        size_t bytesRead = stream.read(&window[used], STREAM_WINDOW_SIZE);
+        used += bytesRead;
+        totalRead += (s64)bytesRead;
+        atEnd = (bytesRead < STREAM_WINDOW_SIZE);
+        timer.switchTo(worker.stats.matchSeconds, "match");
+
+        // Only whole lines get scanned; keep reading if there isn't one yet
+        const char *data = window.data();
+        size_t scanEnd = used;
+        if(!atEnd)
+        {
+            const char *lastNewline = NULL;
+            for(const char *p = data + used; p > (data + scanFrom); --p)
+            {
+                if(p[-1] == '\n')
+                {
+                    lastNewline = p - 1;
+                    break;
+                }
+            }
+            if(!lastNewline)
+                continue;
+            scanEnd = (lastNewline + 1) - data;
+        }
+
+        if(first)
+        {
+            first = false;
+            if(!used)
+            {
+                skipped = true; // shrank down to nothing since it was opened
+                break;
+            }
+            if((config_.binaryFiles_ != BINARY_SEARCH) && looksBinary(data, used))
+            {
+                job.binary = true;
+                skipped = (config_.binaryFiles_ == BINARY_SKIP);
+                if(skipped)
+                    break;
+                binary = true;
+            }
+        }
+
+        scan.contents = data;
+        scan.contentsEnd = data + scanEnd;
+        scan.contextLines.clear();
+        for(size_t i = 0; i < carriedContext.size(); ++i)
+        {
+            LineSpan span;
+            span.text = data + carriedContext[i].first;
+            span.length = carriedContext[i].second;
+            scan.contextLines.push_back(span);
+        }
+
+        if(binary)
+        {
+            if(fileHasMatch(scan, data + scanFrom, canBufferScan(scanEnd)))
+            {
+                binaryMatch = true;
+                break;
+            }
+        }
+        else if(params_.flags & SF_COUNT_ONLY)
+        {
+            countRange(scan, data + scanFrom, canBufferScan(scanEnd));
+        }
+        else
+        {
+            scanRange(scan, data + scanFrom, canBufferScan(scanEnd));
+            if(scan.full && !scan.trailingContextLines)
+                break;
+        }
+
+        // Move what's still needed to the front: the context lines, then the unscanned leftovers
+        size_t leftover = used - scanEnd;
+        std::string carry;
+        carriedContext.clear();
+        for(std::deque<LineSpan>::iterator it = scan.contextLines.begin(); it != scan.contextLines.end(); ++it)
+        {
+            carriedContext.push_back(std::make_pair(carry.size(), it->length));
+            carry.append(it->text, it->length);
+            carry += '\n';
+        }
+        carry.append(data + scanEnd, leftover);
+        memcpy(&window[0], carry.data(), carry.size());
+        used = carry.size();
+        scanFrom = used - leftover;
+    }
+    stream.close();
+
+    if(skipped)
+        return false;
+    worker.stats.bytesRead += totalRead;
+    if(binaryMatch)
+        reportBinaryMatch(job);
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void staticWorkerProc(void *param)
+{
+    SearchWorker *worker = (SearchWorker *)param;
+    worker->context->workerProc(worker);
+}
+
+void SearchContext::workerProc(SearchWorker *worker)
+{
+    if(trace_)
+        worker->trace = trace_->createBuffer("worker");
+
+    for(;;)
+    {
+        jobSemaphore_.wait();
+
+        SearchJob *job;
+        {
+            PlatformScopedLock lock(jobMutex_);
+            job = pendingJobs_.front();
+            pendingJobs_.pop_front();
+        }
+        if(!job)
+            break; // sentinel from stopWorkers()
+
+        if(!stop_ && !limitReached_)
+            job->searched = searchFile(*worker, *job);
+
+        {
+            PlatformScopedLock lock(jobMutex_);
+            job->done = true;
+        }
+        jobDoneEvent_.signal();
+    }
+}
+
+void SearchContext::startWorkers(int count)
+{
+    if(count <= 0)
+        count = platformProcessorCount();
+
+    workerThreads_ = (count > 1) ? count : 0;
+    if(!workerThreads_)
+    {
+        SearchWorker *worker = new SearchWorker(this);
+        prepareWorker(worker);
+        worker->trace = threadTrace_; // it runs on this thread
+        workers_.push_back(worker);
+        return;
+    }
+
+    for(int i = 0; i < workerThreads_; ++i)
+    {
+        SearchWorker *worker = new SearchWorker(this);
+        prepareWorker(worker);
+        worker->thread.start(staticWorkerProc, worker);
+        workers_.push_back(worker);
+    }
+}
+
+void SearchContext::prepareWorker(SearchWorker *worker)
+{
+    worker->needleHits.assign(matchList_.needles().size(), 0);
+    if(matchRegex_)
+        worker->matchExtra = studyRegex(matchRegex_);
+    if(bufferRegex_)
+        worker->bufferExtra = studyRegex(bufferRegex_);
+
+    if(isJitCompiled(worker->matchExtra) || isJitCompiled(worker->bufferExtra))
+    {
+        // The default 32K machine stack runs out quickly on long lines or nested groups
+        worker->jitStack = pcre_jit_stack_alloc(JIT_STACK_START_SIZE, JIT_STACK_MAX_SIZE);
+        if(worker->jitStack)
+        {
+            if(worker->matchExtra)
+                pcre_assign_jit_stack(worker->matchExtra, NULL, worker->jitStack);
+            if(worker->bufferExtra)
+                pcre_assign_jit_stack(worker->bufferExtra, NULL, worker->jitStack);
+        }
+    }
+}
+
+void SearchContext::stopWorkers()
+{
+    if(workerThreads_)
+    {
+        {
+            PlatformScopedLock lock(jobMutex_);
+            for(int i = 0; i < workerThreads_; ++i)
+                pendingJobs_.push_back(NULL);
+        }
+        jobSemaphore_.post(workerThreads_);
+    }
+
+    for(SearchWorkerList::iterator it = workers_.begin(); it != workers_.end(); ++it)
+    {
+        SearchWorker *worker = *it;
+        worker->thread.join();
+        for(size_t i = 0; i < worker->needleHits.size(); ++i)
+            needleHits_[i] += worker->needleHits[i];
+        phaseStats_.add(worker->stats);
+        delete worker;
+    }
+    workers_.clear();
+    workerThreads_ = 0;
+
+    // Anything left over was abandoned by a stop()
+    pendingJobs_.clear();
+    for(SearchJobQueue::iterator it = orderedJobs_.begin(); it != orderedJobs_.end(); ++it)
+    {
+        delete *it;
+    }
+    orderedJobs_.clear();
+}
+
+void SearchContext::queueJob(int id, const std::string &filename)
+{
+    SearchJob *job = new SearchJob;
+    job->filename = filename;
+
+    if(!workerThreads_)
+    {
+        job->searched = searchFile(*workers_[0], *job);
+        job->done = true;
+        commitJob(id, job);
+        delete job;
+        return;
+    }
+
+    {
+        PlatformScopedLock lock(jobMutex_);
+        pendingJobs_.push_back(job);
+    }
+    orderedJobs_.push_back(job);
+    jobSemaphore_.post();
+
+    flushJobs(id, false);
+
+    // Don't let enumeration run too far ahead of the workers, or buffered output piles up
+    while(!stop_ && ((int)orderedJobs_.size() > (workerThreads_ * MAX_QUEUED_JOBS_PER_WORKER)))
+    {
+        jobDoneEvent_.wait(100);
+        flushJobs(id, false);
+    }
+}
+
+void SearchContext::flushJobs(int id, bool waitForAll)
+{
+    while(!orderedJobs_.empty() && !stop_)
+    {
+        SearchJob *job = orderedJobs_.front();
+        bool done;
+        {
+            PlatformScopedLock lock(jobMutex_);
+            done = job->done;
+        }
+
+        if(!done)
+        {
+            if(!waitForAll)
+                return;
+
+            jobDoneEvent_.wait(100);
+            continue;
+        }
+
+        orderedJobs_.pop_front();
+        commitJob(id, job);
+        delete job;
+    }
+}
+
+void SearchContext::commitJob(int id, SearchJob *job)
+{
+    // Once the limit's been reached, whatever else was already in flight never happened
+    if(limitReached_)
+        return;
+    if(params_.maxResults && ((hits_ + job->hits) >= params_.maxResults))
+        limitResults(*job);
+
+    if(!job->results.entries.empty())
+    {
+        int file;
+        {
+            PlatformScopedLock lock(mutex_);
+            file = (int)files_.size();
+            files_.push_back(job->filename);
+        }
+        for(SearchList::iterator it = job->results.entries.begin(); it != job->results.entries.end(); ++it)
+        {
+            it->file_ = file;
+        }
+        append(id, job->results);
+    }
+    for(StringList::iterator it = job->errors.begin(); it != job->errors.end(); ++it)
+    {
+        sendError(id, *it);
+    }
+
+    if(job->matched)
+    {
+        filesWithHits_++;
+        if(params_.flags & SF_COUNT_ONLY)
+        {
+            FileCount count;
+            count.filename = job->filename;
+            count.hits = job->hits;
+            count.line = job->binary ? 1 : job->firstHitLine;
+            count.binary = job->binary;
+            fileCounts_.push_back(count);
+        }
+    }
+    if(job->binary)
+        binaryFiles_++;
+    linesWithHits_ += job->linesWithHits;
+    hits_ += job->hits;
+
+    if(job->searched)
+    {
+        filesSearched_++;
+    }
+    else
+    {
+        filesSkipped_++;
+    }
+
+    TextBlockList noBlocks;
+    poke(id, noBlocks, false);
+}
+
+// Cuts job's output off at the line with the last hit maxResults allows (keeping that line's
+// trailing context), and stops the search from going any further
+void SearchContext::limitResults(SearchJob &job)
+{
+    limitReached_ = 1;
+
+    SearchList &entries = job.results.entries;
+    int hitsLeft = params_.maxResults - hits_;
+    int hits = 0;
+    int lines = 0;
+    size_t keep = 0;
+    while((keep < entries.size()) && (hits < hitsLeft))
+    {
+        const SearchEntry &entry = entries[keep++];
+        if(entry.line_ && !entry.contextOnly_)
+        {
+            hits += entry.spanCount_;
+            lines++;
+        }
+    }
+    for(int i = 0; (i < contextLines_) && (keep < entries.size()) && entries[keep].contextOnly_ && (entries[keep].line_ == (entries[keep - 1].line_ + 1)); ++i)
+    {
+        keep++;
+    }
+    entries.resize(keep);
+
+    job.hits = hits;
+    job.linesWithHits = lines;
+}
+
+int SearchContext::currentHits()
+{
+    return hits_;
+}
+
+// How many hits a file can have before there's no point looking any further; 0 for no limit.
+// maxResults is only enforced as jobs are committed, but no file can add more than what's left of
+// it, so scanning stops there too rather than turning every hit in a huge file into a line first.
+int SearchContext::fileHitLimit()
+{
+    int limit = params_.maxHitsPerFile;
+    if(params_.maxResults)
+    {
+        // Read without the lock, same as limitReached_; a stale count only makes the limit looser
+        int left = params_.maxResults - hits_;
+        if(left < 1)
+            left = 1; // whatever this file finds gets thrown away at commit anyway
+        if(!limit || (left < limit))
+            limit = left;
+    }
+    return limit;
+}
+
+static bool moreHits(const std::pair<int, int> &a, const std::pair<int, int> &b)
+{
+    return (a.first != b.first) ? (a.first > b.first) : (a.second < b.second);
+}
+
+std::string SearchContext::describeNeedleHits()
+{
+    // Most hit strings first, in list order for ties
+    std::vector<std::pair<int, int> > ranked;
+    for(size_t i = 0; i < needleHits_.size(); ++i)
+    {
+        if(needleHits_[i])
+            ranked.push_back(std::make_pair(needleHits_[i], (int)i));
+    }
+    std::sort(ranked.begin(), ranked.end(), moreHits);
+
+    const StringList &needles = matchList_.needles();
+    std::string text = "\nHits per string: ";
+    char buffer[64];
+    int listed = std::min((int)ranked.size(), MAX_LISTED_NEEDLES);
+    for(int i = 0; i < listed; ++i)
+    {
+        if(i)
+            text += ", ";
+        sprintf(buffer, " (%d)", ranked[i].first);
+        text += needles[ranked[i].second];
+        text += buffer;
+    }
+    if((int)ranked.size() > listed)
+    {
+        sprintf(buffer, ", and %d more", (int)ranked.size() - listed);
+        text += buffer;
+    }
+    sprintf(buffer, "%s%d of %d had no hits", ranked.empty() ? "" : ". ", (int)(needles.size() - ranked.size()), (int)needles.size());
+    text += buffer;
+    return text;
+}
+
+static bool moreFileHits(const FileCount &a, const FileCount &b)
+{
+    return a.hits > b.hits;
+}
+
+// Lists every file SF_COUNT_ONLY found a hit in, most hits first (binary files, which only ever get
+// checked for a match, last). Clicking a filename opens it at its first hit.
+void SearchContext::sendCounts(int id)
+{
+    std::stable_sort(fileCounts_.begin(), fileCounts_.end(), moreFileHits);
+
+    char buffer[64];
+    int width = 6;
+    if(!fileCounts_.empty())
+        width = std::max(width, sprintf(buffer, "%d", fileCounts_[0].hits));
+
+    SearchResults results;
+    {
+        PlatformScopedLock lock(mutex_);
+        for(std::vector<FileCount>::iterator it = fileCounts_.begin(); it != fileCounts_.end(); ++it)
+        {
+            if(it->binary)
+                sprintf(buffer, "%*s  ", width, "binary");
+            else
+                sprintf(buffer, "%*d  ", width, it->hits);
+            std::string row = buffer;
+            TextSpan link;
+            link.offset = (int)row.length();
+            row += displayFilename(it->filename);
+            link.length = (int)row.length() - link.offset;
+
+            SearchEntry &entry = results.addLine(it->line, false, row.data(), row.length());
+            entry.file_ = (int)files_.size();
+            entry.spanCount_ = 1;
+            results.spans.push_back(link);
+            files_.push_back(it->filename);
+        }
+    }
+    fileCounts_.clear();
+
+    append(id, results);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void SearchContext::loadIndexes()
+{
+    // The index can only vouch for files missing something every match has to contain
+    StringList needles;
+    if(!matchList_.empty())
+        needles = matchList_.needles();
+    else if(!(params_.flags & SF_MATCH_REGEXES) || !matchRegex_)
+        needles.push_back(literal_.needle());
+    else if(!requiredLiteral_.needle().empty())
+        needles.push_back(requiredLiteral_.needle());
+    if(needles.empty())
+        return;
+
+    for(StringList::iterator it = params_.paths.begin(); it != params_.paths.end(); ++it)
+    {
+        TrigramIndex *index = new TrigramIndex;
+        if(index->load(*it) && index->select(needles))
+            indexes_.push_back(index);
+        else
+            delete index;
+    }
+}
+
+bool SearchContext::indexAllows(DirectoryEntry &entry)
+{
+    for(std::vector<TrigramIndex *>::iterator it = indexes_.begin(); it != indexes_.end(); ++it)
+    {
+        if((*it)->isCandidate(entry.path, entry.size, entry.modified))
+            continue;
+
+        // Files listed out of a manifest can have changed since; check before believing the index
+        if(!entry.fromManifest)
+            return false;
+        entry.fromManifest = false;
+        if(!statPath(entry.path, entry) || !(*it)->isCandidate(entry.path, entry.size, entry.modified))
+            return false;
+    }
+    return true;
+}
+
+void SearchContext::closeIndexes()
+{
+    for(std::vector<TrigramIndex *>::iterator it = indexes_.begin(); it != indexes_.end(); ++it)
+    {
+        delete *it;
+    }
+    indexes_.clear();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void staticSearchProc(void *param)
+{
+    SearchContext * context = (SearchContext *)param;
+    context->searchProc();
+}
 
 void SearchContext::search(const SearchParams &params)
 {
@@ -517,48 +1776,121 @@ void SearchContext::search(const SearchParams &params)
     stop_ = 0;
     offset_ = 0;
 
-    DWORD id;
-    thread_ = CreateThread(NULL, 0, staticSearchProc, (void*)this, 0, &id);
+    // Replacing again every time a file changed would set itself off forever, and replacing only
+    // some of the matches would be a strange thing to want
+    if(params_.flags & SF_REPLACE)
+    {
+        params_.flags &= ~(SF_WATCH | SF_FILES_WITH_MATCHES | SF_COUNT_ONLY);
+        params_.maxHitsPerFile = 0;
+        params_.maxResults = 0;
+    }
+
+    // Counting only ever finishes with the table, so there's nothing to watch, list or cut short
+    if(params_.flags & SF_COUNT_ONLY)
+    {
+        params_.flags &= ~(SF_WATCH | SF_FILES_WITH_MATCHES);
+        params_.maxHitsPerFile = 0;
+        params_.maxResults = 0;
+    }
+    if(params_.flags & SF_FILES_WITH_MATCHES)
+        params_.maxHitsPerFile = 1;
+    if(params_.maxHitsPerFile < 0)
+        params_.maxHitsPerFile = 0;
+    if(params_.maxResults < 0)
+        params_.maxResults = 0;
+
+    thread_.start(staticSearchProc, this);
 }
 
 void SearchContext::stop()
 {
     searchID_++;
 
-    if(thread_ != INVALID_HANDLE_VALUE)
-    {
-        stop_ = 1;
-        WaitForSingleObject(thread_, INFINITE);
-        CloseHandle(thread_);
-        thread_ = INVALID_HANDLE_VALUE;
-    }
+    stop_ = 1;
+    thread_.join();
 }
 
 void SearchContext::searchProc()
 {
+    if(params_.flags & SF_BUILD_INDEX)
+    {
+        indexProc();
+        return;
+    }
+
     int id = searchID_;
-    HANDLE findHandle = INVALID_HANDLE_VALUE;
-    StringList paths;
-    paths = params_.paths;
-    RegexList filespecRegexes;
-    pcre *matchRegex = NULL;
-
-    directoriesSearched_ = 0;
-    directoriesSkipped_ = 0;
+
+    walkerStats_.directoriesListed = 0;
+    walkerStats_.directoriesCached = 0;
+    walkerStats_.directoriesSkipped = 0;
+    walkerStats_.filesSkipped = 0;
     filesSearched_ = 0;
     filesSkipped_ = 0;
     filesWithHits_ = 0;
     linesWithHits_ = 0;
     hits_ = 0;
-    lastFilename_ = "";
-
-    unsigned int startTick = GetTickCount();
+    binaryFiles_ = 0;
+    filesRuledOut_ = 0;
+    filesUpdated_ = -1;
+    limitReached_ = 0;
+    contextLines_ = (params_.flags & (SF_FILES_WITH_MATCHES | SF_COUNT_ONLY)) ? 0 : config_.contextLines_;
+    needleHits_.clear();
+    fileCounts_.clear();
+    lastFile_ = -1;
+    phaseStats_ = SearchStats();
+
+    double startSeconds = platformSeconds();
+    if(!params_.traceFilename.empty())
+    {
+        trace_ = new SearchTrace;
+        threadTrace_ = trace_->createBuffer("search");
+    }
+    DirectoryWatcher watcher;
 
     bool filespecUsesRegexes = ((params_.flags & SF_FILESPEC_REGEXES) != 0);
     bool matchUsesRegexes    = ((params_.flags & SF_MATCH_REGEXES) != 0);
 
-    delete pokeData_;
-    pokeData_ = new PokeData;
+    pokeData_ = channel_.acquire();
+
+    // Nothing from the last search can be left in these; searchFile() prefilters with them
+    literal_.set("", true);
+    requiredLiteral_.set("", true);
+    matchList_.clear();
+    if(params_.flags & SF_MATCH_LIST)
+    {
+        // Any of a ;-separated list of plain strings, all hunted for at once
+        StringList needles;
+        size_t start = 0;
+        for(;;)
+        {
+            size_t semicolon = params_.match.find(';', start);
+            needles.push_back(params_.match.substr(start, (semicolon == std::string::npos) ? std::string::npos : semicolon - start));
+            if(semicolon == std::string::npos)
+                break;
+            start = semicolon + 1;
+        }
+        matchList_.set(needles, (params_.flags & SF_MATCH_CASE_SENSITIVE) != 0);
+        needleHits_.assign(matchList_.needles().size(), 0);
+        matchUsesRegexes = false;
+    }
+    else if(matchUsesRegexes)
+    {
+        // Regexes without any actual regex in them are just a literal search
+        std::string required;
+        bool wholePattern;
+        if(findRequiredLiteral(params_.match, required, wholePattern))
+        {
+            if(wholePattern)
+            {
+                literal_.set(required, (params_.flags & SF_MATCH_CASE_SENSITIVE) != 0);
+                matchUsesRegexes = false;
+            }
+            else
+            {
+                requiredLiteral_.set(required, (params_.flags & SF_MATCH_CASE_SENSITIVE) != 0);
+            }
+        }
+    }
 
     if(matchUsesRegexes)
     {
@@ -567,145 +1899,486 @@ void SearchContext::searchProc()
         int flags = 0;
         if(!(params_.flags & SF_MATCH_CASE_SENSITIVE))
             flags |= PCRE_CASELESS;
-        matchRegex = pcre_compile(params_.match.c_str(), flags, &error, &erroffset, NULL);
-        if(!matchRegex)
+        matchRegex_ = pcre_compile(params_.match.c_str(), flags, &error, &erroffset, NULL);
+        if(!matchRegex_)
         {
-            MessageBox(window_, error, "Match Regex Error", MB_OK);
+            if(observer_)
+                observer_->searchFailed("Match Regex Error", error);
             goto cleanup;
         }
+
+        // Same pattern, but able to hunt through an entire file at once (see searchFile())
+        if(config_.bufferScan_ && regexStaysWithinLines(params_.match))
+            bufferRegex_ = pcre_compile(params_.match.c_str(), flags | PCRE_MULTILINE | PCRE_NEWLINE_LF, &error, &erroffset, NULL);
+    }
+    else if(!(params_.flags & (SF_MATCH_REGEXES | SF_MATCH_LIST)))
+    {
+        literal_.set(params_.match, (params_.flags & SF_MATCH_CASE_SENSITIVE) != 0);
     }
 
-    for(StringList::iterator it = params_.filespecs.begin(); it != params_.filespecs.end(); ++it)
     {
-        std::string regexString = it->c_str();
-        if(!filespecUsesRegexes)
-            convertWildcard(regexString);
+        std::string error;
+        if(!filespecs_.set(params_.filespecs, filespecUsesRegexes, (params_.flags & SF_FILESPEC_CASE_SENSITIVE) != 0, error))
+        {
+            if(observer_)
+                observer_->searchFailed("Filespec Regex Error", error);
+            goto cleanup;
+        }
+    }
 
-        int flags = 0;
-        if(!(params_.flags & SF_FILESPEC_CASE_SENSITIVE))
-            flags |= PCRE_CASELESS;
+    loadIndexes();
 
-        const char *error;
-        int erroffset;
-        pcre *regex = pcre_compile(regexString.c_str(), flags, &error, &erroffset, NULL);
-        if(regex)
-            filespecRegexes.push_back(regex);
-        else
+    if(observer_)
+        observer_->searchStateChanged(true);
+
+    startWorkers(config_.searchThreads_);
+
+    {
+        // Files named outright get searched first, whatever the filespecs say; only directories
+        // get walked
+        StringList roots;
+        for(StringList::iterator it = params_.paths.begin(); it != params_.paths.end(); ++it)
         {
-            MessageBox(window_, error, "Filespec Regex Error", MB_OK);
-            goto cleanup;
+            DirectoryEntry root;
+            if(statPath(*it, root) && !root.isDirectory)
+                queueJob(id, *it);
+            else
+                roots.push_back(*it);
+        }
+
+        bool recursive = ((params_.flags & SF_RECURSIVE) != 0);
+        DirectoryManifest manifest;
+        if(config_.directoryManifest_)
+            manifest.open(roots, recursive && (config_.directoryManifest_ > 1));
+
+        // Watch before walking, so nothing that changes mid-search gets missed
+        if((params_.flags & SF_WATCH) && !watcher.start(params_.paths, recursive))
+        {
+            sendError(id, "WARNING: Couldn't watch for changes, searching once\n");
+            params_.flags &= ~SF_WATCH;
+        }
+
+        {
+            DirectoryWalker walker(roots, recursive, config_.walkerThreads_, &filespecs_, config_.directoryManifest_ ? &manifest : NULL, trace_);
+            DirectoryEntry entry;
+            for(;;)
+            {
+                stopCheck();
+                if(limitReached_)
+                    break;
+
+                DirectoryWalker::State state = walker.next(entry);
+                walkerStats_ = walker.stats();
+                if(state == DirectoryWalker::WALK_DONE)
+                    break;
+
+                if(state == DirectoryWalker::WALK_WAITING)
+                {
+                    // Walkers are stuck waiting on the disk; keep the output flowing
+                    flushJobs(id, false);
+                    TextBlockList noBlocks;
+                    poke(id, noBlocks, false);
+                    continue;
+                }
+
+                if(!indexAllows(entry))
+                {
+                    filesRuledOut_++;
+                    continue;
+                }
+
+                queueJob(id, entry.path);
+            }
+            walker.times(phaseStats_.listSeconds, phaseStats_.filterSeconds);
         }
+
+        // Only a complete recursive walk has seen every directory the manifest should remember
+        if(recursive && !limitReached_)
+            manifest.save();
+    }
+
+    flushJobs(id, true);
+
+    if((params_.flags & SF_COUNT_ONLY) && !stop_)
+        sendCounts(id);
+
+    if((params_.flags & SF_WATCH) && !stop_)
+    {
+        // Done, as far as the summary is concerned. Changed files get searched again on this thread.
+        stopWorkers();
+        sendSummary(id, startSeconds);
+        startWorkers(1);
+        watchFiles(id, watcher);
+    }
+
+cleanup:
+    stopWorkers();
+    if(trace_)
+    {
+        // Every other thread that recorded anything is gone by now. Writing it out doesn't count
+        // towards the time in the summary.
+        double traceStart = platformSeconds();
+        threadTrace_->add("search", startSeconds, traceStart);
+        if(!trace_->write(params_.traceFilename) && !stop_)
+            sendError(id, "WARNING: Couldn't write the trace to " + params_.traceFilename + "\n");
+        startSeconds += platformSeconds() - traceStart;
+        delete trace_;
+        trace_ = NULL;
+        threadTrace_ = NULL;
+    }
+    if(!stop_)
+        sendSummary(id, startSeconds);
+    if(matchRegex_)
+        pcre_free(matchRegex_);
+    if(bufferRegex_)
+        pcre_free(bufferRegex_);
+    matchRegex_ = NULL;
+    bufferRegex_ = NULL;
+    filespecs_.clear();
+    closeIndexes();
+    matchList_.clear();
+    fileCounts_.clear();
+    filesUpdated_ = -1;
+    delete pokeData_;
+    pokeData_ = NULL;
+    if(observer_)
+        observer_->searchStateChanged(false);
+}
+
+void SearchContext::sendSummary(int id, double startSeconds)
+{
+    SearchStats stats = phaseStats_;
+    stats.totalSeconds = platformSeconds() - startSeconds;
+    stats.directoriesListed = walkerStats_.directoriesListed;
+    stats.filesSearched = filesSearched_;
+    stats.filesWithHits = filesWithHits_;
+    stats.hits = hits_;
+    {
+        PlatformScopedLock lock(mutex_);
+        stats_ = stats;
     }
 
-    PostMessage(window_, WM_SEARCHCONTEXT_STATE, 1, 0);
+    char buffer[512];
+    float sec = (float)stats.totalSeconds;
+    const char *verb = "searched";
+    if(params_.flags & SF_REPLACE)
+        verb = params_.dryRun ? "to update" : "updated";
+    sprintf(buffer, "\n%d hits in %d lines across %d files.\n%d directories scanned, %d files %s, %d files skipped (%3.3f sec)",
+        hits_,
+        linesWithHits_,
+        filesWithHits_,
+        walkerStats_.directoriesListed,
+        filesSearched_,
+        verb,
+        filesSkipped_ + walkerStats_.filesSkipped,
+        sec);
 
-    while(!paths.empty())
+    TextBlockList textBlocks;
+    textBlocks.addBlock(buffer, config_.textColor_);
+    if(binaryFiles_)
+    {
+        bool reported = (config_.binaryFiles_ == BINARY_REPORT) && !(params_.flags & SF_REPLACE);
+        sprintf(buffer, "\n%d binary files %s", binaryFiles_, reported ? "checked for matches only" : "skipped");
+        textBlocks.addBlock(buffer, config_.textColor_);
+    }
+    if(walkerStats_.directoriesCached)
+    {
+        sprintf(buffer, "\n%d directories unchanged since the last search, not listed again", walkerStats_.directoriesCached);
+        textBlocks.addBlock(buffer, config_.textColor_);
+    }
+    if(filesRuledOut_)
+    {
+        sprintf(buffer, "\n%d files ruled out by the index", filesRuledOut_);
+        textBlocks.addBlock(buffer, config_.textColor_);
+    }
+    if(limitReached_)
     {
-        directoriesSearched_++;
-        stopCheck();
+        sprintf(buffer, "\nStopped at the limit of %d hits", params_.maxResults);
+        textBlocks.addBlock(buffer, config_.textColor_);
+    }
+    if(!matchList_.empty())
+        textBlocks.addBlock(describeNeedleHits(), config_.textColor_);
+
+    char writeTime[64] = "";
+    if((params_.flags & SF_REPLACE) && !params_.dryRun)
+        sprintf(writeTime, ", write %3.3f", stats.writeSeconds);
+    sprintf(buffer, "\n%3.1f MB read, %lld lines scanned; list %3.3f, filter %3.3f, read %3.3f, match %3.3f%s, format %3.3f, deliver %3.3f thread sec",
+        stats.bytesRead / (1024.0 * 1024.0),
+        (long long)stats.linesScanned,
+        stats.listSeconds,
+        stats.filterSeconds,
+        stats.readSeconds,
+        stats.matchSeconds,
+        writeTime,
+        stats.formatSeconds,
+        stats.deliverSeconds);
+    textBlocks.addBlock(buffer, config_.textColor_);
+    poke(id, textBlocks, true);
+}
 
-        std::string currentSearchPath = paths.back();
-        std::string currentSearchWildcard = currentSearchPath + "\\*";
+// Keeps the output of a finished search up to date until stop(), searching only what the watcher
+// says changed. Everything happens on the search thread, with a single inline worker.
+void SearchContext::watchFiles(int id, DirectoryWatcher &watcher)
+{
+    filesUpdated_ = 0;
 
-        paths.pop_back();
+    std::set<std::string> pending;
+    unsigned int firstChange = 0; // since pending was last empty
+    unsigned int lastChange = 0;
+    bool progressStale = true;
+    while(!stop_)
+    {
+        StringList changed;
+        bool complete = watcher.wait(WATCH_POLL_MS, changed);
+        bool lost = !watcher.complete();
+        if(!complete || lost)
+        {
+            // Changes got lost (or are about to be); look at everything again, along with whatever
+            // had output before
+            DirectoryWalker walker(params_.paths, (params_.flags & SF_RECURSIVE) != 0, 1, &filespecs_);
+            DirectoryEntry entry;
+            while(!stop_ && (walker.next(entry) == DirectoryWalker::WALK_FILE))
+            {
+                changed.push_back(entry.path);
+            }
 
-        WIN32_FIND_DATA wfd;
-        findHandle = FindFirstFile(currentSearchWildcard.c_str(), &wfd);
-        if(findHandle == INVALID_HANDLE_VALUE)
-            continue;
+            PlatformScopedLock lock(mutex_);
+            changed.insert(changed.end(), files_.begin(), files_.end());
+        }
 
-        while(FindNextFile(findHandle, &wfd))
+        if(!changed.empty())
         {
-            stopCheck();
-            bool isDirectory = ((wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+            if(pending.empty())
+                firstChange = platformTicks();
+            pending.insert(changed.begin(), changed.end());
+            lastChange = platformTicks();
+        }
 
-            if((wfd.cFileName[0] == '.') || (wfd.cFileName[0] == 0))
+        // Once some directory can't be watched, the output can't be kept up to date; it gets brought
+        // up to date one last time, right away
+        if(!pending.empty() && (lost || ((platformTicks() - lastChange) >= WATCH_SETTLE_MS) || ((platformTicks() - firstChange) >= WATCH_MAX_DELAY_MS)))
+        {
+            for(std::set<std::string>::iterator it = pending.begin(); (it != pending.end()) && !stop_; ++it)
             {
-                if(isDirectory)
-                    directoriesSkipped_++;
-                else
-                    filesSkipped_++;
-                continue;
+                updateWatchedPath(id, *it);
             }
+            pending.clear();
+            progressStale = true;
+        }
+        if(lost)
+        {
+            sendError(id, "WARNING: Couldn't watch every directory for changes, stopped watching\n");
+            break;
+        }
+
+        // Pokes are rate limited; keep at it until the latest count actually goes out
+        if(progressStale)
+        {
+            unsigned int previousPoke = lastPoke_;
+            TextBlockList noBlocks;
+            poke(id, noBlocks, false);
+            progressStale = (lastPoke_ == previousPoke);
+        }
+    }
+}
+
+// Whether a search of params_.paths would have looked at path
+bool SearchContext::isWatched(const std::string &path)
+{
+    for(StringList::iterator it = params_.paths.begin(); it != params_.paths.end(); ++it)
+    {
+        const std::string &root = *it;
+        if(path.compare(0, root.length(), root))
+            continue;
+
+        size_t start = root.length();
+        if((start < path.length()) && (path[start] == PLATFORM_PATH_SEPARATOR))
+            start++;
+        else if(!start || (root[start - 1] != PLATFORM_PATH_SEPARATOR))
+            continue; // just a sibling that starts the same way
+        if(start >= path.length())
+            continue;
 
-            std::string filename = currentSearchPath;
-            if(!filename.length() || (filename[filename.length() - 1] != '\\'))
+        // Same rules as DirectoryWalker: no dot-prefixed anything, and only the top level unless recursive
+        bool hidden = (path[start] == '.');
+        bool nested = false;
+        for(size_t i = start; i < path.length(); ++i)
+        {
+            if(path[i] == PLATFORM_PATH_SEPARATOR)
             {
-                filename += "\\";
+                nested = true;
+                if(((i + 1) < path.length()) && (path[i + 1] == '.'))
+                    hidden = true;
             }
-            filename += wfd.cFileName;
+        }
+        if(!hidden && (!nested || (params_.flags & SF_RECURSIVE)))
+            return true;
+    }
+    return false;
+}
+
+void SearchContext::updateWatchedPath(int id, const std::string &path)
+{
+    if(!isWatched(path))
+        return;
 
-            if(isDirectory)
+    DirectoryEntry entry;
+    if(!statPath(path, entry))
+    {
+        removeWatchedPath(id, path);
+        return;
+    }
+
+    if(entry.isDirectory)
+    {
+        // New or renamed directories can show up with files already in them, and those don't
+        // always get notifications of their own
+        if(params_.flags & SF_RECURSIVE)
+        {
+            DirectoryWalker walker(StringList(1, path), true, 1, &filespecs_);
+            DirectoryEntry file;
+            while(!stop_ && (walker.next(file) == DirectoryWalker::WALK_FILE))
             {
-                if(params_.flags & SF_RECURSIVE)
-                    paths.push_back(filename);
+                updateWatchedPath(id, file.path);
             }
-            else
+        }
+        return;
+    }
+
+    size_t separator = path.rfind(PLATFORM_PATH_SEPARATOR);
+    if(!filespecs_.matches(path.substr(0, separator), path.substr(separator + 1)))
+        return;
+
+    SearchJob job;
+    job.filename = path;
+    searchFile(*workers_[0], job);
+    patchFile(id, path, job.results);
+}
+
+// Drops the output of a deleted file, or of every file under a deleted directory
+void SearchContext::removeWatchedPath(int id, const std::string &path)
+{
+    std::set<std::string> filenames;
+    {
+        PlatformScopedLock lock(mutex_);
+        std::string prefix = path + PLATFORM_PATH_SEPARATOR;
+        for(StringList::iterator it = files_.begin(); it != files_.end(); ++it)
+        {
+            if((*it == path) || !it->compare(0, prefix.length(), prefix))
+                filenames.insert(*it);
+        }
+    }
+
+    for(std::set<std::string>::iterator it = filenames.begin(); it != filenames.end(); ++it)
+    {
+        SearchResults noResults;
+        patchFile(id, *it, noResults);
+    }
+}
+
+// Reads every file under each path, same as a search would, and writes out a trigram index for
+// it. Binary files and files big enough to stream are only listed, so searches always open them.
+void SearchContext::indexProc()
+{
+    int id = searchID_;
+
+    walkerStats_.directoriesListed = 0;
+    walkerStats_.directoriesCached = 0;
+    walkerStats_.directoriesSkipped = 0;
+    walkerStats_.filesSkipped = 0;
+    filesSearched_ = 0;
+    filesSkipped_ = 0;
+    filesRuledOut_ = 0;
+    hits_ = 0;
+
+    unsigned int startTick = platformTicks();
+
+    pokeData_ = channel_.acquire();
+
+    if(observer_)
+        observer_->searchStateChanged(true);
+
+    TextBlockList textBlocks;
+    MappedFile file;
+    for(StringList::iterator root = params_.paths.begin(); (root != params_.paths.end()) && !stop_; ++root)
+    {
+        StringList roots(1, *root);
+        TrigramIndexWriter writer(*root);
+        DirectoryManifest manifest;
+        if(config_.directoryManifest_)
+            manifest.open(roots, true);
+        {
+            DirectoryWalker walker(roots, true, config_.walkerThreads_, NULL, config_.directoryManifest_ ? &manifest : NULL);
+            DirectoryEntry entry;
+            while(!stop_)
             {
-                if(searchFile(id, filename, filespecRegexes, matchRegex))
-                {
-                    filesSearched_++;
-                }
-                else
+                DirectoryWalker::State state = walker.next(entry);
+                walkerStats_ = walker.stats();
+                if(state == DirectoryWalker::WALK_DONE)
+                    break;
+
+                TextBlockList noBlocks;
+                if(state == DirectoryWalker::WALK_FILE)
                 {
-                    filesSkipped_++;
-                }
+                    // The index has to remember what the file looks like now
+                    if(entry.fromManifest && !statPath(entry.path, entry))
+                        continue;
 
-                poke(id, TextBlockList(), false);
+                    if(file.open(entry.path, 0, config_.streamAboveKb_) && !looksBinary(file.data(), file.size()))
+                    {
+                        writer.addFile(entry.path, entry.size, entry.modified, file.data(), file.size());
+                        filesSearched_++;
+                    }
+                    else
+                    {
+                        writer.addFile(entry.path, entry.size, entry.modified, NULL, 0);
+                        filesSkipped_++;
+                    }
+                    file.close();
+                }
+                poke(id, noBlocks, false);
             }
         }
+        if(stop_)
+            break;
 
-        if(findHandle != INVALID_HANDLE_VALUE)
+        manifest.save();
+        std::string error;
+        if(writer.write(error))
+        {
+            char buffer[512];
+            sprintf(buffer, "Indexed %d files (%d distinct trigrams) under ", writer.fileCount(), writer.trigramCount());
+            textBlocks.addBlock(buffer + *root + "\n", config_.textColor_);
+        }
+        else
         {
-            FindClose(findHandle);
+            textBlocks.addBlock(error + "\n", RGB(255, 0, 0));
         }
     }
 
-cleanup:
-    for(RegexList::iterator it = filespecRegexes.begin(); it != filespecRegexes.end(); ++it)
-    {
-        pcre_free(*it);
-    }
-    if(matchRegex)
-        pcre_free(matchRegex);
-    filespecRegexes.clear();
     if(!stop_)
     {
-        unsigned int endTick = GetTickCount();
         char buffer[512];
-        float sec = (endTick - startTick) / 1000.0f;
-        const char *verb = "searched";
-        if(params_.flags & SF_REPLACE)
-            verb = "updated";
-        sprintf(buffer, "\n%d hits in %d lines across %d files.\n%d directories scanned, %d files %s, %d files skipped (%3.3f sec)",
-            hits_,
-            linesWithHits_,
-            filesWithHits_,
-            directoriesSearched_,
-            filesSearched_,
-            verb,
-            filesSkipped_,
-            sec);
-
-        TextBlockList textBlocks;
+        sprintf(buffer, "\n%d files read, %d only listed (binary or huge) (%3.3f sec)", filesSearched_, filesSkipped_, (platformTicks() - startTick) / 1000.0f);
         textBlocks.addBlock(buffer, config_.textColor_);
         poke(id, textBlocks, true);
     }
     delete pokeData_;
     pokeData_ = NULL;
-    PostMessage(window_, WM_SEARCHCONTEXT_STATE, 0, 0);
+    if(observer_)
+        observer_->searchStateChanged(false);
 }
 
 // ------------------------------------------------------------------------------------------------
 
 void SearchContext::lock()
 {
-    WaitForSingleObject(mutex_, INFINITE);
+    mutex_.lock();
 }
 
 void SearchContext::unlock()
 {
-    ReleaseMutex(mutex_);
+    mutex_.unlock();
 }
 
 SearchList &SearchContext::list()
@@ -713,28 +2386,38 @@ SearchList &SearchContext::list()
     return list_;
 }
 
+static bool entryEndsBefore(int offset, const SearchEntry &entry)
+{
+    return offset < entry.offset_;
+}
+
+bool SearchContext::findLine(int offset, std::string &filename, int &line)
+{
+    PlatformScopedLock lock(mutex_);
+
+    SearchList::const_iterator it = std::upper_bound(list_.begin(), list_.end(), offset, entryEndsBefore);
+    if((it == list_.end()) || !it->line_)
+        return false;
+
+    filename = files_[it->file_];
+    line = it->line_;
+    return true;
+}
+
 int SearchContext::count()
 {
-    ScopedMutex lock(mutex_);
+    PlatformScopedLock lock(mutex_);
     return list_.size();
 }
 
-int SearchContext::searchID()
+SearchStats SearchContext::stats()
 {
-    ScopedMutex lock(mutex_);
-    return searchID_;
+    PlatformScopedLock lock(mutex_);
+    return stats_;
 }
 
-// ------------------------------------------------------------------------------------------------
-
-void test()
+int SearchContext::searchID()
 {
-    SearchContext *context = new SearchContext((HWND)INVALID_HANDLE_VALUE);
-    SearchParams params;
-    params.paths.push_back("c:\\work\\custom");
-    params.filespecs.push_back("txt");
-    params.filespecs.push_back("elf");
-    context->search(params);
-    Sleep(100);
-    delete context;
+    PlatformScopedLock lock(mutex_);
+    return searchID_;
 }
@@ -8,81 +8,136 @@
 #ifndef SEARCHCONTEXT_H
 #define SEARCHCONTEXT_H
 
-#include <windows.h>
 #include <config.h>
 #include <pcre.h>
 
+#include "Platform.h"
 #include "SearchConfig.h"
-
-#define WM_SEARCHCONTEXT_STATE (WM_USER+1)
-#define WM_SEARCHCONTEXT_POKE (WM_USER+2)
+#include "DirectoryWalker.h"
+#include "FilespecMatcher.h"
+#include "LiteralMatcher.h"
+#include "MultiLiteralMatcher.h"
+#include "MappedFile.h"
+#include "ResultChannel.h"
+#include "SearchTrace.h"
+#include "TrigramIndex.h"
 
 void replaceAll(std::string &s, const char *f, const char *r);
+
+#ifdef _WIN32
 std::string getWindowText(HWND ctrl);
 void setWindowText(HWND ctrl, const std::string &s);
 bool ctrlIsChecked(HWND ctrl);
 void checkCtrl(HWND ctrl, bool checked);
+#endif
 
-class ScopedMutex
-{
-public:
-    ScopedMutex(HANDLE mutex);
-    ~ScopedMutex();
-
-protected:
-    HANDLE mutex_;
-};
-
+// A colored stretch of a TextBlockList's text
 struct TextBlock
 {
-	std::string text;
+    int start;
+    int length;
 	int color;
     bool link;
 };
 
-class TextBlockList : public std::deque<TextBlock>
+// A highlighted stretch of a line of output
+struct TextSpan
+{
+    int offset;
+    int length;
+};
+
+// Output text, along with how to color it. The text is kept in one buffer, so building up a batch
+// of output (and clearing it for reuse) doesn't cost an allocation per block.
+class TextBlockList
 {
 public:
+    std::string text;
+    std::vector<TextBlock> blocks;
+
+    bool empty() const { return blocks.empty(); }
+    void clear() { text.clear(); blocks.clear(); }
+    void swap(TextBlockList &other) { text.swap(other.text); blocks.swap(other.blocks); }
+
     void addBlock(const std::string &text, int color, bool link = false)
     {
-        push_back(TextBlock());
-        TextBlock &lastOne = back();
-        lastOne.text = text;
-        lastOne.color = color;
-        lastOne.link = link;
+        addBlock(text.data(), text.length(), color, link);
     }
 
-	void addHighlightedBlock(const std::string &text, int offset, int count, int textColor, int highlightedColor, bool link = false)
-	{
-		std::string pre = text.substr(0, offset);
-		std::string highlighted = text.substr(offset, count);
-		std::string post = text.substr(offset + count);
+    void addBlock(const char *blockText, size_t length, int color, bool link = false)
+    {
+        TextBlock block;
+        block.start = (int)text.size();
+        block.length = (int)length;
+        block.color = color;
+        block.link = link;
+        blocks.push_back(block);
+        text.append(blockText, length);
+    }
+
+    void append(const TextBlockList &other)
+    {
+        int shift = (int)text.size();
+        text += other.text;
+        for(std::vector<TextBlock>::const_iterator it = other.blocks.begin(); it != other.blocks.end(); ++it)
+        {
+            blocks.push_back(*it);
+            blocks.back().start += shift;
+        }
+    }
 
-		addBlock(pre, textColor);
-		addBlock(highlighted, highlightedColor, link);
-		addBlock(post, textColor);
+	// Highlights any number of spans (in order, not overlapping) in a single pass over text
+	void addHighlightedBlocks(const char *text, int length, const TextSpan *spans, int spanCount, int textColor, int highlightedColor, bool link = false)
+	{
+		int pos = 0;
+		for(int i = 0; i < spanCount; ++i)
+		{
+			addBlock(text + pos, (size_t)(spans[i].offset - pos), textColor);
+			addBlock(text + spans[i].offset, spans[i].length, highlightedColor, link);
+			pos = spans[i].offset + spans[i].length;
+		}
+		addBlock(text + pos, (size_t)(length - pos), textColor);
 	}
 };
 
+// One line of output, or a message. Until it's been appended, its text and highlights live in the
+// SearchResults it came in; after that, only what's needed to find it again means anything.
 class SearchEntry
 {
 public:
     SearchEntry();
     ~SearchEntry();
 
-    std::string filename_;
-    int line_;
-	int offset_;
+    int file_; // index into SearchContext::files_; -1 for messages that aren't about any one file
+    int line_; // 0 for messages
+	int offset_; // where its output ends
 	bool contextOnly_;
+    int color_; // messages only
 
-	TextBlockList textBlocks;
+    int textStart_; // in SearchResults::text
+    int textLength_;
+    int spanStart_; // in SearchResults::spans
+    int spanCount_;
 };
 
 typedef std::vector<SearchEntry> SearchList;
-typedef std::vector<pcre *> RegexList;
+
+// Entries along with their text and highlights, packed into a few buffers so a file's worth of
+// output costs a handful of allocations rather than several per line
+struct SearchResults
+{
+    SearchList entries;
+    std::string text;
+    std::vector<TextSpan> spans;
+
+    SearchEntry &addLine(int line, bool contextOnly, const char *lineText, size_t length);
+    SearchEntry &addMessage(const std::string &message, int color);
+};
 
 struct SearchParams
 {
+    SearchParams();
+
     StringList paths;
     StringList filespecs;
     std::string match;
@@ -90,29 +145,153 @@ struct SearchParams
 	std::string backupExtension;
     s64 maxFileSize;
     int flags;
+    int maxHitsPerFile; // 0 for no limit; SF_FILES_WITH_MATCHES makes it 1
+    int maxResults;     // hits, after which the rest of the search is skipped; 0 for no limit
+    bool dryRun;        // SF_REPLACE shows what it would change, without writing anything
+    std::string traceFilename; // if set, a Chrome trace of the search gets written here at the end
+};
+
+// Where a search's time went. Phase times are summed over every thread that did that kind of
+// work, so with several threads they can add up to more than totalSeconds. Mapped files are paged
+// in as they're matched against, so for those most of the actual reading shows up as matching.
+struct SearchStats
+{
+    SearchStats();
+    void add(const SearchStats &other); // phases and volumes; the counts are filled in at the end
+    std::string json() const;
+
+    double totalSeconds;   // wall clock, start to finish
+    double listSeconds;    // listing directories (or reading them out of a manifest)
+    double filterSeconds;  // weeding listings down to what the filespecs allow
+    double readSeconds;    // opening and mapping files, and reading streamed ones
+    double matchSeconds;   // looking for hits, and gathering up their lines
+    double writeSeconds;   // writing replaced files back out
+    double formatSeconds;  // turning lines into output text
+    double deliverSeconds; // waiting for room to hand output over
+    s64 bytesRead;         // in files that got matched against (not ones sniffed out as binary)
+    s64 linesScanned;      // lines matched one at a time; buffer scans skip past lines with no candidate
+
+    int directoriesListed;
+    int filesSearched;
+    int filesWithHits;
+    int hits;
 };
 
+struct SearchJob
+{
+    SearchJob();
+
+    std::string filename;
+    SearchResults results; // buffered output, appended in enumeration order
+    StringList errors;
+    bool searched;
+    bool done;
+
+    // Only added to the totals when the job's committed, so they always match the output
+    bool matched;
+    bool binary;
+    int linesWithHits;
+    int hits;
+    int firstHitLine; // SF_COUNT_ONLY doesn't keep the lines themselves, just where to find them
+};
+
+// A row of the SF_COUNT_ONLY table
+struct FileCount
+{
+    std::string filename;
+    int hits;
+    int line; // the first hit
+    bool binary;
+};
+
+typedef std::deque<SearchJob *> SearchJobQueue;
+
+// A match that replace swaps for the replacement text, as a byte range of the original file
+struct ReplaceSpan
+{
+    size_t offset;
+    size_t length;
+};
+
+class SearchContext;
+class DirectoryWatcher;
+struct FileScan;
+struct LineSpan;
+
+struct SearchWorker
+{
+    SearchWorker(SearchContext *context);
+    ~SearchWorker();
+
+    SearchContext *context;
+    PlatformThread thread;
+
+    // Scratch buffers, reused from file to file
+    MappedFile file;
+    FileStream stream;
+    std::string window; // for streamed files
+    std::vector<ReplaceSpan> replacements; // only the ones that change something, in file order
+    FileWriter writer;
+
+    // JIT stacks can't be shared between threads, and PCRE hangs the stack off the compiled
+    // code, so every worker studies the match regexes for itself
+    pcre_jit_stack *jitStack;
+    pcre_extra *matchExtra;
+    pcre_extra *bufferExtra;
+
+    std::vector<int> needleHits; // per needle, for match lists
+    SearchStats stats;           // folded into the context's when the worker's stopped
+    TraceBuffer *trace;          // NULL unless the search is being traced
+};
+
+typedef std::vector<SearchWorker *> SearchWorkerList;
+
 struct PokeData // pika, pika!
 {
+    PokeData();
+    void clear();
+
+    int id; // the search it's from; batches from an earlier search are thrown away
+    bool finished; // the search is over, and textBlocks are its summary
     std::string progress;
 
 	TextBlockList textBlocks;
+
+    // Unless patchStart is -1, textBlocks replace patchLength characters of output at patchStart
+    // instead of being appended
+    int patchStart;
+    int patchLength;
+};
+
+// Whoever's driving a SearchContext. Both get called on the search thread; output doesn't come
+// through here at all, it's picked up with receivePoke().
+class SearchObserver
+{
+public:
+    virtual ~SearchObserver() {}
+
+    virtual void searchStateChanged(bool running) = 0;
+    virtual void searchFailed(const std::string &title, const std::string &error) = 0; // the search never started
 };
 
 class SearchContext
 {
 public:
-    SearchContext(HWND window);
+    SearchContext(SearchObserver *observer); // NULL to not hear anything, or publish any output
     ~SearchContext();
 
     void clear();
 
-    void append(int id, SearchEntry &entry);         // takes ownership
+    void append(int id, SearchResults &results);     // takes ownership of the entries
     void search(const SearchParams &params); // copies
     void stop();
     void poke(int id, TextBlockList &textBlocks, bool finished);
+    PokeData *receivePoke();          // UI thread; NULL once it's caught up
+    void recyclePoke(PokeData *poke); // UI thread, when it's done with one
+    void patchFile(int id, const std::string &filename, SearchResults &results); // same
 
-    void makePretty(SearchEntry &entry);
+    std::string displayFilename(const std::string &filename);
+    int makePretty(const SearchResults &results, const SearchEntry &entry, TextBlockList &blocks);
 
 	void sendError(int id, const std::string &error);
 
@@ -120,36 +299,106 @@ public:
     SearchList &list();
     void unlock();
 
+    // Finds the line of output at offset, returning false if it's not a line of a file
+    bool findLine(int offset, std::string &filename, int &line);
+
     int count();
+    int filesWithHits() { return filesWithHits_; } // so far; only final once the search is done
+    int filesSearched() { return filesSearched_; }  // same
+    int hits() { return hits_; }                    // same
+    SearchStats stats(); // of the last search to finish
 
     SearchConfig &config() { return config_; }
     int searchID();
 
     void searchProc();
+    void indexProc();
+    void workerProc(SearchWorker *worker);
 protected:
-    bool searchFile(int id, const std::string &filename, RegexList &filespecRegexes, pcre *matchRegex);
+    bool searchFile(SearchWorker &worker, SearchJob &job);
+    bool findMatch(SearchWorker &worker, const char *line, const char *lineEnd, int &matchPos, int &matchLen, int &needle);
+    const char *scanLine(FileScan &scan, const char *originalLine);
+    void keepUnmatchedLine(FileScan &scan, const LineSpan &span);
+    void skipLines(FileScan &scan, const char *begin, const char *end);
+    const char *findCandidate(FileScan &scan, const char *from, bool &failed);
+    bool canBufferScan(size_t size);
+    void scanRange(FileScan &scan, const char *p, bool bufferScan);
+    void countRange(FileScan &scan, const char *p, bool bufferScan);
+    bool fileHasMatch(FileScan &scan, const char *p, bool bufferScan);
+    void reportBinaryMatch(SearchJob &job);
+    bool streamFile(SearchWorker &worker, SearchJob &job);
+    bool replaceFile(SearchWorker &worker, SearchJob &job);
+    bool publishPoke(int id, bool wait);
 
-    int directoriesSearched_;
-    int directoriesSkipped_;
+    void startWorkers(int count);
+    void prepareWorker(SearchWorker *worker);
+    void stopWorkers();
+    void queueJob(int id, const std::string &filename);
+    void flushJobs(int id, bool waitForAll);
+    void commitJob(int id, SearchJob *job);
+    void limitResults(SearchJob &job);
+    int currentHits();
+    int fileHitLimit();
+    std::string describeNeedleHits();
+    void sendCounts(int id);
+    void sendSummary(int id, double startSeconds);
+    void watchFiles(int id, DirectoryWatcher &watcher);
+    bool isWatched(const std::string &path);
+    void updateWatchedPath(int id, const std::string &path);
+    void removeWatchedPath(int id, const std::string &path);
+    void loadIndexes();
+    bool indexAllows(DirectoryEntry &entry);
+    void closeIndexes();
+
+    DirectoryWalkerStats walkerStats_;
     int filesSearched_;
     int filesSkipped_;
     int filesWithHits_;
     int linesWithHits_;
     int hits_;
+    int binaryFiles_;
+    int filesRuledOut_; // by a trigram index, without being opened
+    int filesUpdated_;  // by SF_WATCH since the search finished, or -1 before then
+    int limitReached_;  // maxResults hits have been committed; everything after gets skipped
+    int contextLines_;  // config_.contextLines_, unless this search doesn't show context
 
-    HWND window_;
+    SearchObserver *observer_;
 
-    HANDLE mutex_;
-    HANDLE thread_;
+    PlatformMutex mutex_;
+    PlatformThread thread_;
     int stop_;
     int searchID_;
     int offset_;
     unsigned int lastPoke_;
-	std::string lastFilename_;
+	int lastFile_;
 	int lastLine_;
-	PokeData *pokeData_;
-    SearchList list_;
+	PokeData *pokeData_; // being filled, until it's published
+    ResultChannel channel_;
+    SearchList list_; // in output order, so offset_ only ever goes up
+    StringList files_; // every file with output, indexed by SearchEntry::file_
     SearchParams params_;
+    FilespecMatcher filespecs_;
+    pcre *matchRegex_;
+    pcre *bufferRegex_; // matchRegex_ for whole-buffer scans; NULL if it has to go line by line
+    LiteralMatcher literal_; // used instead when the match isn't a regex
+    LiteralMatcher requiredLiteral_; // something every regex match contains, if there is such a thing
+    MultiLiteralMatcher matchList_; // used instead of all of the above for SF_MATCH_LIST
+    std::vector<int> needleHits_;
+    std::vector<FileCount> fileCounts_; // SF_COUNT_ONLY's output, until the search is done
+    SearchStats phaseStats_; // the search thread's own, plus every stopped worker's
+    SearchStats stats_;      // finished, under mutex_
+    SearchTrace *trace_;        // only while a traced search is running
+    TraceBuffer *threadTrace_;  // the search thread's part of it
+    std::vector<TrigramIndex *> indexes_; // for the roots that have one
+
+    // Worker pool; with zero worker threads, jobs run inline on the search thread
+    PlatformMutex jobMutex_;
+    PlatformSemaphore jobSemaphore_;
+    PlatformEvent jobDoneEvent_;
+    int workerThreads_;
+    SearchWorkerList workers_;
+    SearchJobQueue pendingJobs_; // not yet claimed by a worker
+    SearchJobQueue orderedJobs_; // everything not yet committed, in enumeration order
     SearchConfig config_;
 };
 
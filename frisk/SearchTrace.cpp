@@ -0,0 +1,125 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "SearchTrace.h"
+#include "SearchConfig.h"
+
+#include <stdio.h>
+#include <set>
+
+#define TRACE_PROCESS_ID (1) // there's only ever the one
+
+// ------------------------------------------------------------------------------------------------
+
+void TraceBuffer::add(const char *name, double start, double end, const std::string &detail)
+{
+    events.push_back(TraceEvent());
+    TraceEvent &event = events.back();
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.detail = detail;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+SearchTrace::SearchTrace()
+: start_(platformSeconds())
+{
+}
+
+SearchTrace::~SearchTrace()
+{
+    for(std::vector<TraceBuffer *>::iterator it = buffers_.begin(); it != buffers_.end(); ++it)
+    {
+        delete *it;
+    }
+}
+
+TraceBuffer *SearchTrace::createBuffer(const char *threadName)
+{
+    TraceBuffer *buffer = new TraceBuffer;
+    buffer->threadId = platformThreadId();
+    buffer->threadName = threadName;
+
+    PlatformScopedLock lock(mutex_);
+    buffers_.push_back(buffer);
+    return buffer;
+}
+
+// Appends s as a JSON string, quotes and all
+static void appendJsonString(std::string &out, const std::string &s)
+{
+    out += '"';
+    for(std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+    {
+        unsigned char c = (unsigned char)*it;
+        if((c == '"') || (c == '\\'))
+        {
+            out += '\\';
+            out += (char)c;
+        }
+        else if(c < 0x20)
+        {
+            char escaped[8];
+            sprintf(escaped, "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+// Written out by hand rather than built up in cJSON first; a big search has hundreds of thousands
+// of events, and a tree of them costs more than the search did
+bool SearchTrace::write(const std::string &filename)
+{
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    char buffer[256];
+    bool first = true;
+    std::set<unsigned int> namedThreads;
+    for(std::vector<TraceBuffer *>::iterator it = buffers_.begin(); it != buffers_.end(); ++it)
+    {
+        TraceBuffer *thread = *it;
+
+        // Names the thread's track; a thread can have more than one buffer, but only one name
+        if(namedThreads.insert(thread->threadId).second)
+        {
+            sprintf(buffer, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",", TRACE_PROCESS_ID, thread->threadId);
+            out += buffer;
+            appendJsonString(out, thread->threadName);
+            out += "}}";
+            first = false;
+        }
+
+        for(std::vector<TraceEvent>::iterator event = thread->events.begin(); event != thread->events.end(); ++event)
+        {
+            // Microseconds from the start of the search
+            sprintf(buffer, "%s\n{\"name\":\"%s\",\"cat\":\"frisk\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+                first ? "" : ",",
+                event->name,
+                (event->start - start_) * 1000000.0,
+                (event->end - event->start) * 1000000.0,
+                TRACE_PROCESS_ID,
+                thread->threadId);
+            out += buffer;
+            if(!event->detail.empty())
+            {
+                out += ",\"args\":{\"path\":";
+                appendJsonString(out, event->detail);
+                out += '}';
+            }
+            out += '}';
+            first = false;
+        }
+    }
+    out += "\n]}\n";
+    return writeEntireFile(filename, out);
+}
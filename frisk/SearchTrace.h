@@ -0,0 +1,91 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef SEARCHTRACE_H
+#define SEARCHTRACE_H
+
+#include "Platform.h"
+
+#include <vector>
+
+// One span of work on one thread, in platformSeconds()
+struct TraceEvent
+{
+    const char *name; // always a string literal
+    double start;
+    double end;
+    std::string detail; // the file or directory it was about, if any
+};
+
+// A single thread's events. Only its own thread ever adds to it, so nothing gets locked.
+struct TraceBuffer
+{
+    unsigned int threadId;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+
+    void add(const char *name, double start, double end, const std::string &detail = std::string());
+};
+
+// Adds a span covering its own lifetime to buffer, if there is one
+class TraceSpan
+{
+public:
+    TraceSpan(TraceBuffer *buffer, const char *name, const std::string &detail = std::string())
+    : buffer_(buffer)
+    , name_(name)
+    , start_(0)
+    {
+        if(buffer_)
+        {
+            detail_ = detail;
+            start_ = platformSeconds();
+        }
+    }
+
+    ~TraceSpan()
+    {
+        if(buffer_)
+            buffer_->add(name_, start_, platformSeconds(), detail_);
+    }
+
+protected:
+    TraceBuffer *buffer_;
+    const char *name_;
+    std::string detail_;
+    double start_;
+
+private:
+    TraceSpan(const TraceSpan &);
+    TraceSpan &operator=(const TraceSpan &);
+};
+
+// Everything one search recorded, one buffer per thread that took part. Written out as Chrome
+// trace-event JSON, which chrome://tracing and Perfetto (ui.perfetto.dev) both open.
+class SearchTrace
+{
+public:
+    SearchTrace();
+    ~SearchTrace();
+
+    // A buffer for the calling thread, good until the trace is destroyed
+    TraceBuffer *createBuffer(const char *threadName);
+
+    // Only once every thread with a buffer is done with it
+    bool write(const std::string &filename);
+
+protected:
+    PlatformMutex mutex_;
+    std::vector<TraceBuffer *> buffers_;
+    double start_;
+
+private:
+    SearchTrace(const SearchTrace &);
+    SearchTrace &operator=(const SearchTrace &);
+};
+
+#endif
@@ -0,0 +1,92 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "TextScan.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define TEXTSCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+int countNewlines(const char *begin, const char *end)
+{
+    int count = 0;
+    const char *p = begin;
+
+#ifdef TEXTSCAN_SSE2
+    const __m128i newlines = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while((end - p) >= 16)
+    {
+        // Each byte lane counts its own newlines; flush before any lane can wrap at 255
+        __m128i counts = _mm_setzero_si128();
+        int rounds = 0;
+        while(((end - p) >= 16) && (rounds < 255))
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(chunk, newlines));
+            p += 16;
+            rounds++;
+        }
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+#endif
+
+    for(; p < end; ++p)
+    {
+        if(*p == '\n')
+            count++;
+    }
+    return count;
+}
+
+const char *findLineStart(const char *begin, const char *pos)
+{
+    while(pos > begin)
+    {
+        if(pos[-1] == '\n')
+            break;
+        pos--;
+    }
+    return pos;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+#define BINARY_SNIFF_SIZE (8 * 1024)
+
+bool looksBinary(const char *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + ((size < BINARY_SNIFF_SIZE) ? size : BINARY_SNIFF_SIZE);
+
+    if(((end - p) >= 2) && (((p[0] == 0xFF) && (p[1] == 0xFE)) || ((p[0] == 0xFE) && (p[1] == 0xFF))))
+        return false; // UTF-16 (or UTF-32 LE, which starts the same way)
+    if(((end - p) >= 4) && !p[0] && !p[1] && (p[2] == 0xFE) && (p[3] == 0xFF))
+        return false; // UTF-32 BE
+    if(((end - p) >= 3) && (p[0] == 0xEF) && (p[1] == 0xBB) && (p[2] == 0xBF))
+        p += 3;
+
+    // Tabs, newlines, form feeds, backspaces and escapes (ANSI colors in logs) are all fair game
+    // in text; high bytes could be any encoding, so they're fine too
+    size_t sniffed = end - p;
+    size_t suspicious = 0;
+    for(; p < end; ++p)
+    {
+        unsigned char c = *p;
+        if(c >= 0x20)
+            continue;
+        if(!c)
+            return true;
+        if((c != '\t') && (c != '\n') && (c != '\r') && (c != '\f') && (c != '\v') && (c != '\b') && (c != 0x1b))
+            suspicious++;
+    }
+    return (suspicious * 10) > sniffed;
+}
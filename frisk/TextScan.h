@@ -0,0 +1,24 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef TEXTSCAN_H
+#define TEXTSCAN_H
+
+#include <stddef.h>
+
+// Number of '\n' bytes in [begin, end)
+int countNewlines(const char *begin, const char *end);
+
+// Start of the line containing pos, without looking back past begin
+const char *findLineStart(const char *begin, const char *pos);
+
+// Guesses whether a file is binary from its first few KB: any NUL byte, or more than a handful of
+// control characters that text doesn't use. A UTF-8 byte order mark is skipped over; UTF-16 and
+// UTF-32 ones (which come with plenty of NULs) mean text.
+bool looksBinary(const char *data, size_t size);
+
+#endif
@@ -0,0 +1,470 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "TrigramIndex.h"
+#include "DirectoryWalker.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#define TRIGRAM_INDEX_VERSION (1)
+#define TRIGRAM_COUNT (1 << 24)
+
+// A file modified this close to when the index was written could change again within the same
+// timestamp tick, keeping its size and modified time. Those never get their trigrams trusted.
+#define RACY_SECONDS (2)
+
+// On disk layout, in native byte order (the index is a local cache, not an interchange format):
+// header, files, trigrams, path order, postings, names. Everything is 8 byte aligned up to the
+// path order, so the mapped tables can be used in place.
+struct TrigramIndexHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int fileCount;
+    unsigned int trigramCount;
+    unsigned int reserved;
+    s64 filesOffset;
+    s64 trigramsOffset;
+    s64 pathOrderOffset;
+    s64 postingsOffset;
+    s64 postingsSize;
+    s64 namesOffset;
+    s64 namesSize;
+};
+
+enum TrigramIndexFileFlag
+{
+    TIF_INDEXED = (1 << 0) // trigrams were collected; without this the file is always a candidate
+};
+
+struct TrigramIndexFile
+{
+    s64 nameOffset; // into names, relative to the root
+    s64 size;
+    s64 modified;
+    unsigned int flags;
+    unsigned int reserved;
+};
+
+struct TrigramIndexTrigram
+{
+    unsigned int trigram;
+    unsigned int count;
+    s64 offset; // into postings
+};
+
+static const char indexMagic[8] = { 'F', 'R', 'I', 'S', 'K', 'I', 'D', 'X' };
+
+static inline unsigned char foldByte(unsigned char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+// Distinct folded trigrams in [data, data + length)
+static void collectTrigrams(const char *data, size_t length, std::vector<unsigned int> &trigrams)
+{
+    trigrams.clear();
+    unsigned int trigram = 0;
+    for(size_t i = 0; i < length; ++i)
+    {
+        trigram = ((trigram << 8) | foldByte((unsigned char)data[i])) & (TRIGRAM_COUNT - 1);
+        if(i >= 2)
+            trigrams.push_back(trigram);
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+}
+
+static void appendVarint(std::string &s, unsigned int value)
+{
+    while(value >= 0x80)
+    {
+        s += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    s += (char)value;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+TrigramIndexWriter::TrigramIndexWriter(const std::string &root)
+: root_(root)
+, prefix_(joinPath(root, ""))
+, seen_(TRIGRAM_COUNT / 8, 0)
+{
+}
+
+void TrigramIndexWriter::addFile(const std::string &path, s64 size, s64 modified, const char *data, size_t length)
+{
+    if(path.compare(0, prefix_.length(), prefix_) != 0)
+        return;
+
+    unsigned int id = (unsigned int)files_.size();
+    files_.push_back(File());
+    File &file = files_.back();
+    file.name = path.substr(prefix_.length());
+    file.size = size;
+    file.modified = modified;
+    file.indexed = (data != NULL);
+    if(!data)
+        return;
+
+    // A bitmap beats sorting here; most files repeat most of their trigrams many times over
+    unsigned int trigram = 0;
+    for(size_t i = 0; i < length; ++i)
+    {
+        trigram = ((trigram << 8) | foldByte((unsigned char)data[i])) & (TRIGRAM_COUNT - 1);
+        if(i < 2)
+            continue;
+
+        unsigned char &bits = seen_[trigram >> 3];
+        unsigned char bit = (unsigned char)(1 << (trigram & 7));
+        if(!(bits & bit))
+        {
+            bits |= bit;
+            touched_.push_back(trigram);
+        }
+    }
+
+    for(std::vector<unsigned int>::iterator it = touched_.begin(); it != touched_.end(); ++it)
+    {
+        Postings &postings = postings_[*it];
+        appendVarint(postings.deltas, id - postings.last);
+        postings.last = id;
+        postings.count++;
+        seen_[*it >> 3] = 0;
+    }
+    touched_.clear();
+}
+
+struct NameOrder
+{
+    NameOrder(const std::vector<std::string> &names) : names_(names) {}
+    bool operator()(unsigned int a, unsigned int b) const { return names_[a] < names_[b]; }
+
+    const std::vector<std::string> &names_;
+};
+
+bool TrigramIndexWriter::write(std::string &error)
+{
+    std::string filename = joinPath(root_, TRIGRAM_INDEX_FILENAME);
+    std::string tempFilename = filename + ".tmp";
+
+    unsigned int fileCount = (unsigned int)files_.size();
+    std::vector<unsigned int> trigrams;
+    trigrams.reserve(postings_.size());
+    for(std::unordered_map<unsigned int, Postings>::const_iterator it = postings_.begin(); it != postings_.end(); ++it)
+    {
+        trigrams.push_back(it->first);
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+
+    TrigramIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.version = TRIGRAM_INDEX_VERSION;
+    header.fileCount = fileCount;
+    header.trigramCount = (unsigned int)trigrams.size();
+    header.filesOffset = sizeof(header);
+    header.trigramsOffset = header.filesOffset + (s64)fileCount * sizeof(TrigramIndexFile);
+    header.pathOrderOffset = header.trigramsOffset + (s64)trigrams.size() * sizeof(TrigramIndexTrigram);
+    header.postingsOffset = header.pathOrderOffset + (s64)fileCount * sizeof(unsigned int);
+    for(std::vector<unsigned int>::iterator it = trigrams.begin(); it != trigrams.end(); ++it)
+    {
+        header.postingsSize += postings_[*it].deltas.length();
+    }
+    header.namesOffset = header.postingsOffset + header.postingsSize;
+
+    std::vector<TrigramIndexFile> fileRecords(fileCount);
+    std::vector<std::string> names(fileCount);
+    for(unsigned int i = 0; i < fileCount; ++i)
+    {
+        TrigramIndexFile &record = fileRecords[i];
+        memset(&record, 0, sizeof(record));
+        record.nameOffset = header.namesSize;
+        record.size = files_[i].size;
+        record.modified = files_[i].modified;
+        record.flags = files_[i].indexed ? TIF_INDEXED : 0;
+        header.namesSize += files_[i].name.length() + 1;
+        names[i].swap(files_[i].name);
+    }
+
+    std::vector<unsigned int> pathOrder(fileCount);
+    for(unsigned int i = 0; i < fileCount; ++i)
+    {
+        pathOrder[i] = i;
+    }
+    std::sort(pathOrder.begin(), pathOrder.end(), NameOrder(names));
+
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if(!f)
+    {
+        error = "Can't write " + tempFilename;
+        return false;
+    }
+
+    // The new file's own timestamp is "now" by the same clock (and to the same tick) as every file's;
+    // if it can't be had, nothing is trusted
+    DirectoryEntry info;
+    s64 racyAfter = statPath(tempFilename, info) ? (info.modified - (RACY_SECONDS * MODIFIED_TICKS_PER_SECOND)) : 0;
+    for(unsigned int i = 0; i < fileCount; ++i)
+    {
+        if(fileRecords[i].modified >= racyAfter)
+            fileRecords[i].flags &= ~TIF_INDEXED;
+    }
+
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+    if(ok && fileCount)
+        ok = (fwrite(&fileRecords[0], sizeof(TrigramIndexFile), fileCount, f) == fileCount);
+    s64 postingsOffset = 0;
+    for(std::vector<unsigned int>::iterator it = trigrams.begin(); ok && (it != trigrams.end()); ++it)
+    {
+        const Postings &postings = postings_[*it];
+        TrigramIndexTrigram record;
+        record.trigram = *it;
+        record.count = postings.count;
+        record.offset = postingsOffset;
+        postingsOffset += postings.deltas.length();
+        ok = (fwrite(&record, sizeof(record), 1, f) == 1);
+    }
+    if(ok && fileCount)
+        ok = (fwrite(&pathOrder[0], sizeof(unsigned int), fileCount, f) == fileCount);
+    for(std::vector<unsigned int>::iterator it = trigrams.begin(); ok && (it != trigrams.end()); ++it)
+    {
+        const std::string &deltas = postings_[*it].deltas;
+        ok = (fwrite(deltas.data(), 1, deltas.length(), f) == deltas.length());
+    }
+    for(unsigned int i = 0; ok && (i < fileCount); ++i)
+    {
+        ok = (fwrite(names[i].c_str(), 1, names[i].length() + 1, f) == (names[i].length() + 1));
+    }
+    if(fclose(f) != 0)
+        ok = false;
+
+    if(!ok || !platformReplaceFile(tempFilename, filename))
+    {
+        remove(tempFilename.c_str());
+        error = "Can't write " + filename;
+        return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+TrigramIndex::TrigramIndex()
+: header_(NULL)
+, files_(NULL)
+, pathOrder_(NULL)
+, trigrams_(NULL)
+, postings_(NULL)
+, names_(NULL)
+, narrowed_(false)
+{
+}
+
+static bool sectionFits(s64 offset, s64 size, size_t fileSize)
+{
+    return (offset >= 0) && (size >= 0) && (offset <= (s64)fileSize) && (size <= ((s64)fileSize - offset));
+}
+
+bool TrigramIndex::load(const std::string &root)
+{
+    close();
+
+    if(!file_.open(joinPath(root, TRIGRAM_INDEX_FILENAME), 0))
+        return false;
+
+    const char *data = file_.data();
+    size_t size = file_.size();
+    const TrigramIndexHeader *header = (const TrigramIndexHeader *)data;
+    if((size < sizeof(TrigramIndexHeader))
+    || memcmp(header->magic, indexMagic, sizeof(indexMagic))
+    || (header->version != TRIGRAM_INDEX_VERSION)
+    || !sectionFits(header->filesOffset, (s64)header->fileCount * sizeof(TrigramIndexFile), size)
+    || !sectionFits(header->trigramsOffset, (s64)header->trigramCount * sizeof(TrigramIndexTrigram), size)
+    || !sectionFits(header->pathOrderOffset, (s64)header->fileCount * sizeof(unsigned int), size)
+    || !sectionFits(header->postingsOffset, header->postingsSize, size)
+    || !sectionFits(header->namesOffset, header->namesSize, size)
+    || (header->namesSize && data[header->namesOffset + header->namesSize - 1]))
+    {
+        file_.close();
+        return false;
+    }
+
+    root_ = root;
+    prefix_ = joinPath(root, "");
+    header_ = header;
+    files_ = (const TrigramIndexFile *)(data + header->filesOffset);
+    trigrams_ = (const TrigramIndexTrigram *)(data + header->trigramsOffset);
+    pathOrder_ = (const unsigned int *)(data + header->pathOrderOffset);
+    postings_ = (const unsigned char *)(data + header->postingsOffset);
+    names_ = data + header->namesOffset;
+    return true;
+}
+
+void TrigramIndex::close()
+{
+    file_.close();
+    header_ = NULL;
+    files_ = NULL;
+    pathOrder_ = NULL;
+    trigrams_ = NULL;
+    postings_ = NULL;
+    names_ = NULL;
+    narrowed_ = false;
+    candidates_.clear();
+}
+
+int TrigramIndex::findFile(const char *name) const
+{
+    unsigned int low = 0;
+    unsigned int high = header_->fileCount;
+    while(low < high)
+    {
+        unsigned int middle = low + ((high - low) / 2);
+        unsigned int id = pathOrder_[middle];
+        if(id >= header_->fileCount)
+            return -1;
+        s64 nameOffset = files_[id].nameOffset;
+        if((nameOffset < 0) || (nameOffset >= header_->namesSize))
+            return -1;
+
+        int cmp = strcmp(names_ + nameOffset, name);
+        if(cmp == 0)
+            return (int)id;
+        if(cmp < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return -1;
+}
+
+const TrigramIndexTrigram *TrigramIndex::findTrigram(unsigned int trigram) const
+{
+    unsigned int low = 0;
+    unsigned int high = header_->trigramCount;
+    while(low < high)
+    {
+        unsigned int middle = low + ((high - low) / 2);
+        const TrigramIndexTrigram *record = &trigrams_[middle];
+        if(record->trigram == trigram)
+            return record;
+        if(record->trigram < trigram)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return NULL;
+}
+
+void TrigramIndex::readPostings(const TrigramIndexTrigram *record, std::vector<unsigned int> &ids) const
+{
+    ids.clear();
+    if((record->offset < 0) || (record->offset > header_->postingsSize))
+        return;
+
+    const unsigned char *p = postings_ + record->offset;
+    const unsigned char *end = postings_ + header_->postingsSize;
+    unsigned int id = 0;
+    for(unsigned int i = 0; (i < record->count) && (p < end); ++i)
+    {
+        unsigned int delta = 0;
+        int shift = 0;
+        while((p < end) && (*p & 0x80) && (shift < 28))
+        {
+            delta |= (unsigned int)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        if(p == end)
+            break;
+        delta |= (unsigned int)(*p++) << shift;
+
+        id += delta;
+        if(id >= header_->fileCount)
+            break;
+        ids.push_back(id);
+    }
+}
+
+static bool fewerPostings(const TrigramIndexTrigram *a, const TrigramIndexTrigram *b)
+{
+    return a->count < b->count;
+}
+
+bool TrigramIndex::select(const StringList &needles)
+{
+    narrowed_ = false;
+    candidates_.clear();
+    if(!header_ || needles.empty())
+        return false;
+
+    for(StringList::const_iterator it = needles.begin(); it != needles.end(); ++it)
+    {
+        if(it->length() < 3)
+            return false;
+    }
+
+    candidates_.assign(header_->fileCount, 0);
+    std::vector<unsigned int> trigrams;
+    std::vector<const TrigramIndexTrigram *> records;
+    std::vector<unsigned int> ids;
+    std::vector<unsigned int> otherIds;
+    std::vector<unsigned int> common;
+    for(StringList::const_iterator it = needles.begin(); it != needles.end(); ++it)
+    {
+        // Files with every one of the needle's trigrams, starting from the rarest
+        collectTrigrams(it->data(), it->length(), trigrams);
+        records.clear();
+        for(std::vector<unsigned int>::iterator trigram = trigrams.begin(); trigram != trigrams.end(); ++trigram)
+        {
+            const TrigramIndexTrigram *record = findTrigram(*trigram);
+            if(!record)
+                break;
+            records.push_back(record);
+        }
+        if(records.size() != trigrams.size())
+            continue; // no indexed file has it at all
+
+        std::sort(records.begin(), records.end(), fewerPostings);
+        readPostings(records[0], ids);
+        for(size_t i = 1; (i < records.size()) && !ids.empty(); ++i)
+        {
+            readPostings(records[i], otherIds);
+            common.clear();
+            std::set_intersection(ids.begin(), ids.end(), otherIds.begin(), otherIds.end(), std::back_inserter(common));
+            ids.swap(common);
+        }
+
+        for(std::vector<unsigned int>::iterator id = ids.begin(); id != ids.end(); ++id)
+        {
+            candidates_[*id] = 1;
+        }
+    }
+
+    narrowed_ = true;
+    return true;
+}
+
+bool TrigramIndex::isCandidate(const std::string &path, s64 size, s64 modified) const
+{
+    if(!narrowed_ || (path.compare(0, prefix_.length(), prefix_) != 0))
+        return true;
+
+    int id = findFile(path.c_str() + prefix_.length());
+    if(id < 0)
+        return true;
+
+    const TrigramIndexFile &file = files_[id];
+    if(!(file.flags & TIF_INDEXED) || (file.size != size) || (file.modified != modified))
+        return true;
+    return candidates_[id] != 0;
+}
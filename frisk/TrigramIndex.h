@@ -0,0 +1,104 @@
+// ---------------------------------------------------------------------------
+//                   Copyright Joe Drago 2012.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#ifndef TRIGRAMINDEX_H
+#define TRIGRAMINDEX_H
+
+#include "SearchConfig.h"
+#include "MappedFile.h"
+
+#include <unordered_map>
+
+// Lives in the root it covers. Dot-prefixed, so the walker never hands it out as a file.
+#define TRIGRAM_INDEX_FILENAME ".friskindex"
+
+struct TrigramIndexHeader;
+struct TrigramIndexFile;
+struct TrigramIndexTrigram;
+
+// Accumulates every distinct (ASCII case folded) 3 byte sequence of each file under a root, and
+// writes them out as sorted posting lists, codesearch style. Files are expected in walk order,
+// with paths that start with the root.
+class TrigramIndexWriter
+{
+public:
+    TrigramIndexWriter(const std::string &root);
+
+    // data is NULL for files that weren't read (binary, too big, unreadable); those are always
+    // searched
+    void addFile(const std::string &path, s64 size, s64 modified, const char *data, size_t length);
+    bool write(std::string &error);
+
+    int fileCount() const { return (int)files_.size(); }
+    int trigramCount() const { return (int)postings_.size(); }
+
+protected:
+    struct File
+    {
+        std::string name; // relative to the root
+        s64 size;
+        s64 modified;
+        bool indexed;
+    };
+
+    struct Postings
+    {
+        Postings() : count(0), last(0) {}
+
+        std::string deltas; // varint file id deltas
+        unsigned int count;
+        unsigned int last;
+    };
+
+    std::string root_;
+    std::string prefix_; // root_ plus a separator; stripped from every path
+    std::vector<File> files_;
+    std::unordered_map<unsigned int, Postings> postings_;
+    std::vector<unsigned char> seen_;   // one bit per trigram, for the file being added
+    std::vector<unsigned int> touched_; // set bits in seen_
+};
+
+// Read side, memory mapped. Once select() has been told what's being searched for, isCandidate()
+// says whether a file found while walking could possibly contain it. Anything the index can't vouch
+// for (not in it, changed size or timestamp since, never read, or modified too close to when the
+// index was written to be sure of) is always a candidate, so a stale index only ever costs speed.
+class TrigramIndex
+{
+public:
+    TrigramIndex();
+
+    bool load(const std::string &root);
+    void close();
+
+    bool loaded() const { return header_ != NULL; }
+    const std::string &root() const { return root_; }
+
+    // Marks the files that could contain at least one of needles. Returns false (and leaves every
+    // file a candidate) if that can't be narrowed down, i.e. a needle is shorter than 3 bytes.
+    bool select(const StringList &needles);
+
+    bool isCandidate(const std::string &path, s64 size, s64 modified) const;
+
+protected:
+    int findFile(const char *name) const;
+    const TrigramIndexTrigram *findTrigram(unsigned int trigram) const;
+    void readPostings(const TrigramIndexTrigram *record, std::vector<unsigned int> &ids) const;
+
+    std::string root_;
+    std::string prefix_;
+    MappedFile file_;
+    const TrigramIndexHeader *header_;
+    const TrigramIndexFile *files_;
+    const unsigned int *pathOrder_; // file ids sorted by name
+    const TrigramIndexTrigram *trigrams_;
+    const unsigned char *postings_;
+    const char *names_;
+    bool narrowed_;
+    std::vector<unsigned char> candidates_; // per file id
+};
+
+#endif
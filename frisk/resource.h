@@ -36,6 +36,13 @@
 #define IDC_TRIM_FILENAMES                      1032
 #define IDC_BACKUP                              1033
 #define IDC_DELETE                              1035
+#define IDC_MATCH_LIST                          1036
+#define IDC_BUILD_INDEX                         1037
+#define IDC_WATCH                               1038
+#define IDC_FILES_WITH_MATCHES                  1039
+#define IDC_MAX_HITS_PER_FILE                   1040
+#define IDC_MAX_RESULTS                         1041
+#define IDC_COUNT_ONLY                          1042
 #define IDC_COLOR_CONTEXT                       40000
 #define IDC_FONT_DESC                           40001
 #define IDC_FONT                                40002